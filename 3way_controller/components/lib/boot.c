@@ -0,0 +1,110 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "libconfig.h"
+#include "libdecls.h"
+
+/*
+ * Boot sequencing.
+ *
+ * Rather than bringing things up one after another, boot is described as a table of stages
+ * (see main.c), each of which says which other stages it needs.  We start each stage as soon
+ * as everything it needs is done, so that (for instance) the heater is under control right
+ * away, from the stored schedule and last known temperature, while we are still waiting for
+ * WIFI to connect.
+ *
+ * A stage's start function either does its work and returns 0, or starts something that
+ * will finish later, returns 1, and calls boot_stage_done when it is finished.
+ *
+ * We remember when each stage started and finished; the console "boot" command shows them.
+ */
+
+static const char *TAG = "boot";
+
+#define MAX_BOOT_STAGES 16
+
+static EventGroupHandle_t boot_events = NULL;
+static const struct boot_stage *stages = NULL;
+static int stage_count = 0;
+static int64_t started[MAX_BOOT_STAGES];    // esp_timer time; 0 if not yet
+static int64_t finished[MAX_BOOT_STAGES];
+static int64_t boot_complete = 0;
+
+void boot_stage_done(int bit) {
+    int64_t now = esp_timer_get_time();
+    for(int i = 0; i < stage_count; i++) {
+        if (stages[i].provides == bit && finished[i] == 0) {
+            finished[i] = now;
+        }
+    }
+    xEventGroupSetBits(boot_events, bit);
+}
+
+/*
+ * Run the stages in table, in whatever order their dependencies allow, and return
+ * once they are all done.
+ */
+void run_boot(const struct boot_stage *table, int count) {
+    EventBits_t all = 0;
+
+    if (count > MAX_BOOT_STAGES) {
+        ESP_LOGE(TAG, "Too many boot stages; ignoring the last %d", count - MAX_BOOT_STAGES);
+        count = MAX_BOOT_STAGES;
+    }
+    boot_events = xEventGroupCreate();
+    stages = table;
+    stage_count = count;
+    for(int i = 0; i < count; i++) {
+        all |= table[i].provides;
+    }
+
+    while (1) {
+        EventBits_t done = xEventGroupGetBits(boot_events);
+        int progress = 0;
+
+        if ((done & all) == all) {
+            break;
+        }
+        for(int i = 0; i < count; i++) {
+            if (started[i] == 0 && (table[i].needs & done) == table[i].needs) {
+                started[i] = esp_timer_get_time();
+                if (table[i].start() == 0) {
+                    boot_stage_done(table[i].provides);
+                }
+                progress = 1;
+            }
+        }
+        if (!progress) {
+            // Wait for one of the stages still running to finish
+            xEventGroupWaitBits(boot_events, all & ~done, pdFALSE, pdFALSE, portMAX_DELAY);
+        }
+    }
+
+    boot_complete = esp_timer_get_time();
+    LOGI(TAG, "Boot complete in %d ms", (int)(boot_complete / 1000));
+}
+
+int boot_is_complete() {
+    return boot_complete != 0;
+}
+
+void report_boot_times() {
+    for(int i = 0; i < stage_count; i++) {
+        if (started[i] == 0) {
+            send_messagef(0, "%-10s waiting", stages[i].name);
+        }
+        else if (finished[i] == 0) {
+            send_messagef(0, "%-10s started %6d ms, not done", stages[i].name, (int)(started[i] / 1000));
+        }
+        else {
+            send_messagef(0, "%-10s started %6d ms, done %6d ms (%d ms)", stages[i].name,
+                (int)(started[i] / 1000), (int)(finished[i] / 1000), (int)((finished[i] - started[i]) / 1000));
+        }
+    }
+    if (boot_complete) {
+        send_messagef(0, "boot complete %d ms", (int)(boot_complete / 1000));
+    }
+}
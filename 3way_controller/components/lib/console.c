@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_log.h"
@@ -8,14 +9,259 @@
 #include "libdecls.h"
 
 // Handle requests from the console
+//
+// A request datagram looks like
+//     [#<id>] <command> [args] [; <command> [args] ...]
+// Commands may be separated by semicolons or newlines.  If an id is given, every reply line
+// is prefixed with "#<id> " and the reply ends with an "#<id> ok" or "#<id> err" line.
+// Replies are sent straight back to whoever sent the request (see messages.c).
 
 static const char *TAG = "console";
 
-int recieve_command(void *buf, int len) {
-    char *cbuf = (char *)buf, *cmd, *args;
-    cbuf[len] = 0;
-    LOGI(TAG, "Received command |%s|", cbuf);
+// Parsed arguments.  Each argument is stored by position, in ival or word
+// depending on its type in the command's schema.
+#define MAX_COMMAND_ARGS 3
+#define WORD_LEN 32
+
+struct command_args {
+    int ival[MAX_COMMAND_ARGS];
+    char word[MAX_COMMAND_ARGS][WORD_LEN];
+    const char *rest;
+};
+
+struct command {
+    const char *name;
+    // One character per argument:  i = integer, I = optional integer (0 if it isn't there),
+    // w = word, s = rest of the line
+    const char *schema;
+    int (*handler)(struct command_args *args);
+    const char *help;
+};
 
+
+/*
+ * Command handlers.  Return 0 on success, -1 if the command was refused.
+ */
+
+static int cmd_boot(struct command_args *args) {
+    report_boot_times();
+    return 0;
+}
+
+static int cmd_bump(struct command_args *args) {
+    bump_temperature(args->ival[0], args->ival[1]);
+    return 0;
+}
+
+static int cmd_errtest(struct command_args *args) {
+    // Generate a bunch of errors so we can see the behavior of the error handler
+    for(int i=0; i<100; i++) {
+        LOGE(TAG,"Test error %d", i);
+    }
+    return 0;
+}
+
+static int cmd_hello(struct command_args *args) {
+    send_message(0,"hello back");
+    return 0;
+}
+
+static int cmd_history(struct command_args *args) {
+    send_history(args->ival[0], args->ival[1]);     // to now, if no second argument
+    return 0;
+}
+
+static int cmd_imagehash(struct command_args *args) {
+    return report_running_image();
+}
+
+static int cmd_jitter(struct command_args *args) {
+    report_control_timing();
+    return 0;
+}
+
+static int cmd_level(struct command_args *args) {
+    set_power_level( args->word[0] );
+    return 0;
+}
+
+static int cmd_longlog(struct command_args *args) {
+    send_longlog(args->ival[0], args->ival[1]);     // to the latest, if no second argument
+    return 0;
+}
+
+static int cmd_maxheat(struct command_args *args) {
+    int m = args->ival[0];
+    if ( m < 60 || m > 100) {
+        LOGI(TAG,"Refused: will not set maxheat outside of 60-100 Celsius");
+        return -1;
+    }
+    set_max_temperature(m);
+    return 0;
+}
+
+static int cmd_perf(struct command_args *args) {
+    report_perf();
+    return 0;
+}
+
+static int cmd_reboot(struct command_args *args) {
+    send_message(0,"Rebooting now...");
+    esp_restart();
+    return 0;
+}
+
+static int cmd_report(struct command_args *args) {
+    char ts[TIME_STRING_LEN];
+    int64_t stamp = esp_timer_get_time();
+    int hours = stamp / (1000LL * 1000 * 60 * 60);
+    int minutes = (stamp / (1000LL * 1000 * 60)) % 60;
+    send_messagef(0, "Current time is %s", time_string(ts));
+    send_messagef(0, "Time since boot: %d:%2d.  Errors since boot: %d", hours, minutes, error_count());
+    report_errors();
+    report_temperature_schedule();
+    send_messagef(0, "Current max is %d", max_temperature());
+    report_ambient_history_values();
+    return 0;
+}
+
+static int cmd_schedule(struct command_args *args) {
+    set_temperature_schedule(args->rest);
+    return 0;
+}
+
+static int cmd_snapshot(struct command_args *args) {
+    send_snapshot();
+    return 0;
+}
+
+static int cmd_subscribe(struct command_args *args) {
+    if (telemetry_subscribe(reply_source(), args->ival[0], args->ival[1]) < 0) {
+        return -1;
+    }
+    send_messagef(0, "subscribed to %d every %d ms for %d s", args->ival[0], args->ival[1], TELEMETRY_LEASE);
+    return 0;
+}
+
+static int cmd_time_update(struct command_args *args) {
+    return update_time();
+}
+
+static int cmd_trace(struct command_args *args) {
+    send_trace(args->ival[0]);    // from the start, if no argument
+    return 0;
+}
+
+static int cmd_unsubscribe(struct command_args *args) {
+    telemetry_unsubscribe(reply_source());
+    return 0;
+}
+
+static int cmd_update(struct command_args *args) {
+    ota_upgrade(args->word[0], args->ival[1], args->rest);
+    // ota_upgrade only returns if the upgrade failed.
+    return -1;
+}
+
+static int cmd_version(struct command_args *args) {
+    send_message(0,version_string);
+    return 0;
+}
+
+static int cmd_wifi(struct command_args *args) {
+    report_wifi();
+    return 0;
+}
+
+static int cmd_help(struct command_args *args);
+
+
+/*
+ * The command table.  This must be kept sorted by name, since we binary search it.
+ * (init_console checks.)
+ */
+static const struct command commands[] = {
+    { "boot",        "",   cmd_boot,        "boot" },
+    { "bump",        "ii", cmd_bump,        "bump <amount> <hours>" },
+    { "errtest",     "",   cmd_errtest,     "errtest" },
+    { "hello",       "",   cmd_hello,       "hello" },
+    { "help",        "",   cmd_help,        "help" },
+    { "history",     "iI", cmd_history,     "history <from minute, or -minutes> [to minute]" },
+    { "imagehash",   "",   cmd_imagehash,   "imagehash" },
+    { "jitter",      "",   cmd_jitter,      "jitter" },
+    { "level",       "w",  cmd_level,       "level off|low|medium|high|auto" },
+    { "longlog",     "iI", cmd_longlog,     "longlog <from record, or -records> [to record]" },
+    { "maxheat",     "i",  cmd_maxheat,     "maxheat <celsius>" },
+    { "perf",        "",   cmd_perf,        "perf" },
+    { "reboot",      "",   cmd_reboot,      "reboot" },
+    { "report",      "",   cmd_report,      "report" },
+    { "schedule",    "s",  cmd_schedule,    "schedule <t0>,<t1>,...,<t23>" },
+    { "snapshot",    "",   cmd_snapshot,    "snapshot" },
+    { "subscribe",   "ii", cmd_subscribe,   "subscribe <variable mask> <period ms>" },
+    { "time_update", "",   cmd_time_update, "time_update" },
+    { "trace",       "I",  cmd_trace,       "trace [from]" },
+    { "unsubscribe", "",   cmd_unsubscribe, "unsubscribe" },
+    { "update",      "wis", cmd_update,     "update <ipaddr> <length> [sha256]" },
+    { "version",     "",   cmd_version,     "version" },
+    { "wifi",        "",   cmd_wifi,        "wifi" },
+};
+#define NUM_COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+static int cmd_help(struct command_args *args) {
+    for(int i = 0; i < NUM_COMMANDS; i++) {
+        send_message(0, commands[i].help);
+    }
+    return 0;
+}
+
+static int compare_command(const void *key, const void *entry) {
+    return strcmp((const char *)key, ((const struct command *)entry)->name);
+}
+
+/*
+ * Fill args according to schema.  Returns 0 on success, -1 if the arguments don't match.
+ */
+static int parse_args(const char *schema, char *argstr, struct command_args *args) {
+    char *cp = argstr, *end;
+    int n = 0;
+
+    for(const char *sp = schema; *sp; sp++, n++) {
+        while (isspace((unsigned char)*cp)) cp++;
+        switch(*sp) {
+            case 'i':
+            case 'I':
+                args->ival[n] = strtol(cp, &end, 10);
+                if (end == cp && (*sp == 'i' || *cp != 0)) {
+                    return -1;
+                }
+                cp = end;
+                break;
+            case 'w': {
+                int len = strcspn(cp, " \t");
+                if (len == 0 || len >= WORD_LEN) {
+                    return -1;
+                }
+                memcpy(args->word[n], cp, len);
+                args->word[n][len] = 0;
+                cp += len;
+                break;
+            }
+            case 's':
+                args->rest = cp;
+                return 0;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Run a single command (which has been separated from any others in the datagram)
+ */
+static int run_command(char *cbuf) {
+    struct command_args args = { .rest = "" };
+    char *cmd, *argstr;
+
+    while (isspace((unsigned char)*cbuf)) cbuf++;
     if (strlen(cbuf) == 0) {
         LOGI(TAG,"Empty command ignored");
         return 0;
@@ -26,93 +272,62 @@ int recieve_command(void *buf, int len) {
     if (sp) { // split string in two.
         *sp = 0;
         cmd = cbuf;
-        args = sp+1;
+        argstr = sp+1;
     }
     else {
         cmd = cbuf;
-        args = "";
+        argstr = "";
     }
 
-    if ( strcmp(cmd, "hello") == 0 ) {
-        send_message(0,"hello back");
-    }
-    else if ( strcmp(cmd, "version") == 0 ) {
-        send_message(0,version_string);
-    }
-    else if ( strcmp(cmd, "level") == 0 ) {
-        set_power_level( args );
+    const struct command *c = bsearch(cmd, commands, NUM_COMMANDS, sizeof(commands[0]), compare_command);
+    if (c == NULL) {
+        LOGI(TAG, "Unrecognized command %s", cmd);
+        return -1;
     }
-    else if ( strcmp(cmd, "maxheat") == 0 ) {
-        int m, found;
-        found = sscanf(args, " %d", &m);
-        if ( found != 1 ) {
-            LOGI(TAG,"Malformed maxheat command? |%s|", args);
-        }
-        else if ( m < 60 || m > 100) {
-            LOGI(TAG,"Refused: will not set maxheat outside of 60-100 Celsius");
-        }
-        else {
-            set_max_temperature(m);
-        }
+    if (parse_args(c->schema, argstr, &args) < 0) {
+        LOGI(TAG,"Malformed %s command? |%s|  (expected: %s)", cmd, argstr, c->help);
+        return -1;
     }
-    else if ( strcmp(cmd, "bump") == 0 ) {
-        int amount, duration, found;
-        found = sscanf(args, " %d %d", &amount, &duration);
-        if ( found == 2 ) {
-            bump_temperature(amount, duration);
-        }
-        else {
-            LOGI(TAG,"Malformed bump command? |%s|", args);
+    return c->handler(&args);
+}
+
+int recieve_command(void *buf, int len, int sock, void *source) {
+    char *cbuf = (char *)buf, *next;
+    const char *request_id = NULL;
+    int status = 0;
+    cbuf[len] = 0;
+    LOGI(TAG, "Received command |%s|", cbuf);
+
+    // Pick off the request id, if there is one
+    if (cbuf[0] == '#') {
+        request_id = ++cbuf;
+        cbuf += strcspn(cbuf, " \t\n;");
+        if (*cbuf) {
+            *cbuf++ = 0;
         }
     }
-    else if ( strcmp(cmd, "update") == 0 ) {
-        char addr[16];  // 123.456.777.999
-        int len, found;
-        found = sscanf(args, " %15s %d", addr, &len);
-        if (found == 2) {
-            ota_upgrade(addr, len);
-        }
-        else {
-            LOGI(TAG,"Malformed update command? |%s|", args);
+
+    begin_reply(sock, source, request_id);
+    while (cbuf) {
+        next = strpbrk(cbuf, ";\n");
+        if (next) {
+            *next++ = 0;
         }
-    }
-    else if ( strcmp(cmd, "schedule") == 0 ) {
-        set_temperature_schedule(args);
-    }
-    else if ( strcmp(cmd, "reboot") == 0 ) {
-        send_message(0,"Rebooting now...");
-        esp_restart();
-    }
-    else if ( strcmp(cmd, "report") == 0 ) {
-        char *ts = time_string(NULL);
-        int64_t stamp = esp_timer_get_time();
-        int hours = stamp / (1000LL * 1000 * 60 * 60);
-        int minutes = (stamp / (1000LL * 1000 * 60)) % 60;
-        send_messagef(0, "Current time is %s", ts);
-        send_messagef(0, "Time since boot: %d:%2d.  Errors since boot: %d", hours, minutes, error_count());
-        report_errors();
-        report_temperature_schedule();
-        send_messagef(0, "Current max is %d", max_temperature());
-        report_ambient_history_values();
-        free(ts);
-    }
-    else if ( strcmp(cmd, "errtest") == 0 ) {
-        // Generate a bunch of errors so we can see the behavior of the error handler
-        for(int i=0; i<100; i++) {
-            LOGE(TAG,"Test error %d", i);
+        if (run_command(cbuf) < 0) {
+            status = -1;
         }
+        cbuf = next;
     }
-    else if (strcmp(cmd, "time_update") == 0 ) {
-        update_time();
-    }
-    else {
-        LOGI(TAG, "Unrecognized command %s", cmd);
-    }
+    end_reply(status);
 
     return 0;
 }
 
 void init_console() {
-    listener_task("console_listener", CNTRL_PORT, recieve_command);
+    for(int i = 1; i < NUM_COMMANDS; i++) {
+        if (strcmp(commands[i-1].name, commands[i].name) >= 0) {
+            LOGE(TAG, "Command table is out of order at %s", commands[i].name);
+        }
+    }
+    listener_task("console_listener", CNTRL_PORT, PRIORITY_CONSOLE, CONSOLE_RATE, CONSOLE_BURST, recieve_command);
 }
-
@@ -17,18 +17,14 @@
 
 const char *TAG = "time";
 static char databuf[2048];
-static char fieldbuf[30];
+static char fieldbuf[TIME_STRING_LEN];
 
 /*
- * Return a string representation of the current time.
- * Provided buf is used unless NULL, in which case a new string is malloc'd
+ * Return a string representation of the current time, in ob (at least TIME_STRING_LEN long).
  */
 char *time_string(char *ob) {
     time_t now;
     time(&now);
-    if (ob == NULL) {
-        ob = malloc(30);
-    }
     return ctime_r(&now, ob);
 }
 
@@ -85,6 +81,7 @@ int update_time() {
         if ( ut > 0 ) {
             struct timeval tv = { .tv_sec = ut };
             settimeofday(&tv,NULL);
+            trace_time(ut);
 
             time_string(fieldbuf);
             LOGI(TAG,"Time set to %s", fieldbuf);
@@ -101,20 +98,21 @@ int update_time() {
 }
 
 /* We might not be able to get the time due to an internet outage.
- * Keep trying (but not too often) until we succeed.
+ * Keep trying (but not too often) until we succeed.  Boot doesn't wait for WIFI before
+ * starting us, so until it connects we just check back every second.
  */
 void update_until_good() {
     while(1) {
-        if ( update_time() == 0 ) {
+        if ( wifi_connected() && update_time() == 0 ) {
             break;
         }
-        vTaskDelay( 60 * 60 * 1000 / portTICK_PERIOD_MS);
+        vTaskDelay( (wifi_connected() ? 60 * 60 * 1000 : 1000) / portTICK_PERIOD_MS);
     }
     vTaskDelete(NULL);
 }
 
 void init_time() {
-    xTaskCreate(update_until_good, "time_updater", 4096, NULL, 5, NULL);
+    xTaskCreate(update_until_good, "time_updater", 4096, NULL, PRIORITY_NETWORK, NULL);
 }
 
 int current_hour() { 
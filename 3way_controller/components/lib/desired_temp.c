@@ -11,7 +11,7 @@ static char *TAG = "desired_temp";
 static int temp_targets[24] = {19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19,   // midnight -- 11am
                                19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19 };  // noon -- 11pm
 
-static int override_temp = NO_TEMP_VALUE;
+static int override_temp = 0;           // whole degrees, like the schedule
 static int64_t override_until = 0;
 
 
@@ -77,8 +77,8 @@ void set_temperature_schedule( const char *sched ) {
 
 void init_temperature_schedule() {
     // Fetch the temperature schedule we've stored before, if there is one.
-    char *stored_schedule = get_psv("ts");
-    if (stored_schedule) {
+    char stored_schedule[PSV_MAX_LEN];
+    if (get_psv("ts", stored_schedule, sizeof(stored_schedule)) == 0) {
         LOGI(TAG, "Restoring schedule %s", stored_schedule);
         parse_temperature_values( stored_schedule, temp_targets );
     }
@@ -101,21 +101,41 @@ void report_temperature_schedule() {
  * An hour value of 0 or less will remove all current bumps.
  */
 void bump_temperature(int increment, int hours) {
-    float current_target = current_desired_temperature();
-    override_temp = (int)(current_target + increment);
+    char buf[CENTIDEG_LEN];
+    centideg_t current_target = current_desired_temperature();
+    override_temp = current_target / 100 + increment;
     // esp_timer tells time in *microseconds*.
     override_until = esp_timer_get_time() + ((int64_t)hours * 1000 * 1000 * 60 * 60);
-    LOGI(TAG,"Bumped temperature from %f to %d until %lld", current_target, override_temp, override_until);
+    LOGI(TAG,"Bumped temperature from %s to %d until %lld", centideg_string(current_target, buf), override_temp, (long long)override_until);
+}
+
+// Put back a bump that was in effect before a restart (see warm_restart.c)
+void restore_bump(int temp, int seconds) {
+    override_temp = temp;
+    override_until = esp_timer_get_time() + seconds * 1000LL * 1000;
+}
+
+/*
+ * Report on the current bump, if any:  returns the number of seconds it has left to run
+ * (0 if there is no bump in effect), and fills in the bumped temperature.
+ */
+int bump_remaining(int *temp) {
+    int64_t remaining = override_until - esp_timer_get_time();
+    if (override_until == 0 || remaining <= 0) {
+        return 0;
+    }
+    *temp = override_temp;
+    return remaining / (1000 * 1000);
 }
 
 
 /*
  * Combine the schedule and any current override to determine what temperature we want right now.
  */
-float current_desired_temperature() {
+centideg_t current_desired_temperature() {
     if (override_until) {
         if (esp_timer_get_time() < override_until) {
-            return override_temp;
+            return CENTIDEG(override_temp);
         }
         else {
             // Mark override as expired.
@@ -123,5 +143,5 @@ float current_desired_temperature() {
             // fall through
         }
     }
-    return temp_targets[ current_hour() ];
+    return CENTIDEG(temp_targets[ current_hour() ]);
 }
@@ -0,0 +1,232 @@
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "libconfig.h"
+#include "libdecls.h"
+
+/*
+ * History:  once a minute we record the ambient, desired and heater temperatures, the power
+ * level, any assigned level and whether a bump is on, so that we can look back at how the
+ * controller has been behaving (for a couple of days) without having had something listening
+ * all along.
+ *
+ * The control loop hands us what it acted on (history_pass), and we record it each time
+ * another minute has gone by.
+ *
+ * Records are delta encoded, into a ring of HISTORY_BLOCKS blocks of HISTORY_BLOCK_SIZE bytes;
+ * when the ring is full the oldest block goes.  Each block starts with a full record (a
+ * keyframe), so it can be decoded on its own:
+ *     keyframe:  uint32 minute number (minutes since boot), int16 ambient, desired, heater,
+ *                uint8 state
+ *     others:    uint8 header.  If bit 7 is clear, the header is the whole record:  the
+ *                ambient delta (bits 0-2) and heater delta (bits 3-6), as signed numbers.
+ *                If it is set, whichever of these it says follow:
+ *                ambient and heater deltas (bits 0-1 and 2-3:  0 unchanged, 1 int8, 2 int16),
+ *                desired delta (bit 4:  int16), state (bit 5:  uint8)
+ * and each record is a minute after the one before.  Temperatures are tenths of a degree
+ * (so a missing reading is NO_TEMP_VALUE / 10); the history is for seeing how things went,
+ * and that is as fine as the sensors are good for.  State is the level (bits 0-2), the
+ * assigned level (bits 3-5; power_na if none) and the bump (bit 6).  Mostly only the
+ * temperatures change, by a little, so a typical record is the one byte.
+ *
+ * The console "history <from> [to]" command sends the blocks that cover minutes from..to
+ * (a negative from counts back from now), oldest first, at most HISTORY_BATCH of them.  Each
+ * is a datagram:
+ *     "HCHI", uint8 version, uint8 unused, uint16 length of the block's data,
+ *     uint32 the current minute number, uint32 the current unix time (0 if not set),
+ *     then the block's data.
+ * console.py decodes them (and asks for more until it has the whole range).
+ */
+
+#define HISTORY_VERSION 2
+#define HISTORY_INTERVAL (60*1000)      // ms; records are numbered in minutes
+#define KEYFRAME_LEN 11
+#define MAX_RECORD_LEN 8        // header, two int16 temperature deltas, desired, state
+#define HISTORY_EXTENDED 0x80   // header bit for a record with more than small temperature deltas
+
+struct __attribute__((packed)) history_header {
+    char magic[4];              // "HCHI"
+    uint8_t version;
+    uint8_t unused;
+    uint16_t length;
+    uint32_t minute;
+    uint32_t time;
+};
+
+struct history_block {
+    uint32_t first;             // minute number of the keyframe
+    uint16_t count;             // records; 0 if the block is unused
+    uint16_t used;              // bytes
+    uint8_t data[HISTORY_BLOCK_SIZE];
+};
+
+static struct history_block blocks[HISTORY_BLOCKS];
+static int current = -1;        // the block being filled
+static uint32_t minute = 0;     // number of the next record
+static int64_t next_due = 0;    // esp_timer time the next record is due
+static SemaphoreHandle_t history_lock;
+
+// The last record, which the next one is a delta from
+static struct {
+    int16_t ambient, desired, heater;
+    uint8_t state;
+} last;
+
+static void put16(uint8_t *p, int16_t v) {
+    memcpy(p, &v, 2);
+}
+
+// Centidegrees to tenths, rounding
+static int16_t tenths(centideg_t v) {
+    return (v >= 0 ? v + 5 : v - 5) / 10;
+}
+
+// Encode a temperature change; returns the size code for the header
+static int put_delta(uint8_t *buf, int *len, int delta) {
+    if (delta == 0) {
+        return 0;
+    }
+    if (delta >= -128 && delta <= 127) {
+        buf[(*len)++] = (int8_t)delta;
+        return 1;
+    }
+    put16(buf + *len, delta);
+    *len += 2;
+    return 2;
+}
+
+static void add_record(int16_t ambient, int16_t desired, int16_t heater, uint8_t state) {
+    uint8_t rec[MAX_RECORD_LEN];
+    int len = 1;
+    int ambient_delta = ambient - last.ambient;
+    int heater_delta = heater - last.heater;
+
+    if (desired == last.desired && state == last.state && ambient_delta >= -4 && ambient_delta <= 3 &&
+            heater_delta >= -8 && heater_delta <= 7) {
+        rec[0] = (ambient_delta & 0x07) | ((heater_delta & 0x0f) << 3);
+    }
+    else {
+        rec[0] = HISTORY_EXTENDED;
+        rec[0] |= put_delta(rec, &len, ambient_delta);
+        rec[0] |= put_delta(rec, &len, heater_delta) << 2;
+        if (desired != last.desired) {
+            rec[0] |= 0x10;
+            put16(rec + len, desired - last.desired);
+            len += 2;
+        }
+        if (state != last.state) {
+            rec[0] |= 0x20;
+            rec[len++] = state;
+        }
+    }
+
+    xSemaphoreTake(history_lock, portMAX_DELAY);
+    struct history_block *b = current >= 0 ? &blocks[current] : NULL;
+    if (b == NULL || b->used + len > HISTORY_BLOCK_SIZE) {
+        // Start a new block (dropping the oldest, if need be) with a keyframe
+        current = (current + 1) % HISTORY_BLOCKS;
+        b = &blocks[current];
+        b->first = minute;
+        b->count = 0;
+        memcpy(b->data, &minute, 4);
+        put16(b->data + 4, ambient);
+        put16(b->data + 6, desired);
+        put16(b->data + 8, heater);
+        b->data[10] = state;
+        b->used = KEYFRAME_LEN;
+    }
+    else {
+        memcpy(b->data + b->used, rec, len);
+        b->used += len;
+    }
+    b->count++;
+    minute++;
+    xSemaphoreGive(history_lock);
+
+    last.ambient = ambient;
+    last.desired = desired;
+    last.heater = heater;
+    last.state = state;
+}
+
+/*
+ * Called by the control loop after each pass, with what it went on and what it decided.
+ * It runs more often than once a minute, so usually this is a minute's record or nothing;
+ * if it has been held up, the minutes it missed get the same record, so that the minute
+ * numbers stay in step with the clock.
+ */
+void history_pass(const struct control_inputs *in, enum power_level level) {
+    int64_t now = esp_timer_get_time();
+    int bump_temp;
+
+    if (history_lock == NULL || now < next_due) {
+        return;
+    }
+    uint8_t state = level | (in->override << 3);
+    if (bump_remaining(&bump_temp)) {
+        state |= 0x40;
+    }
+    do {
+        add_record(tenths(in->actual), tenths(in->desired), tenths(in->heater), state);
+        next_due += HISTORY_INTERVAL * 1000LL;
+    } while (next_due <= now);
+}
+
+/*
+ * Send the blocks covering minutes from..to (see above)
+ */
+void send_history(int from, int to) {
+    uint32_t buf[(sizeof(struct history_header) + HISTORY_BLOCK_SIZE + 3) / 4];
+    struct history_header *h = (struct history_header *)buf;
+    time_t now;
+    int sent = 0;
+
+    time(&now);
+    xSemaphoreTake(history_lock, portMAX_DELAY);
+    if (from < 0) {
+        from += minute;
+    }
+    if (to <= 0 || to > (int)minute) {
+        to = minute;
+    }
+    int oldest = current + 1;
+    xSemaphoreGive(history_lock);
+
+    // Each block is copied out under the lock, and sent after we let go of it, so that the
+    // control loop is never waiting on the network.  (If a block is started meanwhile, it
+    // takes the oldest one's place, and may be sent out of order or not at all; console.py
+    // goes by the minute numbers, and asks again for anything it is missing.)
+    for(int i = 0; i < HISTORY_BLOCKS && sent < HISTORY_BATCH; i++) {
+        xSemaphoreTake(history_lock, portMAX_DELAY);
+        struct history_block *b = &blocks[(oldest + i) % HISTORY_BLOCKS];
+        int wanted = (b->count != 0 && (int)(b->first + b->count) > from && (int)b->first <= to);
+        if (wanted) {
+            memcpy(h->magic, "HCHI", 4);
+            h->version = HISTORY_VERSION;
+            h->unused = 0;
+            h->length = b->used;
+            h->minute = minute;
+            h->time = now > EARLIEST_VALID_TIME ? now : 0;
+            memcpy(h + 1, b->data, b->used);
+        }
+        xSemaphoreGive(history_lock);
+        if (wanted) {
+            send_reply_data(buf, sizeof(*h) + h->length);
+            sent++;
+        }
+    }
+    if (sent == 0) {
+        send_messagef(0, "No history from minute %d to %d", from, to);
+    }
+}
+
+// Before the control loop starts, so that its first pass is minute 0
+void init_history() {
+    next_due = esp_timer_get_time();
+    history_lock = xSemaphoreCreateMutex();
+}
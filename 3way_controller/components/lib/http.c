@@ -0,0 +1,476 @@
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+#include "libconfig.h"
+#include "libdecls.h"
+
+/*
+ * HTTP status and metrics, for monitoring that can't use the UDP broadcasts:
+ *     GET /metrics   the controller's state and counters, in the Prometheus text format
+ *     GET /status    the controller's state, as a JSON document
+ * e.g. "curl http://heater/metrics" (or http://127.0.0.1:8080/metrics for the twin).
+ *
+ * This is a minimal HTTP/1.1 server on a plain socket, in one task:  it keeps up to
+ * HTTP_CONNECTIONS connections open (keep-alive, so a scraper doesn't connect every time),
+ * dropping one after HTTP_IDLE_TIMEOUT seconds of quiet, or the longest idle one to make room.
+ * Requests are GETs with no body; each connection has a HTTP_REQUEST_LEN buffer for them.
+ *
+ * Responses are sent chunked, formatted straight into a single chunk buffer that goes out
+ * whenever it fills; so however long a response is, it never needs more than that buffer
+ * (and the body is never assembled in one piece).  HTTP/1.0 clients, which don't know about
+ * chunks, get the same pieces unframed, and the end of the response is the connection
+ * closing.  Everything formatted is integers (temperatures are centidegrees), so a scrape
+ * costs little.
+ *
+ * The temperatures are the ones the control loop last acted on (see power_controller.c), not
+ * fresh readings:  a scrape shouldn't be able to reset the ambient history or count an error.
+ */
+
+static const char *TAG = "http";
+
+#define HTTP_REQUEST_LEN 512
+#define CHUNK_HEAD 6                    // "hhhh\r\n"
+#define CHUNK_DATA 512
+#define SEND_TIMEOUT 5                  // seconds a client may keep us waiting to take a response
+
+struct connection {
+    int sock;                           // -1 if the slot is free
+    int64_t last_active;
+    int len;
+    char request[HTTP_REQUEST_LEN];
+};
+
+static struct connection connections[HTTP_CONNECTIONS];
+static TaskHandle_t http_task_handle = NULL;
+static uint32_t http_requests = 0;
+static uint32_t http_connections = 0;
+
+struct response {
+    int sock;
+    int len;                            // in the chunk being filled
+    int failed;
+    int chunked;                        // else HTTP/1.0:  no framing, and we close at the end
+    char buf[CHUNK_HEAD + CHUNK_DATA + 3];  // room for the chunk's "\r\n" and vsnprintf's null
+};
+
+static int send_all(int sock, const char *data, int len) {
+    while (len > 0) {
+        int n = send(sock, data, len, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void flush_chunk(struct response *r) {
+    char head[CHUNK_HEAD + 1];
+    if (r->len == 0 || r->failed) {
+        return;
+    }
+    if (r->chunked) {
+        snprintf(head, sizeof(head), "%04x\r\n", r->len);
+        memcpy(r->buf, head, CHUNK_HEAD);
+        memcpy(r->buf + CHUNK_HEAD + r->len, "\r\n", 2);
+        r->failed = send_all(r->sock, r->buf, CHUNK_HEAD + r->len + 2) < 0;
+    }
+    else {
+        r->failed = send_all(r->sock, r->buf + CHUNK_HEAD, r->len) < 0;
+    }
+    r->len = 0;
+}
+
+static void out_printf(struct response *r, const char *fmt, ...) {
+    va_list ap;
+    for(int attempt = 0; attempt < 2; attempt++) {
+        int room = CHUNK_DATA - r->len;
+        va_start(ap, fmt);
+        int n = vsnprintf(r->buf + CHUNK_HEAD + r->len, room + 1, fmt, ap);
+        va_end(ap);
+        if (n <= room) {
+            r->len += n;
+            return;
+        }
+        if (r->len == 0) {
+            r->len = room;      // longer than a whole chunk; cut short
+            return;
+        }
+        flush_chunk(r);
+    }
+}
+
+static void begin_response(struct response *r, int sock, const char *content_type, int chunked, int keep) {
+    char head[160];
+    int len = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n%s"
+                       "Connection: %s\r\n\r\n", content_type,
+                       chunked ? "Transfer-Encoding: chunked\r\n" : "", keep && chunked ? "keep-alive" : "close");
+    r->sock = sock;
+    r->len = 0;
+    r->chunked = chunked;
+    r->failed = send_all(sock, head, len) < 0;
+}
+
+// Returns 0 if the connection can be kept
+static int end_response(struct response *r) {
+    flush_chunk(r);
+    if (!r->chunked) {
+        return -1;
+    }
+    if (!r->failed && send_all(r->sock, "0\r\n\r\n", 5) < 0) {
+        r->failed = 1;
+    }
+    return r->failed ? -1 : 0;
+}
+
+static int send_error(int sock, const char *status, int keep) {
+    char buf[160];
+    int len = snprintf(buf, sizeof(buf), "HTTP/1.1 %s\r\nContent-Type: text/plain\r\nContent-Length: %d\r\n"
+                       "Connection: %s\r\n\r\n%s\n", status, (int)strlen(status) + 1,
+                       keep ? "keep-alive" : "close", status);
+    return send_all(sock, buf, len);
+}
+
+static uint32_t stack_free(TaskHandle_t task) {
+    return task ? uxTaskGetStackHighWaterMark(task) * sizeof(StackType_t) : 0;
+}
+
+/*
+ * /metrics
+ */
+
+static void out_metric(struct response *r, const char *name, const char *type, const char *help) {
+    out_printf(r, "# HELP heater_%s %s\n# TYPE heater_%s %s\n", name, help, name, type);
+}
+
+static void out_gauge(struct response *r, const char *name, const char *help, long long value) {
+    out_metric(r, name, "gauge", help);
+    out_printf(r, "heater_%s %lld\n", name, value);
+}
+
+static void out_counter(struct response *r, const char *name, const char *help, long long value) {
+    out_metric(r, name, "counter", help);
+    out_printf(r, "heater_%s %lld\n", name, value);
+}
+
+static void out_celsius(struct response *r, const char *name, const char *help, centideg_t value) {
+    char buf[CENTIDEG_LEN];
+    out_metric(r, name, "gauge", help);
+    out_printf(r, "heater_%s %s\n", name, value == NO_TEMP_VALUE ? "NaN" : centideg_string(value, buf));
+}
+
+static int send_metrics(int sock, int chunked, int keep) {
+    struct response r;
+    int bump_temp = 0, port, received, dropped;
+    int messages, messages_dropped, errors, errors_dropped, repeats, limited;
+    uint32_t passes, missed, switches;
+    struct control_inputs in;
+
+    begin_response(&r, sock, "text/plain; version=0.0.4", chunked, keep);
+
+    last_control_inputs(&in);
+    out_celsius(&r, "ambient_celsius", "Ambient temperature", in.actual);
+    out_gauge(&r, "ambient_slope_centicelsius_per_hour", "Ambient temperature trend", current_ambient_slope());
+    out_celsius(&r, "element_celsius", "Heater element temperature", in.heater);
+    out_celsius(&r, "desired_celsius", "Desired temperature, from the schedule and any bump", in.desired);
+    out_gauge(&r, "max_heater_celsius", "Heater temperature at which the heater is turned off", max_temperature());
+    out_gauge(&r, "power_level", "Power level (0 off, 1 low, 2 medium, 3 high)", current_power_level());
+    out_gauge(&r, "power_assigned", "Assigned power level (4 if none)", current_power_override());
+    out_gauge(&r, "bump_remaining_seconds", "Time left on the current bump", bump_remaining(&bump_temp));
+
+    control_counters(&passes, &missed, &switches);
+    out_counter(&r, "control_passes_total", "Control loop passes", passes);
+    out_counter(&r, "control_missed_deadlines_total", "Control loop passes that started late", missed);
+    out_counter(&r, "relay_switches_total", "Times a relay was switched", switches);
+
+    out_gauge(&r, "uptime_seconds", "Time since boot", esp_timer_get_time() / (1000 * 1000));
+    out_gauge(&r, "wifi_connected", "Whether WIFI is connected", wifi_connected());
+    out_gauge(&r, "heap_free_bytes", "Free heap", esp_get_free_heap_size());
+    out_gauge(&r, "heap_min_free_bytes", "Least free heap since boot", esp_get_minimum_free_heap_size());
+    out_metric(&r, "stack_free_bytes", "gauge", "Stack never used, by task");
+    out_printf(&r, "heater_stack_free_bytes{task=\"control\"} %u\n", (unsigned)stack_free(power_controller_task()));
+    out_printf(&r, "heater_stack_free_bytes{task=\"broadcast\"} %u\n", (unsigned)stack_free(broadcast_loop_task()));
+    out_printf(&r, "heater_stack_free_bytes{task=\"http\"} %u\n", (unsigned)stack_free(http_task_handle));
+
+    message_queue_stats(&messages, &messages_dropped, &errors, &errors_dropped);
+    message_filter_stats(&repeats, &limited);
+    out_metric(&r, "queue_length", "gauge", "Messages waiting, by queue");
+    out_printf(&r, "heater_queue_length{queue=\"message\"} %d\nheater_queue_length{queue=\"error\"} %d\n", messages, errors);
+    out_metric(&r, "queue_dropped_total", "counter", "Messages lost to queue overflow, by queue");
+    out_printf(&r, "heater_queue_dropped_total{queue=\"message\"} %d\nheater_queue_dropped_total{queue=\"error\"} %d\n",
+               messages_dropped, errors_dropped);
+    out_counter(&r, "errors_total", "Errors since boot", error_count());
+    out_counter(&r, "messages_repeated_total", "Repeated messages collapsed", repeats);
+    out_counter(&r, "messages_rate_limited_total", "Warnings and errors held back by their tag's limit", limited);
+
+    out_metric(&r, "packets_received_total", "counter", "Packets received, by port");
+    for(int i = 0; listener_stats(i, &port, &received, &dropped) == 0; i++) {
+        out_printf(&r, "heater_packets_received_total{port=\"%d\"} %d\n", port, received);
+    }
+    out_metric(&r, "packets_dropped_total", "counter", "Packets dropped by the rate limit, by port");
+    for(int i = 0; listener_stats(i, &port, &received, &dropped) == 0; i++) {
+        out_printf(&r, "heater_packets_dropped_total{port=\"%d\"} %d\n", port, dropped);
+    }
+    out_counter(&r, "http_requests_total", "HTTP requests served", http_requests);
+    out_counter(&r, "http_connections_total", "HTTP connections accepted", http_connections);
+
+    return end_response(&r);
+}
+
+/*
+ * /status
+ */
+
+static void out_json_temp(struct response *r, const char *name, centideg_t value, const char *sep) {
+    char buf[CENTIDEG_LEN];
+    out_printf(r, "\"%s\": %s%s", name, value == NO_TEMP_VALUE ? "null" : centideg_string(value, buf), sep);
+}
+
+static int send_status(int sock, int chunked, int keep) {
+    static const char *levels[] = { "off", "low", "medium", "high", "auto" };
+    struct response r;
+    int bump_temp = 0;
+    struct control_inputs in;
+    time_t now;
+    char buf[TIME_STRING_LEN];
+
+    begin_response(&r, sock, "application/json", chunked, keep);
+    time(&now);
+    out_printf(&r, "{\"version\": \"%s\", \"uptime\": %d, \"time\": ", version_string,
+               (int)(esp_timer_get_time() / (1000 * 1000)));
+    if (now > EARLIEST_VALID_TIME) {
+        struct tm local;
+        strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", localtime_r(&now, &local));
+        out_printf(&r, "%lld, \"local_time\": \"%s\",\n", (long long)now, buf);
+    }
+    else {
+        out_printf(&r, "null,\n");
+    }
+
+    enum power_level assigned = current_power_override();
+    out_printf(&r, " \"level\": \"%s\", \"assigned\": ", levels[current_power_level()]);
+    if (assigned != power_na) {
+        out_printf(&r, "\"%s\",\n", levels[assigned]);
+    }
+    else {
+        out_printf(&r, "null,\n");
+    }
+
+    last_control_inputs(&in);
+    out_printf(&r, " \"temperatures\": {");
+    out_json_temp(&r, "ambient", in.actual, ", ");
+    out_json_temp(&r, "heater", in.heater, ", ");
+    out_json_temp(&r, "desired", in.desired, ", ");
+    out_printf(&r, "\"max_heater\": %d, \"ambient_slope_centicelsius_per_hour\": %d},\n", max_temperature(), current_ambient_slope());
+
+    int remaining = bump_remaining(&bump_temp);
+    if (remaining) {
+        out_printf(&r, " \"bump\": {\"temperature\": %d, \"remaining\": %d},\n", bump_temp, remaining);
+    }
+    else {
+        out_printf(&r, " \"bump\": null,\n");
+    }
+
+    out_printf(&r, " \"errors\": %d, \"new_errors\": %d, \"wifi\": %s, \"free_heap\": %u}\n", error_count(),
+               new_error_count(), wifi_connected() ? "true" : "false", (unsigned)esp_get_free_heap_size());
+    return end_response(&r);
+}
+
+/*
+ * Connections
+ */
+
+static void close_connection(struct connection *c) {
+    close(c->sock);
+    c->sock = -1;
+    c->len = 0;
+}
+
+// Handle the request at the start of c->request (headers end at end).  Returns 0 if the
+// connection stays open.
+static int handle_request(struct connection *c, char *end) {
+    char *method = c->request, *path, *version;
+
+    *end = 0;
+    http_requests++;
+    path = strchr(method, ' ');
+    version = path ? strchr(path + 1, ' ') : NULL;
+    if (version == NULL) {
+        send_error(c->sock, "400 Bad Request", 0);
+        return -1;
+    }
+    *path++ = 0;
+    *version++ = 0;
+    char *headers = strstr(version, "\r\n");
+    if (headers) {
+        *headers++ = 0;
+        for(char *p = headers; *p; p++) {
+            *p = tolower((unsigned char)*p);
+        }
+    }
+    else {
+        headers = "";
+    }
+    char *query = strchr(path, '?');
+    if (query) {
+        *query = 0;
+    }
+
+    // HTTP/1.1 keeps the connection unless told not to; 1.0 only if asked to (and then only
+    // for errors, which have a length; our responses to it end with the connection)
+    int http11 = strcmp(version, "HTTP/1.1") == 0;
+    int keep = http11 ? strstr(headers, "connection: close") == NULL
+                      : strstr(headers, "connection: keep-alive") != NULL;
+
+    if (strcmp(method, "GET") != 0) {
+        return send_error(c->sock, "405 Method Not Allowed", keep) < 0 || !keep ? -1 : 0;
+    }
+    int ret;
+    if (strcmp(path, "/metrics") == 0) {
+        ret = send_metrics(c->sock, http11, keep);
+    }
+    else if (strcmp(path, "/status") == 0) {
+        ret = send_status(c->sock, http11, keep);
+    }
+    else {
+        ret = send_error(c->sock, "404 Not Found", keep);
+    }
+    return ret < 0 || !keep ? -1 : 0;
+}
+
+static void read_requests(struct connection *c, int64_t now) {
+    int n = recv(c->sock, c->request + c->len, HTTP_REQUEST_LEN - 1 - c->len, 0);
+    if (n <= 0) {
+        close_connection(c);
+        return;
+    }
+    c->len += n;
+    c->request[c->len] = 0;
+    c->last_active = now;
+
+    // There may be more than one (pipelined)
+    char *end;
+    while ((end = strstr(c->request, "\r\n\r\n")) != NULL) {
+        int used = end + 4 - c->request;
+        if (handle_request(c, end) < 0) {
+            close_connection(c);
+            return;
+        }
+        c->len -= used;
+        memmove(c->request, c->request + used, c->len + 1);
+    }
+    if (c->len == HTTP_REQUEST_LEN - 1) {
+        send_error(c->sock, "431 Request Header Fields Too Large", 0);
+        close_connection(c);
+    }
+}
+
+static void accept_connection(int listener, int64_t now) {
+    struct connection *c = NULL;
+    int sock = accept(listener, NULL, NULL);
+    if (sock < 0) {
+        return;
+    }
+    // A free slot, or else the one that has been quiet longest
+    for(int i = 0; i < HTTP_CONNECTIONS; i++) {
+        struct connection *slot = &connections[i];
+        if (slot->sock < 0) {
+            c = slot;
+            break;
+        }
+        if (c == NULL || slot->last_active < c->last_active) {
+            c = slot;
+        }
+    }
+    if (c->sock >= 0) {
+        close_connection(c);
+    }
+    struct timeval timeout = { .tv_sec = SEND_TIMEOUT };
+    int one = 1;
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    // A response is a few sends; don't let Nagle hold each one up for the client's delayed ACK
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c->sock = sock;
+    c->len = 0;
+    c->last_active = now;
+    http_connections++;
+}
+
+static void http_task(void *arg) {
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+        .sin_port = htons(HTTP_PORT),
+    };
+    int one = 1;
+
+    for(int i = 0; i < HTTP_CONNECTIONS; i++) {
+        connections[i].sock = -1;
+    }
+    int listener = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    if (listener < 0) {
+        LOGE(TAG, "Unable to create socket: errno %d", errno);
+        vTaskDelete(NULL);
+        return;
+    }
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, HTTP_CONNECTIONS) != 0) {
+        LOGE(TAG, "Unable to listen on port %d: errno %d", HTTP_PORT, errno);
+        close(listener);
+        vTaskDelete(NULL);
+        return;
+    }
+    ESP_LOGI(TAG, "Serving /metrics and /status on port %d", HTTP_PORT);
+
+    while(1) {
+        fd_set readable;
+        int maxfd = listener;
+        FD_ZERO(&readable);
+        FD_SET(listener, &readable);
+        for(int i = 0; i < HTTP_CONNECTIONS; i++) {
+            if (connections[i].sock >= 0) {
+                FD_SET(connections[i].sock, &readable);
+                if (connections[i].sock > maxfd) {
+                    maxfd = connections[i].sock;
+                }
+            }
+        }
+        struct timeval wait = { .tv_sec = 1 };
+        int n = select(maxfd + 1, &readable, NULL, NULL, &wait);
+        int64_t now = esp_timer_get_time();
+        if (n < 0) {
+            ESP_LOGE(TAG, "select failed: errno %d", errno);
+            vTaskDelay(1000 / portTICK_PERIOD_MS);
+            continue;
+        }
+        for(int i = 0; i < HTTP_CONNECTIONS; i++) {
+            struct connection *c = &connections[i];
+            if (c->sock < 0) {
+                continue;
+            }
+            if (n > 0 && FD_ISSET(c->sock, &readable)) {
+                read_requests(c, now);
+            }
+            else if (now - c->last_active > HTTP_IDLE_TIMEOUT * 1000000LL) {
+                close_connection(c);
+            }
+        }
+        if (n > 0 && FD_ISSET(listener, &readable)) {
+            accept_connection(listener, now);
+        }
+    }
+}
+
+void init_http() {
+    xTaskCreate(http_task, "http", 4096, NULL, PRIORITY_NETWORK, &http_task_handle);
+}
@@ -11,11 +11,69 @@
 // Port used to perform OTA update
 #define OTA_PORT 3343
 
+// Port for the HTTP status and metrics endpoint (see http.c); how many connections it keeps
+// open at once, and for how long (seconds) one may sit idle.
+// (The host build of the controller sets its own port.)
+#ifndef HTTP_PORT
+#define HTTP_PORT 80
+#endif
+#define HTTP_CONNECTIONS 2
+#define HTTP_IDLE_TIMEOUT 60
+
+// OTA downloads are received into a pool of OTA_BUFFER_COUNT buffers of OTA_BUFFER_SIZE
+// bytes each, so the network can keep going while flash is being written.
+#define OTA_BUFFER_SIZE 4096
+#define OTA_BUFFER_COUNT 4
+
+// Window used to inflate compressed OTA images; must be a power of two.
+// sync with ota_pack.py
+#define OTA_INFLATE_WINDOW 8192
+
+// Size of the piece of the running image we read at a time when applying an OTA patch
+#define OTA_DELTA_WINDOW 1024
+
+// If an OTA download is interrupted, we reconnect and resume where we left off.  We give up
+// after OTA_RESUME_ATTEMPTS tries in a row that make no progress, waiting a little longer
+// (OTA_RESUME_DELAY ms more) each time.
+#define OTA_RESUME_ATTEMPTS 5
+#define OTA_RESUME_DELAY 2000
+
+// WIFI reconnection:  the backoff between attempts doubles from WIFI_BACKOFF_MIN to WIFI_BACKOFF_MAX
+// milliseconds.  The first WIFI_FAST_ATTEMPTS attempts go straight to the AP we were last connected to.
+#define WIFI_BACKOFF_MIN 250
+#define WIFI_BACKOFF_MAX (30*1000)
+#define WIFI_FAST_ATTEMPTS 3
+
+// How often (milliseconds) listening tasks check whether they need to rebind their sockets
+#define NETWORK_CHECK_INTERVAL 2000
+
+// Task priorities.  Keeping the heater safe comes first, then getting it the readings it needs,
+// then talking to people; nothing the network sends us can hold up the control loop.
+// (All of these are below the wifi and lwIP tasks, which run at 18 and up.)
+#define PRIORITY_CONTROL 10     // power_controller, and the OTA health check that can roll back
+#define PRIORITY_AMBIENT 8      // ambient temperature listener
+#define PRIORITY_CONSOLE 6      // console listener
+#define PRIORITY_NETWORK 5      // broadcasts, telemetry, time updates, wifi, OTA download
+#define PRIORITY_BACKGROUND 3   // performance sampling, status LED
+
+// Each listening port takes at most RATE packets a second on average, and BURST at once;
+// anything more is dropped (and counted) before it is looked at.
+#define CONSOLE_RATE 20
+#define CONSOLE_BURST 40
+#define AMBIENT_RATE 1
+#define AMBIENT_BURST 5
+
+// How often (milliseconds) a listener that is dropping packets says so
+#define RATE_WARN_INTERVAL (10*1000)
+
 // Port used by the heater to broadcast information
 #define BROADCAST_PORT 3341
 
 // Address to brodcast to; usually this would be an "all" address
+// (The host build of the controller sets its own.)
+#ifndef BROADCAST_IP_ADDR
 #define BROADCAST_IP_ADDR "10.0.0.255"
+#endif
 
 // Frequency with which to broadcast messages, in milliseconds
 #define BROADCAST_INTERVAL (5*1000)
@@ -26,17 +84,28 @@
 // Pin used to drive the higher wattage heater element
 #define HWATT_PIN 10
 
-// Pin used to perform diagnostics on update.  This pin isn't used for anything
-// and isn't connected to anything.
-#define DIAGNOSTIC_PIN 4
+// After an update, how long (in seconds) the new image has to show that it is healthy before
+// we roll back to the old one, and how low the heap may get before we consider it unhealthy.
+#define OTA_HEALTH_DEADLINE 120
+#define OTA_HEALTH_MIN_HEAP (32 * 1024)
+
+// How often to update the status LED animation, in milliseconds
+#define LED_FRAME_INTERVAL 40
+
+// The value used to denote if there is no known / valid temperature reading (in centidegrees,
+// like all temperatures; see centideg_t in libdecls.h)
+#define NO_TEMP_VALUE (-10000)
 
-// The value used to denote if there is no known / valid temperature reading.
-#define NO_TEMP_VALUE -100.0
+// Any time (unix time) before this is the clock not having been set yet
+#define EARLIEST_VALID_TIME 1600000000
 
 // How long to trust the last-read temperature value for, before discarding it, 
 // in milliseconds
 #define READ_LIFETIME (30 * 60 * 1000)
 
+// How often to save the ambient temperature, so we can start from it after a reboot, in milliseconds
+#define AMBIENT_SAVE_INTERVAL (15 * 60 * 1000)
+
 // Maximum heater temperature to tolerate, in Celsius
 // The heater will be turned off if it reaches this temperature
 // Note my heater can reaches this temperature easily on high
@@ -46,6 +115,44 @@
 // Frequency with which to check and update the heater control, in milliseconds
 #define HEATER_UPDATE_INTERVAL (30*1000)
 
+// A control loop pass that starts more than this many milliseconds late counts as a missed deadline
+#define CONTROL_DEADLINE 500
+
+// Telemetry streaming:  fastest rate a subscriber may ask for, in milliseconds; how long
+// a subscription lasts unless it is renewed, in seconds; and how many delta frames to send
+// between full frames.
+#define TELEMETRY_MIN_PERIOD 500
+#define TELEMETRY_LEASE 60
+#define TELEMETRY_FULL_FRAME_INTERVAL 10
+
+// How often to broadcast a performance summary, in milliseconds
+#define PERF_INTERVAL (5*60*1000)
+
+// The per-minute history (see history.c) is kept in HISTORY_BLOCKS blocks of HISTORY_BLOCK_SIZE
+// bytes, about 6.5KB in all.  Most records are a single byte, but it is sized for two (while
+// the heater warms up or cools down, its temperature moves too fast for the one-byte form):
+// a block then holds (240 - 11) / 2 = 114 minutes, and the 26 full blocks besides the one
+// being filled hold 49 hours.  (At one byte a record, it is four days.)  A "history" command
+// sends back at most HISTORY_BATCH blocks (a datagram each).  HISTORY_BLOCK_SIZE + 16 must
+// fit in MESSAGE_LEN.
+#define HISTORY_BLOCKS 27
+#define HISTORY_BLOCK_SIZE 240
+#define HISTORY_BATCH 8
+
+// The long-term log of hourly summaries (see longlog.c) is kept in this flash partition (see
+// partitions.csv).  A "longlog" command sends back at most LONGLOG_CHUNKS datagrams of it.
+#define LONGLOG_PARTITION "longlog"
+#define LONGLOG_CHUNKS 8
+
+// Number of events the trace ring holds (32 bytes each; see trace.c), and how many
+// datagrams of them one "trace" command sends back at most
+#define TRACE_RECORDS 256
+#define TRACE_CHUNKS 8
+
+// Once boot is complete, the controller shouldn't need the heap:  everything it uses from
+// then on is static, pooled or on the stack.  Define HEAP_GUARD to check that (see perf.c):
+// 1 logs every allocation our code makes after boot, 2 aborts on it.
+// #define HEAP_GUARD 1
 
 // Maximum number of errors/messages to queue
 #define MESSAGE_QUEUE_SIZE 32
@@ -53,5 +160,21 @@
 // Maximum length of messages
 #define MESSAGE_LEN 256
 
+// A message that repeats one queued less than DEDUP_WINDOW milliseconds ago isn't queued again;
+// the repeats are counted, and summarized in one line once the window is up.  We keep track of
+// the last DEDUP_SLOTS different messages, and DEDUP_TEXT_LEN characters of each for the summary.
+#define DEDUP_WINDOW (60*1000)
+#define DEDUP_SLOTS 8
+#define DEDUP_TEXT_LEN 64
+
+// Each log tag may queue TAG_ERROR_RATE warnings and errors a minute on average, and
+// TAG_ERROR_BURST at once; past that they are counted and summarized.  TAG_SLOTS tags are limited.
+#define TAG_ERROR_RATE 10
+#define TAG_ERROR_BURST 10
+#define TAG_SLOTS 16
+
+// Maximum length of the request id a console command may carry
+#define REQUEST_ID_LEN 15
+
 // Note: the message buffers are pre-allocated, requiring a total of
 // 4 * MESSAGE_QUEUE_SIZE * MESSAGE_LEN  characters
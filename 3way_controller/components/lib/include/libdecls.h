@@ -1,19 +1,54 @@
 extern const char *version_string;      // main.c
 
-// read/write persistent storage values
-char *get_psv(const char *key);
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+enum power_level { power_off, power_low, power_medium, power_high, power_na };
+
+// Boot sequencing; see boot.c
+struct boot_stage {
+    const char *name;
+    int needs;          // bits of the stages that must be done first
+    int provides;       // our bit
+    int (*start)(void); // 0 if done, 1 if it will call boot_stage_done later
+};
+void run_boot(const struct boot_stage *table, int count);
+void boot_stage_done(int bit);
+void report_boot_times();
+int boot_is_complete();
+
+// read/write persistent storage values.  get_psv returns 0 and fills buf if the key is set.
+#define PSV_MAX_LEN 128
+int get_psv(const char *key, char *buf, int len);
 void set_psv(const char *key, const char *newval);
 
 // Time of day funtions
 void init_time();
 int update_time();
 int current_hour();
+#define TIME_STRING_LEN 30
 char *time_string(char *buf);
 
+// Temperatures are kept in hundredths of a degree Celsius:  the chip has no FPU, so this way
+// the whole pipeline, from parsing readings to deciding the power level, is integer arithmetic.
+// Configured temperatures (the schedule, the maximum) are still whole degrees.
+typedef int16_t centideg_t;
+#define CENTIDEG(degrees) ((centideg_t)((degrees) * 100))
+#define CENTIDEG_LEN 8          // room for centideg_string's result
+int parse_centideg(const char *s, centideg_t *val);
+char *centideg_string(centideg_t val, char *buf);
+
 // temperature sensing
-float current_ambient_temperature(); // in Celsius
-float current_heater_temperature();
-void init_temps();
+centideg_t current_ambient_temperature();
+centideg_t current_heater_temperature();
+centideg_t sample_heater_temperature();
+centideg_t sample_ambient_temperature();
+int current_ambient_slope();   // centidegrees per hour
+void init_heater_sensor();
+void init_ambient_listener();
+void restore_ambient_temperature();
+int64_t ambient_age();
+void restore_ambient(centideg_t val, int slope, int64_t age);
 void report_ambient_history_values();
 
 // temperature setting
@@ -22,48 +57,167 @@ void set_max_temperature(int val);
 void init_temperature_schedule();
 void set_temperature_schedule(const char *sched);
 void bump_temperature(int increment, int hours);
-float current_desired_temperature();
+int bump_remaining(int *temp);
+void restore_bump(int temp, int seconds);
+centideg_t current_desired_temperature();
 void report_temperature_schedule();
 
 // command listener
 void init_console();
 
 // Power controller
+struct control_inputs {
+    centideg_t desired, actual, heater, max;
+    enum power_level override;
+};
+enum power_level decide_power_level(const struct control_inputs *in, enum power_level previous, const char **reason);
 void set_power_level(char *level);
 void power_controller_start();
+enum power_level current_power_level();
+enum power_level current_power_override();
+void restore_power_level(enum power_level level, enum power_level override);
+TaskHandle_t power_controller_task();
+void last_control_inputs(struct control_inputs *in);
+void report_control_timing();
+void control_counters(uint32_t *passes, uint32_t *missed, uint32_t *switches);
+
+// Performance counters
+void init_perf();
+void report_perf();
+enum cycle_meter { METER_AMBIENT, METER_CONTROL, METER_COUNT };
+uint32_t meter_start();
+void meter_stop(enum cycle_meter meter, uint32_t start);
+
+// With HEAP_GUARD, our own heap use goes through perf.c to be counted and checked.
+// (So libdecls.h must be included after the standard headers, as it always is.)
+#ifdef HEAP_GUARD
+#include <stddef.h>
+void *guarded_malloc(size_t size, const char *file, int line);
+void *guarded_calloc(size_t n, size_t size, const char *file, int line);
+void *guarded_realloc(void *p, size_t size, const char *file, int line);
+#define malloc(size) guarded_malloc(size, __FILE__, __LINE__)
+#define calloc(n, size) guarded_calloc(n, size, __FILE__, __LINE__)
+#define realloc(p, size) guarded_realloc(p, size, __FILE__, __LINE__)
+#endif
+
+// Trace recording; see trace.c.  Records are 32 bytes, little endian as the chip is;
+// sync with host/replay.c and console.py.
+enum trace_type { TRACE_BOOT = 1, TRACE_DATAGRAM, TRACE_DROPPED, TRACE_SENSOR, TRACE_TIME,
+                  TRACE_DECISION, TRACE_OUTPUT };
+#define TRACE_TEXT_LEN 20
+struct trace_record {
+    uint32_t ms;                // since boot
+    uint8_t type;
+    uint8_t len;                // datagrams: how long it was (up to 255)
+    uint16_t arg;               // datagrams: port; decisions and outputs: the level
+    union {
+        struct {
+            uint32_t addr;
+            char text[TRACE_TEXT_LEN];  // the start of it; not null terminated
+        } datagram;
+        struct {
+            int16_t desired, actual, heater, max;
+            uint8_t override, previous;
+        } decision;
+        int32_t value;          // sensor: centidegrees; time: unix time
+    };
+};
+void init_trace();
+void trace_datagram(int port, uint32_t addr, const void *data, int len, int dropped);
+void trace_sensor(centideg_t val);
+void trace_time(int32_t unixtime);
+void trace_decision(const struct control_inputs *in, enum power_level previous, enum power_level level);
+void trace_output(enum power_level level);
+void send_trace(uint32_t from);
+
+// Per-minute history
+void init_history();
+void history_pass(const struct control_inputs *in, enum power_level level);
+void send_history(int from, int to);
+
+// Long-term log of hourly summaries, in flash
+void init_longlog();
+void longlog_pass(enum power_level level, centideg_t ambient, int overheating);
+void send_longlog(int from, int to);
+
+// Carrying state across restarts
+void save_warm_state();
+int restore_warm_state();
+
+// Binary state snapshot
+void send_snapshot();
+
+// HTTP metrics and status
+void init_http();
+
+// Telemetry streaming
+void init_telemetry();
+int telemetry_subscribe(void *sa, int mask, int period);
+void telemetry_unsubscribe(void *sa);
 
 // OTA (Over the Air) upgrade
-void ota_upgrade(const char *ipaddr, int expected_len);
+void ota_upgrade(const char *ipaddr, int expected_len, const char *sha_hex);
 void ota_check();
 
+// Health check bits; see ota_upgrade.c
+#define HEALTH_WIFI     0x01
+#define HEALTH_CONSOLE  0x02
+#define HEALTH_AMBIENT  0x04
+#define HEALTH_CONTROL  0x08
+#define HEALTH_ALL      0x0f
+void report_health(int bit);
+int ota_image_begin(const unsigned char *expected_sha);
+int ota_image_write(const unsigned char *data, int len);
+int ota_image_finish();
+void ota_image_abort();
+int report_running_image();
+
+// WIFI connection management
+void init_wifi();
+int wifi_wait_connected(TickType_t wait);
+int wifi_connected();
+int wifi_link_generation();
+void report_wifi();
+
 // Network actions
-void listener_task(const char *taskname, int port, int callback(void *, int));
+void listener_task(const char *taskname, int port, int priority, int rate, int burst,
+                   int callback(void *, int, int, void *));
+void report_listeners();
+int listener_stats(int i, int *port, int *received, int *dropped);
 int get_internet_data(const char *server, const char *path, char *fill_buffer, int fb_len);
 void init_broadcast_loop();
+TaskHandle_t broadcast_loop_task();
 
 // led status
 void init_status_led();
-void update_status_led();
 
 
 // message and error management
 void send_message(int severity,const char *message);
 void send_messagef(int severity,const char *fmt, ...);
+void send_logf(const char *tag, int severity, const char *fmt, ...);
 int process_message_queue(int sock, void *sa);
+void begin_reply(int sock, void *sa, const char *request_id);
+void end_reply(int status);
+void send_reply_data(const void *data, int len);
+void *reply_source();
 int error_count();
 int new_error_count();
+int dropped_message_count();
+void message_queue_stats(int *messages, int *messages_dropped, int *errors, int *errors_dropped);
+void message_filter_stats(int *repeats, int *limited);
 void report_errors();
 
 // duplicating ESP logging so we can also send and log it
 #define LOGE(tag,...) \
     ESP_LOGE(tag,__VA_ARGS__); \
-    send_messagef(2,__VA_ARGS__);
+    send_logf(tag,2,__VA_ARGS__);
 
 #define LOGW(tag,...) \
     ESP_LOGW(tag,__VA_ARGS__); \
-    send_messagef(1,__VA_ARGS__);
+    send_logf(tag,1,__VA_ARGS__);
 
 #define LOGI(tag,...) \
     ESP_LOGI(tag,__VA_ARGS__); \
-    send_messagef(0,__VA_ARGS__);
+    send_logf(tag,0,__VA_ARGS__);
 
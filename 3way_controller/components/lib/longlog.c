@@ -0,0 +1,400 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "libconfig.h"
+#include "libdecls.h"
+
+/*
+ * Long-term log:  for each hour, the lowest, highest and mean ambient temperature, how long
+ * the heater spent at each level (which, with the heater's wattages, is the energy used), how
+ * many times the relays switched and how many times it overheated; kept in flash, so that
+ * months of it are there for tuning the settings to the season.
+ *
+ * It goes in its own data partition (LONGLOG_PARTITION; see partitions.csv), written as an
+ * append-only log of 32 byte records.  Each flash sector starts with a header:
+ *     magic, sequence number (one more for each sector we start), how many times this sector
+ *     has been erased, version, record size, CRC
+ * followed by LONGLOG_PER_SECTOR records, written one after another into erased flash and
+ * never rewritten.  When a sector fills up we move on to the next one, erasing it (and losing
+ * the oldest records) when we come round to it again.  So every sector is erased once per
+ * trip around the partition (about eleven months at 64 sectors), and nothing else is erased
+ * at all; a restart carries on appending where the log left off.  Records have their own CRC,
+ * so one half written when the power went is just ignored.
+ *
+ * Records are numbered:  sector sequence number * LONGLOG_PER_SECTOR + slot.  The console
+ * "longlog <from> [to]" command sends records from..to-1 (a negative from counts back from
+ * the newest), oldest first, at most LONGLOG_CHUNKS datagrams at a time, as trace.c does:
+ *     "HCLL", uint8 version, uint8 record count, uint16 record size,
+ *     uint32 number of the first record, uint32 number of the next record to be written,
+ *     then the records, as they are in flash (unchecked; console.py checks their CRCs).
+ * The partition is memory mapped, so finding and sending records reads the flash in place.
+ *
+ * The control loop feeds in each pass (longlog_pass); the hour's record is written by a
+ * low priority task, so that the control loop doesn't wait on the flash, and what there is of
+ * the current hour is written when we restart.
+ */
+
+#define LONGLOG_MAGIC 0x4c4c4348        // "HCLL"
+#define LONGLOG_VERSION 1
+#define LONGLOG_INTERVAL 3600           // seconds per record
+#define LONGLOG_RECORD_SIZE 32
+#define LONGLOG_QUEUE 4                 // finished records waiting for the writer
+#define LONGLOG_PER_SECTOR ((SPI_FLASH_SEC_SIZE - sizeof(struct longlog_sector)) / LONGLOG_RECORD_SIZE)
+
+static const char *TAG = "longlog";
+
+struct longlog_sector {
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t erases;
+    uint8_t version;
+    uint8_t record_size;
+    uint16_t unused;
+    uint32_t reserved[3];
+    uint32_t crc;               // of everything above
+};
+
+struct longlog_record {
+    uint32_t start;             // unix time the hour began; 0 if the clock wasn't set
+    uint32_t uptime;            // seconds since boot when it began
+    uint16_t seconds;           // how much of the hour it covers
+    int16_t ambient_min;        // centidegrees; NO_TEMP_VALUE if there were no readings
+    int16_t ambient_max;
+    int16_t ambient_mean;
+    uint16_t level_seconds[4];  // at power_off, low, medium, high
+    uint16_t toggles;           // relay switchings
+    uint8_t overheats;          // times the heater went over the maximum
+    uint8_t flags;              // LONGLOG_BOOT if this is the first record since boot
+    uint32_t crc;               // of everything above
+};
+
+#define LONGLOG_BOOT 0x01
+
+struct __attribute__((packed)) longlog_chunk_header {
+    char magic[4];              // "HCLL"
+    uint8_t version;
+    uint8_t count;
+    uint16_t record_size;
+    uint32_t first;
+    uint32_t next;
+};
+
+#define RECORDS_PER_CHUNK ((MESSAGE_LEN - sizeof(struct longlog_chunk_header)) / LONGLOG_RECORD_SIZE)
+
+_Static_assert(sizeof(struct longlog_sector) == LONGLOG_RECORD_SIZE, "sector header is a record slot");
+_Static_assert(sizeof(struct longlog_record) == LONGLOG_RECORD_SIZE, "longlog record size");
+
+static const esp_partition_t *partition = NULL;
+static const uint8_t *flash;            // the partition, memory mapped
+static spi_flash_mmap_handle_t flash_handle;
+static int sectors;
+static int head = -1;                   // the sector being filled; -1 if none yet
+static uint32_t head_sequence;
+static int head_used;                   // records in it
+static uint32_t oldest_sequence;
+static SemaphoreHandle_t longlog_lock;  // for the above
+static QueueHandle_t longlog_queue;     // finished records, waiting to be written
+
+// The hour in progress (written by the control loop, under hour_lock)
+static struct {
+    int64_t key;                        // which hour:  unix hour, or -1 - hours since boot if the clock isn't set
+    struct longlog_record r;
+    int64_t level_us[4];                // time at each level so far
+    int32_t ambient_sum;
+    int ambient_count;
+    int64_t last_pass;                  // us since boot
+    enum power_level last_level;
+    int overheating;
+    int boot;
+} hour;
+static SemaphoreHandle_t hour_lock;
+
+static const struct longlog_sector *sector_header(int sector) {
+    return (const struct longlog_sector *)(flash + sector * SPI_FLASH_SEC_SIZE);
+}
+
+static int sector_valid(const struct longlog_sector *s) {
+    return s->magic == LONGLOG_MAGIC && s->record_size == LONGLOG_RECORD_SIZE &&
+           s->crc == esp_rom_crc32_le(0, (const uint8_t *)s, offsetof(struct longlog_sector, crc));
+}
+
+static int slot_empty(const uint8_t *p) {
+    for(int i = 0; i < LONGLOG_RECORD_SIZE; i++) {
+        if (p[i] != 0xff) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static const uint8_t *record_slot(int sector, int slot) {
+    return flash + sector * SPI_FLASH_SEC_SIZE + (slot + 1) * LONGLOG_RECORD_SIZE;
+}
+
+static uint32_t next_record() {
+    return head < 0 ? 0 : head_sequence * LONGLOG_PER_SECTOR + head_used;
+}
+
+// Erase the sector after the head and make it the head.  (Called with longlog_lock held.)
+static int start_sector() {
+    int next = (head + 1) % sectors;
+    struct longlog_sector s;
+    const struct longlog_sector *old = sector_header(next);
+
+    memset(&s, 0xff, sizeof(s));
+    s.magic = LONGLOG_MAGIC;
+    s.sequence = head < 0 ? 0 : head_sequence + 1;
+    s.erases = (sector_valid(old) ? old->erases : 0) + 1;
+    s.version = LONGLOG_VERSION;
+    s.record_size = LONGLOG_RECORD_SIZE;
+    s.crc = esp_rom_crc32_le(0, (const uint8_t *)&s, offsetof(struct longlog_sector, crc));
+
+    if (esp_partition_erase_range(partition, next * SPI_FLASH_SEC_SIZE, SPI_FLASH_SEC_SIZE) != ESP_OK ||
+        esp_partition_write(partition, next * SPI_FLASH_SEC_SIZE, &s, sizeof(s)) != ESP_OK) {
+        LOGE(TAG, "Unable to start sector %d", next);
+        return -1;
+    }
+    if (head >= 0 && s.sequence >= sectors) {
+        oldest_sequence = s.sequence - sectors + 1;
+    }
+    head = next;
+    head_sequence = s.sequence;
+    head_used = 0;
+    return 0;
+}
+
+static void append_record(struct longlog_record *r) {
+    r->crc = esp_rom_crc32_le(0, (const uint8_t *)r, offsetof(struct longlog_record, crc));
+    xSemaphoreTake(longlog_lock, portMAX_DELAY);
+    if (head < 0 || head_used == LONGLOG_PER_SECTOR) {
+        if (start_sector() < 0) {
+            xSemaphoreGive(longlog_lock);
+            return;
+        }
+    }
+    size_t offset = record_slot(head, head_used) - flash;
+    if (esp_partition_write(partition, offset, r, sizeof(*r)) != ESP_OK) {
+        LOGE(TAG, "Unable to write record at %u", (unsigned)offset);
+    }
+    // Used even if the write failed:  the slot may not be erased any more
+    head_used++;
+    xSemaphoreGive(longlog_lock);
+}
+
+static void longlog_task(void *arg) {
+    struct longlog_record r;
+    while(1) {
+        if (xQueueReceive(longlog_queue, &r, portMAX_DELAY)) {
+            append_record(&r);
+        }
+    }
+}
+
+// Close off the hour in progress, if it has anything in it.  (Called with hour_lock held.)
+static int finish_hour(struct longlog_record *r) {
+    int64_t total = 0;
+    *r = hour.r;
+    for(int i = 0; i < 4; i++) {
+        r->level_seconds[i] = (hour.level_us[i] + 500000) / 1000000;
+        total += hour.level_us[i];
+    }
+    r->seconds = (total + 500000) / 1000000;
+    if (r->seconds == 0 && hour.ambient_count == 0) {
+        return 0;
+    }
+    if (hour.ambient_count) {
+        r->ambient_mean = hour.ambient_sum / hour.ambient_count;
+    }
+    return 1;
+}
+
+static void start_hour(int64_t key, int64_t uptime) {
+    memset(&hour.r, 0, sizeof(hour.r));
+    hour.key = key;
+    hour.r.start = key >= 0 ? key * LONGLOG_INTERVAL : 0;
+    hour.r.uptime = uptime / 1000000;
+    hour.r.ambient_min = hour.r.ambient_max = hour.r.ambient_mean = NO_TEMP_VALUE;
+    hour.r.flags = hour.boot ? LONGLOG_BOOT : 0;
+    hour.boot = 0;
+    memset(hour.level_us, 0, sizeof(hour.level_us));
+    hour.ambient_sum = 0;
+    hour.ambient_count = 0;
+}
+
+/*
+ * Each control loop pass:  the level it has just set, the ambient temperature it went by,
+ * and whether the heater is over the maximum.
+ */
+void longlog_pass(enum power_level level, centideg_t ambient, int overheating) {
+    struct longlog_record done;
+    int64_t uptime = esp_timer_get_time();
+    time_t now = time(NULL);
+    int64_t key = now > EARLIEST_VALID_TIME ? now / LONGLOG_INTERVAL : -1 - uptime / (LONGLOG_INTERVAL * 1000000LL);
+    int finished = 0;
+
+    if (partition == NULL) {
+        return;
+    }
+    xSemaphoreTake(hour_lock, portMAX_DELAY);
+    if (hour.last_pass) {
+        // The time since the last pass was spent at the level that pass set
+        hour.level_us[hour.last_level] += uptime - hour.last_pass;
+    }
+    if (key != hour.key) {
+        finished = finish_hour(&done);
+        start_hour(key, uptime);
+    }
+    if (hour.last_pass) {
+        // The relay pins follow the level:  bit 0 is LWATT_PIN, bit 1 HWATT_PIN
+        hour.r.toggles += __builtin_popcount((hour.last_level ^ level) & 3);
+    }
+    if (overheating && !hour.overheating && hour.r.overheats < 255) {
+        hour.r.overheats++;
+    }
+    if (ambient != NO_TEMP_VALUE) {
+        if (hour.ambient_count == 0 || ambient < hour.r.ambient_min) {
+            hour.r.ambient_min = ambient;
+        }
+        if (hour.ambient_count == 0 || ambient > hour.r.ambient_max) {
+            hour.r.ambient_max = ambient;
+        }
+        hour.ambient_sum += ambient;
+        hour.ambient_count++;
+    }
+    hour.overheating = overheating;
+    hour.last_level = level;
+    hour.last_pass = uptime;
+    xSemaphoreGive(hour_lock);
+
+    if (finished && xQueueSend(longlog_queue, &done, 0) != pdTRUE) {
+        LOGW(TAG, "Long-term log writer is behind; dropped a record");
+    }
+}
+
+// Write out what there is of the current hour (and anything still queued) before a restart
+static void longlog_on_shutdown() {
+    struct longlog_record r;
+    while (xQueueReceive(longlog_queue, &r, 0)) {
+        append_record(&r);
+    }
+    xSemaphoreTake(hour_lock, portMAX_DELAY);
+    int finished = finish_hour(&r);
+    xSemaphoreGive(hour_lock);
+    if (finished) {
+        append_record(&r);
+    }
+}
+
+/*
+ * Send records from..to-1 (see above)
+ */
+void send_longlog(int from, int to) {
+    uint32_t buf[MESSAGE_LEN / 4];
+    struct longlog_chunk_header *h = (struct longlog_chunk_header *)buf;
+
+    if (partition == NULL) {
+        send_messagef(0, "No %s partition; there is no long-term log", LONGLOG_PARTITION);
+        return;
+    }
+    for(int chunk = 0; chunk < LONGLOG_CHUNKS; chunk++) {
+        xSemaphoreTake(longlog_lock, portMAX_DELAY);
+        uint32_t next = next_record();
+        uint32_t oldest = oldest_sequence * LONGLOG_PER_SECTOR;
+        uint32_t at = from < 0 ? ((uint32_t)-from > next ? 0 : next + from) : from;
+        uint32_t end = to <= 0 || (uint32_t)to > next ? next : to;
+        if (at < oldest) {
+            at = oldest;
+        }
+        if (at > end) {
+            at = end;
+        }
+        memcpy(h->magic, "HCLL", 4);
+        h->version = LONGLOG_VERSION;
+        h->record_size = LONGLOG_RECORD_SIZE;
+        h->first = at;
+        h->next = next;
+        h->count = 0;
+        uint8_t *records = (uint8_t *)(h + 1);
+        while (h->count < RECORDS_PER_CHUNK && at < end) {
+            uint32_t sequence = at / LONGLOG_PER_SECTOR;
+            int sector = (head - (int)(head_sequence - sequence) + sectors) % sectors;
+            memcpy(records + h->count * LONGLOG_RECORD_SIZE, record_slot(sector, at % LONGLOG_PER_SECTOR), LONGLOG_RECORD_SIZE);
+            h->count++;
+            at++;
+        }
+        xSemaphoreGive(longlog_lock);
+
+        send_reply_data(buf, sizeof(*h) + h->count * LONGLOG_RECORD_SIZE);
+        if (at == end) {
+            break;
+        }
+        from = at;
+    }
+}
+
+/*
+ * Find the log in its partition:  the newest sector is the one to carry on filling, from its
+ * first empty slot.
+ */
+void init_longlog() {
+    longlog_lock = xSemaphoreCreateMutex();
+    hour_lock = xSemaphoreCreateMutex();
+    hour.boot = 1;
+
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, LONGLOG_PARTITION);
+    if (partition == NULL) {
+        LOGE(TAG, "No %s partition; not keeping a long-term log", LONGLOG_PARTITION);
+        return;
+    }
+    if (esp_partition_mmap(partition, 0, partition->size, SPI_FLASH_MMAP_DATA, (const void **)&flash, &flash_handle) != ESP_OK) {
+        LOGE(TAG, "Unable to map the %s partition; not keeping a long-term log", LONGLOG_PARTITION);
+        partition = NULL;
+        return;
+    }
+    sectors = partition->size / SPI_FLASH_SEC_SIZE;
+
+    uint32_t max_erases = 0;
+    int valid = 0;
+    for(int i = 0; i < sectors; i++) {
+        const struct longlog_sector *s = sector_header(i);
+        if (!sector_valid(s)) {
+            continue;
+        }
+        if (head < 0 || s->sequence > head_sequence) {
+            head = i;
+            head_sequence = s->sequence;
+        }
+        if (!valid || s->sequence < oldest_sequence) {
+            oldest_sequence = s->sequence;
+        }
+        if (s->erases > max_erases) {
+            max_erases = s->erases;
+        }
+        valid++;
+    }
+    if (head >= 0) {
+        // Past any sector that was being started over when we went down
+        if (head_sequence - oldest_sequence >= sectors) {
+            oldest_sequence = head_sequence - sectors + 1;
+        }
+        while (head_used < LONGLOG_PER_SECTOR && !slot_empty(record_slot(head, head_used))) {
+            head_used++;
+        }
+    }
+    LOGI(TAG, "Long-term log: %u records, %d of %d sectors in use, most erased %u times",
+         (unsigned)(next_record() - oldest_sequence * LONGLOG_PER_SECTOR), valid, sectors, (unsigned)max_erases);
+
+    longlog_queue = xQueueCreate(LONGLOG_QUEUE, sizeof(struct longlog_record));
+    xTaskCreate(longlog_task, "longlog", 3072, NULL, PRIORITY_BACKGROUND, NULL);
+    esp_register_shutdown_handler(longlog_on_shutdown);
+}
@@ -2,7 +2,11 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "lwip/sockets.h"
 #include "libconfig.h"
 #include "libdecls.h"
@@ -23,6 +27,15 @@
  * 
  * There are two queues implemented exactly the same way:  the message queue, and
  * the error queue.  (What varies is when and how they are filled and emptied.)
+ *
+ * The exception is replies to console requests.  While a reply is in progress, informational
+ * messages sent from the task handling the request go straight back to the requester instead
+ * of being queued.  (Warnings and errors are queued as usual as well, so they still get logged.)
+ *
+ * So that a condition that keeps recurring can't crowd everything else out of the queues,
+ * what gets queued is filtered (see "Repeats and rate limits" below):  a message that repeats
+ * one queued within the last DEDUP_WINDOW is only counted, and later summarized in one line;
+ * and each tag gets only so many warnings and errors a minute.
  */
 
 static const char *TAG = "messages";
@@ -39,34 +52,216 @@ struct rrqueue {
     char *fill; // points to q1 or q2, whichever we are currently filling
     int i; // index of next slot to write in fill queue
     int has_wrapped;  // true if queue has already round-robined.
+    int dropped;  // number of messages overwritten before they could be processed
+    char *list[MESSAGE_QUEUE_SIZE+1];  // what fetch_rrqueue returns
 };
 
 static struct rrqueue message_queue;
 static struct rrqueue error_queue;
 
+// The reply in progress, if any.  Only the task that began the reply writes this.
+static struct {
+    TaskHandle_t task;  // NULL if there is no reply in progress
+    int sock;
+    struct sockaddr_in to;
+    char id[REQUEST_ID_LEN+1];  // empty if the requester didn't supply an id
+} reply;
+
+// Messages we have queued recently, to spot repeats.  A message is identified by a hash of
+// its text (and so, in effect, by where it comes from and what it says).
+struct recent_message {
+    uint32_t hash;              // 0 if the slot is free
+    int severity;
+    int count;                  // repeats since the first, not queued
+    int64_t first, last;        // esp_timer times of the first and latest
+    char text[DEDUP_TEXT_LEN];  // the start of it, for the summary
+};
+static struct recent_message recent[DEDUP_SLOTS];
+
+// Per-tag token buckets for warnings and errors (tokens in millionths, as in network.c)
+struct tag_limit {
+    const char *tag;            // NULL if the slot is free
+    int64_t tokens;
+    int64_t last_fill;
+    int suppressed;             // since the last summary
+    int64_t last_summary;
+};
+static struct tag_limit tag_limits[TAG_SLOTS];
+
+static int repeats_collapsed = 0;
+static int rate_limited = 0;
+
+// Every task that logs comes through here, and a higher priority one can preempt a lower
+// one part way through, so the queues, the tables above and the counts are only touched
+// with this held.  It covers just the bookkeeping:  replies and broadcasts go out without it.
+static SemaphoreHandle_t message_lock;
+
 // forward decl
 void init_rrqueue(struct rrqueue *q);
 void enqueue_rrqueue(struct rrqueue *q, const char *message);
 char **fetch_rrqueue(struct rrqueue *q);
+void send_reply_message(const char *message);
 
 
-/*
- * Accept messages for queuing.
- * Severity is 0=informational, 1=warning, 2=error.
- */
-
-void send_message(int severity, const char *message) {
+// The first message is sent from app_main before it starts any of our other tasks, so
+// there is no race to set things up.
+static void init_messages() {
     if (queues_init == 0) {
         init_rrqueue(&message_queue);
         init_rrqueue(&error_queue);
+        message_lock = xSemaphoreCreateMutex();
         queues_init = 1;
     }
+}
+
+static void queue_message(int severity, const char *message) {
     enqueue_rrqueue( &message_queue, message );
     if (severity > 0) {
         enqueue_rrqueue( &error_queue, message );
+    }
+}
+
+/*
+ * Repeats and rate limits
+ */
+
+// FNV-1a
+static uint32_t message_hash(const char *message) {
+    uint32_t h = 2166136261u;
+    for( ; *message; message++) {
+        h = (h ^ (unsigned char)*message) * 16777619u;
+    }
+    return h ? h : 1;
+}
+
+static int seconds_since_boot(int64_t t) {
+    return t / (1000 * 1000);
+}
+
+// Queue the summary of a message's repeats, if it had any, and free its slot.
+static void summarize_repeats(struct recent_message *r) {
+    if (r->count) {
+        char buf[MESSAGE_LEN];
+        snprintf(buf, sizeof(buf), "Repeated %d more times from %d to %d s: %s", r->count,
+                 seconds_since_boot(r->first), seconds_since_boot(r->last), r->text);
+        queue_message(r->severity, buf);
+    }
+    r->hash = 0;
+}
+
+// Summarize whatever has been held back for long enough.
+static void flush_repeats(int64_t now) {
+    for(int i = 0; i < DEDUP_SLOTS; i++) {
+        if (recent[i].hash && now - recent[i].first >= DEDUP_WINDOW * 1000LL) {
+            summarize_repeats(&recent[i]);
+        }
+    }
+    for(int i = 0; i < TAG_SLOTS; i++) {
+        struct tag_limit *t = &tag_limits[i];
+        if (t->suppressed && now - t->last_summary >= DEDUP_WINDOW * 1000LL) {
+            char buf[MESSAGE_LEN];
+            snprintf(buf, sizeof(buf), "%s: %d more warnings and errors held back (over %d a minute)",
+                     t->tag, t->suppressed, TAG_ERROR_RATE);
+            queue_message(1, buf);
+            t->suppressed = 0;
+            t->last_summary = now;
+        }
+    }
+}
+
+// Returns 1 if message repeats one queued within the window (and counts it), else 0,
+// having noted message as the latest of its kind.
+static int is_repeat(int severity, const char *message, int64_t now) {
+    uint32_t hash = message_hash(message);
+    struct recent_message *slot = NULL;
+
+    for(int i = 0; i < DEDUP_SLOTS; i++) {
+        if (recent[i].hash == hash) {
+            recent[i].count++;
+            recent[i].last = now;
+            repeats_collapsed++;
+            return 1;
+        }
+        // Otherwise we'll use a free slot, or failing that the oldest one
+        if (recent[i].hash == 0) {
+            if (slot == NULL || slot->hash != 0) {
+                slot = &recent[i];
+            }
+        }
+        else if (slot == NULL || (slot->hash != 0 && recent[i].first < slot->first)) {
+            slot = &recent[i];
+        }
+    }
+    summarize_repeats(slot);
+    slot->hash = hash;
+    slot->severity = severity;
+    slot->count = 0;
+    slot->first = slot->last = now;
+    strncpy(slot->text, message, DEDUP_TEXT_LEN-1);
+    slot->text[DEDUP_TEXT_LEN-1] = 0;
+    return 0;
+}
+
+// Returns 1 if tag may queue another warning or error, else 0 (and counts it).
+static int tag_allows(const char *tag, int64_t now) {
+    struct tag_limit *t = NULL;
+    for(int i = 0; i < TAG_SLOTS && t == NULL; i++) {
+        if (tag_limits[i].tag == tag || tag_limits[i].tag == NULL) {
+            t = &tag_limits[i];
+        }
+    }
+    if (t == NULL) {
+        return 1;   // more tags than slots; they go unlimited
+    }
+    if (t->tag == NULL) {
+        t->tag = tag;
+        t->tokens = TAG_ERROR_BURST * 1000000LL;
+        t->last_fill = now;
+    }
+    t->tokens += (now - t->last_fill) * TAG_ERROR_RATE / 60;
+    t->last_fill = now;
+    if (t->tokens > TAG_ERROR_BURST * 1000000LL) {
+        t->tokens = TAG_ERROR_BURST * 1000000LL;
+    }
+    if (t->tokens < 1000000LL) {
+        t->suppressed++;
+        rate_limited++;
+        return 0;
+    }
+    t->tokens -= 1000000LL;
+    return 1;
+}
+
+/*
+ * Accept messages for queuing.
+ * Severity is 0=informational, 1=warning, 2=error.  tag (if not NULL) is the ESP log tag
+ * of whoever is logging it, for rate limiting.
+ */
+
+static void accept_message(const char *tag, int severity, const char *message) {
+    init_messages();
+    if (reply.task && reply.task == xTaskGetCurrentTaskHandle()) {
+        send_reply_message(message);
+        if (severity == 0) {
+            return;
+        }
+    }
+
+    int64_t now = esp_timer_get_time();
+    xSemaphoreTake(message_lock, portMAX_DELAY);
+    if (severity > 0) {
         err_count++;
         new_errors++;
     }
+    flush_repeats(now);
+    if ((severity == 0 || tag == NULL || tag_allows(tag, now)) && !is_repeat(severity, message, now)) {
+        queue_message(severity, message);
+    }
+    xSemaphoreGive(message_lock);
+}
+
+void send_message(int severity, const char *message) {
+    accept_message(NULL, severity, message);
 }
 
 void send_messagef(int severity,const char *fmt, ...) {
@@ -77,7 +272,89 @@ void send_messagef(int severity,const char *fmt, ...) {
     vsnprintf( buf, MESSAGE_LEN, fmt, args );
     va_end(args);
     
-    send_message(severity, buf);
+    accept_message(NULL, severity, buf);
+}
+
+void send_logf(const char *tag, int severity, const char *fmt, ...) {
+    char buf[MESSAGE_LEN];
+
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf( buf, MESSAGE_LEN, fmt, args );
+    va_end(args);
+
+    accept_message(tag, severity, buf);
+}
+
+
+/*
+ * Replies.  The console calls begin_reply when it starts handling a request and end_reply
+ * when it is done.  If the request carried an id, every reply line is prefixed with it, and
+ * end_reply sends a final "#<id> ok" (or "#<id> err") line so the requester knows the 
+ * reply is complete.
+ */
+
+void begin_reply(int sock, void *sa, const char *request_id) {
+    reply.sock = sock;
+    memcpy(&reply.to, sa, sizeof(reply.to));
+    strncpy(reply.id, request_id ? request_id : "", REQUEST_ID_LEN);
+    reply.id[REQUEST_ID_LEN] = 0;
+    reply.task = xTaskGetCurrentTaskHandle();
+}
+
+void end_reply(int status) {
+    if (reply.id[0]) {
+        send_reply_message(status == 0 ? "ok" : "err");
+    }
+    reply.task = NULL;
+}
+
+// The address of the requester, if a reply is in progress (otherwise NULL)
+void *reply_source() {
+    return reply.task ? &reply.to : NULL;
+}
+
+/*
+ * Send arbitrary (e.g. binary) data as a reply.  It is prefixed with the request id
+ * just like a text message.
+ */
+void send_reply_data(const void *data, int len) {
+    char buf[REQUEST_ID_LEN + MESSAGE_LEN + 2];
+    int idlen = 0;
+
+    if (reply.task == NULL) {
+        return;
+    }
+    if (reply.id[0]) {
+        idlen = sprintf(buf, "#%s ", reply.id);
+    }
+    if (idlen + len > sizeof(buf)) {
+        LOGE(TAG, "Reply of %d bytes is too long", len);
+        return;
+    }
+    memcpy(buf+idlen, data, len);
+    if ( sendto(reply.sock, buf, idlen+len, 0, (struct sockaddr *)&reply.to, sizeof(reply.to)) < 0 ) {
+        ESP_LOGE(TAG, "Error occurred sending reply: errno %d", errno);
+    }
+}
+
+void send_reply_message(const char *message) {
+    char buf[REQUEST_ID_LEN + MESSAGE_LEN + 2];
+    int len;
+
+    if (reply.id[0]) {
+        len = snprintf(buf, sizeof(buf), "#%s %s", reply.id, message);
+    }
+    else {
+        len = snprintf(buf, sizeof(buf), "%s", message);
+    }
+    if (len >= sizeof(buf)) {
+        len = sizeof(buf)-1;
+    }
+    // Don't use LOGE here; it would just try to reply again.
+    if ( sendto(reply.sock, buf, len, 0, (struct sockaddr *)&reply.to, sizeof(reply.to)) < 0 ) {
+        ESP_LOGE(TAG, "Error occurred sending reply: errno %d", errno);
+    }
 }
 
 
@@ -95,6 +372,29 @@ int new_error_count() {
     return new_errors;
 }
 
+int dropped_message_count() {
+    return message_queue.dropped;
+}
+
+static int queue_fill(struct rrqueue *q) {
+    return q->has_wrapped ? MESSAGE_QUEUE_SIZE : q->i;
+}
+
+// How full the message and error queues are (out of MESSAGE_QUEUE_SIZE), and how many
+// messages each has lost.
+void message_queue_stats(int *messages, int *messages_dropped, int *errors, int *errors_dropped) {
+    *messages = queue_fill(&message_queue);
+    *messages_dropped = message_queue.dropped;
+    *errors = queue_fill(&error_queue);
+    *errors_dropped = error_queue.dropped;
+}
+
+// How many messages were held back as repeats, and by the per-tag limits
+void message_filter_stats(int *repeats, int *limited) {
+    *repeats = repeats_collapsed;
+    *limited = rate_limited;
+}
+
 void report_errors() {
     // All we do here is set the "report requested" variable.
     // Process_message_queue takes care of it next time it runs.
@@ -115,14 +415,13 @@ int send_a_message(int sock, void *sa, char *m) {
 }
 
 int process_message_queue(int sock, void *sa) {
-    if (queues_init == 0) {
-        init_rrqueue(&message_queue);
-        init_rrqueue(&error_queue);
-        queues_init = 1;
-    }
+    init_messages();
 
+    xSemaphoreTake(message_lock, portMAX_DELAY);
+    flush_repeats(esp_timer_get_time());
     int didoverflow = message_queue.has_wrapped;
     char **mlist = fetch_rrqueue(&message_queue);
+    xSemaphoreGive(message_lock);
     char **mp;
     int err = 0;
 
@@ -140,16 +439,17 @@ int process_message_queue(int sock, void *sa) {
             err = send_a_message(sock, sa, *mp);
             mp++;
         }
-        free(mlist);
     }
 
     // If we're also supposed to send errors, do that too.
     // We don't worry about overflow here --- since we're only doing occassional, user-requested, 
     // reports, we expect overflow to happen.
     if (report_requested && err == 0) {
+        xSemaphoreTake(message_lock, portMAX_DELAY);
         mlist = fetch_rrqueue(&error_queue);
         int nerrs = new_errors;
         new_errors = 0;
+        xSemaphoreGive(message_lock);
         report_requested = 0;
         if (mlist) {
             char msgbuf[64];
@@ -161,7 +461,6 @@ int process_message_queue(int sock, void *sa) {
                 mp++;
             }
             send_a_message(sock, sa, "End Error Report");        
-            free(mlist);
         }
         else {
             send_a_message(sock, sa, "No new Error Messages to report.");
@@ -179,9 +478,11 @@ int process_message_queue(int sock, void *sa) {
  * Each queue is actually implemented as two queues.  This is so that that one is always
  * available to be inserted into, while the other might be being processed.
  * 
- * We don't worry about mutex issues regarding adding to the queues because this
- * is an RT system which won't switch tasks until they block, and all the queue
- * manipulation is non-blocking.
+ * Adding to a queue and fetching from it are done with message_lock held (see
+ * accept_message and process_message_queue):  the tasks that log run at different
+ * priorities, and one can preempt another in the middle of an enqueue.  The consumer
+ * sends what it fetched without the lock, which is safe because until the next fetch
+ * everything new goes into the other half.
  * 
  * It is important, however, that there is only a single queue consumer, so the 
  * activities of processing a queue, and swapping between them, are also safe.
@@ -207,6 +508,7 @@ void init_rrqueue(struct rrqueue *q) {
     q->fill = q->q1;
     q->i = 0;
     q->has_wrapped = 0;
+    q->dropped = 0;
 }
 
 void enqueue_rrqueue(struct rrqueue *q, const char *message) {
@@ -215,6 +517,9 @@ void enqueue_rrqueue(struct rrqueue *q, const char *message) {
             q->i = 0;
             q->has_wrapped = 1;
         }
+        if (q->has_wrapped) {
+            q->dropped++;
+        }
         int len = strlen(message);
         if (len >= MESSAGE_LEN) {
             len = MESSAGE_LEN - 1;
@@ -232,6 +537,7 @@ void enqueue_rrqueue(struct rrqueue *q, const char *message) {
  * queues so that any new input goes to the other queue.  Will return NULL if there are no
  * items to process, otherwise a NULL-terminated array of pointers to the individual messages,
  * in proper order (accounting for round-robining)
+ * The array belongs to the queue, and is good until the next fetch (there is only one consumer).
  */
 char **fetch_rrqueue(struct rrqueue *q) {
     if ( q->i == 0 && q->has_wrapped == 0 ) {
@@ -249,8 +555,7 @@ char **fetch_rrqueue(struct rrqueue *q) {
     q->has_wrapped = 0;
 
     // build a list of pointers to return
-    int count = (has_wrapped ? MESSAGE_QUEUE_SIZE : top);    
-    char **result = malloc((count+1) * sizeof(char *));
+    char **result = q->list;
     int bp, rp = 0;
 
     // Fill result array.
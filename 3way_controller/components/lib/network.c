@@ -2,6 +2,7 @@
 #include <string.h>
 #include <stdio.h>
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "lwip/err.h"
 #include "lwip/sockets.h"
 #include "lwip/sys.h"
@@ -24,16 +25,68 @@
  * This function is parameterized by a callback that actually handles the data received,
  * and it runs as a task loop (so it should be the last thing called in an independent
  * vTask)
+ * The callback is also given the listening socket and the sender's address (a 
+ * struct sockaddr_in), so it can reply directly to the sender if it wants to.
  */
 
+/*
+ * Each listener has a token bucket:  it holds up to burst tokens and gains rate of them a
+ * second; every packet takes one, and a packet that finds the bucket empty is dropped
+ * without being passed on.  So however hard someone hammers a port, its callback runs at
+ * most rate times a second on average.  Tokens are kept in millionths, to go with esp_timer.
+ */
+#define TOKEN 1000000LL
+
 struct argsholder {
-    char *taskname;
+    char taskname[24];
     int port;
-    int (*callback)(void *, int);
+    int (*callback)(void *, int, int, void *);
+    int rate;
+    int burst;
+    int64_t tokens;
+    int64_t last_fill;
+    int received;
+    int dropped;
+    int dropped_unreported;
+    int64_t last_warning;
 };
 
+// Listeners are set up once, at boot, so their arguments come from a fixed pool.
+#define MAX_LISTENERS 4
+static struct argsholder listeners[MAX_LISTENERS];
+static int listener_count = 0;
+
 #define BUFLEN 1048
 
+// Take a token for a packet arriving now, if there is one.
+static int take_token(struct argsholder *args) {
+    int64_t now = esp_timer_get_time();
+    args->tokens += (now - args->last_fill) * args->rate;
+    args->last_fill = now;
+    if (args->tokens > args->burst * TOKEN) {
+        args->tokens = args->burst * TOKEN;
+    }
+    if (args->tokens < TOKEN) {
+        return 0;
+    }
+    args->tokens -= TOKEN;
+    return 1;
+}
+
+// Count a dropped packet, and mention it now and then (not every time, or the warnings
+// would flood the message queue in turn).
+static void drop_packet(struct argsholder *args) {
+    int64_t now = esp_timer_get_time();
+    args->dropped++;
+    args->dropped_unreported++;
+    if (now - args->last_warning > RATE_WARN_INTERVAL * 1000LL) {
+        LOGW(args->taskname, "Over %d packets/s on port %d; dropped %d", args->rate, args->port,
+             args->dropped_unreported);
+        args->dropped_unreported = 0;
+        args->last_warning = now;
+    }
+}
+
 
 void listener_loop(struct argsholder *args) {
     unsigned char rx_buffer[BUFLEN];
@@ -43,8 +96,11 @@ void listener_loop(struct argsholder *args) {
             .sin_port = htons(args->port),
             .sin_addr.s_addr = htonl(INADDR_ANY)
         };
+    // Wake up every so often to see whether the link has been re-established (see wifi.c)
+    struct timeval check_interval = { .tv_sec = NETWORK_CHECK_INTERVAL / 1000 };
 
     while (1) {
+        int generation = wifi_link_generation();
         int sock = socket(AF_INET, SOCK_DGRAM, 0);
         if (sock < 0) {
             LOGE(tag, "Unable to create socket: errno %d", errno);
@@ -56,20 +112,39 @@ void listener_loop(struct argsholder *args) {
             LOGE(tag, "Socket unable to bind: errno %d", errno);
             break;
         }
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &check_interval, sizeof(check_interval));
+        if (args->port == CNTRL_PORT) {
+            report_health(HEALTH_CONSOLE);
+        }
 
         while (1) {
-            int received_len = recv(sock, rx_buffer, sizeof(rx_buffer), 0);
-
-            if (received_len < 0) {
+            struct sockaddr_in source;
+            socklen_t source_len = sizeof(source);
+            // Leave room for callers to null-terminate what they receive
+            int received_len = recvfrom(sock, rx_buffer, sizeof(rx_buffer)-1, 0, (struct sockaddr *)&source, &source_len);
+
+            if (received_len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (wifi_link_generation() != generation) {
+                    LOGI(tag, "Link changed; rebinding");
+                    break;
+                }
+            }
+            else if (received_len < 0) {
                 LOGE(tag, "receive failed: errno %d", errno);
                 break;
             }
+            else if (take_token(args)) {
+                args->received++;
+                trace_datagram(args->port, source.sin_addr.s_addr, rx_buffer, received_len, 0);
+                args->callback(rx_buffer, received_len, sock, &source);
+            }
             else {
-                args->callback(rx_buffer, received_len);
+                trace_datagram(args->port, source.sin_addr.s_addr, rx_buffer, received_len, 1);
+                drop_packet(args);
             }
         }
 
-        LOGW(tag, "Shutting down socket and restarting");
+        ESP_LOGW(tag, "Shutting down socket and restarting");
         close(sock);
     }
 
@@ -78,12 +153,40 @@ void listener_loop(struct argsholder *args) {
 }
 
 
-void listener_task(const char *taskname, int port, int callback(void *, int)) {
-    struct argsholder *args = malloc(sizeof *args);
-    args->taskname = strcpy(malloc(strlen(taskname)+1), taskname);
+void listener_task(const char *taskname, int port, int priority, int rate, int burst,
+                   int callback(void *, int, int, void *)) {
+    if (listener_count == MAX_LISTENERS) {
+        LOGE("listener", "No room for listener %s; increase MAX_LISTENERS", taskname);
+        return;
+    }
+    struct argsholder *args = &listeners[listener_count++];
+    strncpy(args->taskname, taskname, sizeof(args->taskname)-1);
     args->port = port;
     args->callback = callback;
-    xTaskCreate((TaskFunction_t)listener_loop, taskname, 4096, args, 5, NULL);
+    args->rate = rate;
+    args->burst = burst;
+    args->tokens = burst * TOKEN;
+    args->last_fill = esp_timer_get_time();
+    xTaskCreate((TaskFunction_t)listener_loop, taskname, 4096, args, priority, NULL);
+}
+
+void report_listeners() {
+    for(int i = 0; i < listener_count; i++) {
+        struct argsholder *args = &listeners[i];
+        send_messagef(0, "perf: port %d (%s) limit %d/s burst %d: %d received, %d dropped", args->port,
+            args->taskname, args->rate, args->burst, args->received, args->dropped);
+    }
+}
+
+// Listener i's port and packet counts, for the metrics endpoint; -1 past the last one
+int listener_stats(int i, int *port, int *received, int *dropped) {
+    if (i >= listener_count) {
+        return -1;
+    }
+    *port = listeners[i].port;
+    *received = listeners[i].received;
+    *dropped = listeners[i].dropped;
+    return 0;
 }
 
 
@@ -162,6 +265,12 @@ int get_internet_data(const char *server, const char *path, char *fill_buffer, i
     return 0;
 }
 
+static TaskHandle_t broadcast_task = NULL;
+
+TaskHandle_t broadcast_loop_task() {
+    return broadcast_task;
+}
+
 /* 
  * This behaves just like the listener loop, except that it is a sender,
  * and the action is hard-wired, not parameterizable.
@@ -188,13 +297,16 @@ void broadcast_loop() {
             break;
         }
 
-        // use socket until it breaks
+        // use socket until it breaks, or the link is re-established.
         // note if it breaks in the middle of a queue, we'll loose some messages;
-        // ok for now
+        // ok for now.  While the link is down, we just let the messages queue up.
+        int generation = wifi_link_generation();
         do {
-            update_status_led();
             vTaskDelay(  BROADCAST_INTERVAL / portTICK_PERIOD_MS );
-            ret = process_message_queue(sock, &addr);
+            if (wifi_link_generation() != generation) {
+                break;
+            }
+            ret = wifi_connected() ? process_message_queue(sock, &addr) : 0;
         } while (ret >= 0);
 
         ESP_LOGI(tag, "Shutting down socket and restarting");
@@ -206,6 +318,5 @@ void broadcast_loop() {
 }
 
 void init_broadcast_loop() {
-    init_status_led();
-    xTaskCreate(broadcast_loop, "broadcast_loop", 4096, NULL, 5, NULL);
+    xTaskCreate(broadcast_loop, "broadcast_loop", 4096, NULL, PRIORITY_NETWORK, &broadcast_task);
 }
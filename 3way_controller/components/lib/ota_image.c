@@ -0,0 +1,496 @@
+#include <stdio.h>
+#include <string.h>
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_ota_ops.h"
+#include "mbedtls/sha256.h"
+#include "esp32c3/rom/miniz.h"
+#include "libconfig.h"
+#include "libdecls.h"
+
+/*
+ * Decoding of OTA images, and writing them to flash.  ota_upgrade.c takes care of getting
+ * the bytes here; this file figures out what they mean.
+ *
+ * We accept either a plain application image (exactly what the build produces) or a packed
+ * image (produced by ota_pack.py), which is a header followed by a payload:
+ *
+ *     magic "HCOT", version, flags, header length, payload length, image length, image sha256
+ *
+ * If the OTA_DEFLATE flag is set the payload is a raw deflate stream, which we inflate as it
+ * arrives, using a window of OTA_INFLATE_WINDOW bytes.  (The packer limits the compressor
+ * to the same window size.)  The inflater is the miniz one that is in the ESP32-C3 ROM.
+ *
+ * If the OTA_DELTA flag is set, the (inflated) payload is not the image itself but a patch
+ * to apply to the image we are currently running:
+ *
+ *     magic "HCDL", source length, source sha256, then a series of operations:
+ *     'A' <offset> <length> <length bytes>:  add these bytes to the source bytes starting at offset
+ *     'I' <length> <length bytes>:           insert these bytes as-is
+ *     'E':                                   end of patch
+ *
+ * (Numbers are little-endian uint32.)  An "add" of all zeros is a copy, and code that has
+ * merely moved turns into mostly zeros too, which compresses very well.  Before we apply a
+ * patch, we check that the running image really is the one it was made against.
+ *
+ * For packed images, the length and hash of what we wrote must match the header, or the
+ * image is rejected before we ever boot it.  The update command can also give us the hash
+ * of the image (which is the only check a raw image gets, beyond its own checksum).
+ */
+
+static const char *TAG = "ota_image";
+
+#define OTA_MAGIC "HCOT"
+#define OTA_VERSION 1
+
+// header flags
+#define OTA_DEFLATE 0x01
+#define OTA_DELTA   0x02
+#define OTA_KNOWN_FLAGS (OTA_DEFLATE | OTA_DELTA)
+
+#define DELTA_MAGIC "HCDL"
+#define DELTA_HEADER_LEN (4 + 4 + 32)
+
+struct __attribute__((packed)) ota_header {
+    char magic[4];
+    uint8_t version;
+    uint8_t flags;
+    uint16_t header_len;        // so later versions can add fields
+    uint32_t payload_len;       // bytes following the header
+    uint32_t image_len;         // bytes of application image
+    uint8_t image_sha256[32];
+};
+
+enum decode_state { DECODE_HEADER, DECODE_RAW, DECODE_PAYLOAD };
+enum delta_state { DELTA_HEADER, DELTA_OP, DELTA_ADD, DELTA_INSERT, DELTA_END };
+
+static struct {
+    const esp_partition_t *partition;
+    esp_ota_handle_t handle;
+    enum decode_state state;
+    int packed;                 // true if we got a header
+    struct ota_header header;
+    int header_fill;            // bytes of header received so far
+    uint32_t payload_left;
+    mbedtls_sha256_context sha;
+    int length;                 // bytes written to flash
+    int64_t write_time;
+    size_t window_pos;
+    int inflate_done;
+    int check_sha;              // true if we were told what hash to expect
+    unsigned char expected_sha[32];
+} image;
+
+static tinfl_decompressor inflator;
+static unsigned char inflate_window[OTA_INFLATE_WINDOW];
+
+static struct {
+    const esp_partition_t *source;
+    enum delta_state state;
+    unsigned char op[DELTA_HEADER_LEN];    // header or operation being collected
+    int op_fill;
+    uint32_t source_len;
+    uint32_t offset;            // where the current "add" is in the source
+    uint32_t left;              // bytes left in the current operation
+} delta;
+
+static unsigned char delta_window[OTA_DELTA_WINDOW];
+
+
+static int write_flash(const unsigned char *data, int len) {
+    int64_t start = esp_timer_get_time();
+    esp_err_t err = esp_ota_write(image.handle, data, len);
+    image.write_time += esp_timer_get_time() - start;
+    if (err != ESP_OK) {
+        LOGE(TAG, "esp_ota_write failed (%s)", esp_err_to_name(err));
+        return -1;
+    }
+    mbedtls_sha256_update_ret(&image.sha, data, len);
+    image.length += len;
+    return 0;
+}
+
+/*
+ * Patching.
+ */
+
+// Collect bytes into delta.op until it holds want bytes.  Returns true once it does.
+static int collect(const unsigned char **data, int *len, int want) {
+    int take = want - delta.op_fill;
+    if (take > *len) {
+        take = *len;
+    }
+    memcpy(delta.op + delta.op_fill, *data, take);
+    delta.op_fill += take;
+    *data += take;
+    *len -= take;
+    return delta.op_fill == want;
+}
+
+static uint32_t op_number(int at) {
+    uint32_t n;
+    memcpy(&n, delta.op + at, 4);
+    return n;
+}
+
+// Make sure we are running the image the patch was made against:  -2 if we aren't.
+static int check_source(const unsigned char *expected_sha) {
+    mbedtls_sha256_context sha;
+    unsigned char actual_sha[32];
+    int err = 0;
+
+    delta.source = esp_ota_get_running_partition();
+    if (delta.source == NULL || delta.source_len > delta.source->size) {
+        LOGE(TAG, "Patch source is larger than the running partition");
+        return -1;
+    }
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts_ret(&sha, 0);
+    for(uint32_t at = 0; at < delta.source_len && err == 0; at += OTA_DELTA_WINDOW) {
+        int n = (delta.source_len - at < OTA_DELTA_WINDOW ? delta.source_len - at : OTA_DELTA_WINDOW);
+        err = esp_partition_read(delta.source, at, delta_window, n);
+        mbedtls_sha256_update_ret(&sha, delta_window, n);
+    }
+    mbedtls_sha256_finish_ret(&sha, actual_sha);
+    mbedtls_sha256_free(&sha);
+
+    if (err != ESP_OK || memcmp(actual_sha, expected_sha, sizeof(actual_sha)) != 0) {
+        LOGE(TAG, "Patch does not apply to the running image; send the full image instead");
+        return -2;
+    }
+    LOGI(TAG, "Patching running image (%u bytes)", delta.source_len);
+    return 0;
+}
+
+// Add len bytes of data to the source at delta.offset, and write the result.
+static int apply_add(const unsigned char *data, int len) {
+    while (len > 0) {
+        int n = (len < OTA_DELTA_WINDOW ? len : OTA_DELTA_WINDOW);
+        if (esp_partition_read(delta.source, delta.offset, delta_window, n) != ESP_OK) {
+            LOGE(TAG, "Unable to read running image at %u", delta.offset);
+            return -1;
+        }
+        for(int i = 0; i < n; i++) {
+            delta_window[i] += data[i];
+        }
+        if (write_flash(delta_window, n) < 0) {
+            return -1;
+        }
+        delta.offset += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int patch(const unsigned char *data, int len) {
+    while (len > 0) {
+        switch (delta.state) {
+            case DELTA_HEADER:
+                if (!collect(&data, &len, DELTA_HEADER_LEN)) {
+                    break;
+                }
+                if (memcmp(delta.op, DELTA_MAGIC, 4) != 0) {
+                    LOGE(TAG, "Patch has a bad header");
+                    return -1;
+                }
+                delta.source_len = op_number(4);
+                int err = check_source(delta.op + 8);
+                if (err < 0) {
+                    return err;
+                }
+                delta.op_fill = 0;
+                delta.state = DELTA_OP;
+                break;
+
+            case DELTA_OP: {
+                // The operation byte says how long the rest is.  Either may be split across
+                // calls; if we have the byte already, it is in delta.op[0].
+                if (delta.op_fill == 0) {
+                    collect(&data, &len, 1);
+                }
+                char op = delta.op[0];
+                int want = (op == 'A' ? 9 : op == 'I' ? 5 : 1);
+                if (!collect(&data, &len, want)) {
+                    break;
+                }
+                delta.op_fill = 0;
+                if (op == 'A') {
+                    delta.offset = op_number(1);
+                    delta.left = op_number(5);
+                    if (delta.offset + delta.left > delta.source_len || delta.offset + delta.left < delta.offset) {
+                        LOGE(TAG, "Patch refers outside of the source image");
+                        return -1;
+                    }
+                    delta.state = DELTA_ADD;
+                }
+                else if (op == 'I') {
+                    delta.left = op_number(1);
+                    delta.state = DELTA_INSERT;
+                }
+                else if (op == 'E') {
+                    delta.state = DELTA_END;
+                }
+                else {
+                    LOGE(TAG, "Unknown patch operation %d", op);
+                    return -1;
+                }
+                break;
+            }
+
+            case DELTA_ADD:
+            case DELTA_INSERT: {
+                int n = (len < delta.left ? len : delta.left);
+                int err = (delta.state == DELTA_ADD ? apply_add(data, n) : write_flash(data, n));
+                if (err < 0) {
+                    return -1;
+                }
+                data += n;
+                len -= n;
+                delta.left -= n;
+                if (delta.left == 0) {
+                    delta.state = DELTA_OP;
+                }
+                break;
+            }
+
+            case DELTA_END:
+                LOGE(TAG, "Data after the end of the patch");
+                return -1;
+        }
+    }
+    return 0;
+}
+
+// Pass decoded payload on to be patched or written, as appropriate.
+static int emit(const unsigned char *data, int len) {
+    if (image.header.flags & OTA_DELTA) {
+        return patch(data, len);
+    }
+    return write_flash(data, len);
+}
+
+static int inflate(const unsigned char *data, int len) {
+    tinfl_status status = TINFL_STATUS_NEEDS_MORE_INPUT;
+
+    do {
+        size_t in_bytes = len;
+        size_t out_bytes = OTA_INFLATE_WINDOW - image.window_pos;
+        status = tinfl_decompress(&inflator, data, &in_bytes, inflate_window, inflate_window + image.window_pos,
+                                  &out_bytes, TINFL_FLAG_HAS_MORE_INPUT);
+        data += in_bytes;
+        len -= in_bytes;
+        int err = (out_bytes ? emit(inflate_window + image.window_pos, out_bytes) : 0);
+        if (err < 0) {
+            return err;
+        }
+        image.window_pos = (image.window_pos + out_bytes) & (OTA_INFLATE_WINDOW - 1);
+    } while (status == TINFL_STATUS_HAS_MORE_OUTPUT || (status == TINFL_STATUS_NEEDS_MORE_INPUT && len > 0));
+
+    if (status < 0) {
+        LOGE(TAG, "Compressed image is corrupt (%d)", status);
+        return -1;
+    }
+    if (status == TINFL_STATUS_DONE) {
+        image.inflate_done = 1;
+        if (len > 0) {
+            LOGE(TAG, "Data after the end of the compressed image");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Deal with the first few bytes:  decide what kind of image this is.
+ * Returns how many bytes of data were used, or -1 on error.
+ */
+static int decode_header(const unsigned char *data, int len) {
+    int want = sizeof(image.header) - image.header_fill;
+    int take = (len < want ? len : want);
+
+    memcpy((char *)&image.header + image.header_fill, data, take);
+    image.header_fill += take;
+
+    // We can tell a plain image as soon as we have the magic.
+    int magic_len = (image.header_fill < 4 ? image.header_fill : 4);
+    if (memcmp(image.header.magic, OTA_MAGIC, magic_len) != 0) {
+        image.state = DECODE_RAW;
+        // The bytes we have been saving up are image, so write them out.
+        int saved = image.header_fill - take;
+        image.header_fill = 0;
+        if (saved && write_flash((const unsigned char *)&image.header, saved) < 0) {
+            return -1;
+        }
+        return 0;
+    }
+    if (image.header_fill < sizeof(image.header)) {
+        return take;
+    }
+
+    if (image.header.version != OTA_VERSION || image.header.header_len != sizeof(image.header) ||
+            (image.header.flags & ~OTA_KNOWN_FLAGS)) {
+        LOGE(TAG, "Unsupported OTA image version %d (flags %x)", image.header.version, image.header.flags);
+        return -1;
+    }
+    image.packed = 1;
+    image.payload_left = image.header.payload_len;
+    image.state = DECODE_PAYLOAD;
+    if (image.header.flags & OTA_DEFLATE) {
+        tinfl_init(&inflator);
+        image.window_pos = 0;
+    }
+    if (image.header.flags & OTA_DELTA) {
+        memset(&delta, 0, sizeof(delta));
+        delta.state = DELTA_HEADER;
+    }
+    LOGI(TAG, "Packed image: %u bytes of payload for %u bytes of image, flags %x",
+        image.header.payload_len, image.header.image_len, image.header.flags);
+    return take;
+}
+
+
+int ota_image_begin(const unsigned char *expected_sha) {
+    memset(&image, 0, sizeof(image));
+    if (expected_sha) {
+        memcpy(image.expected_sha, expected_sha, sizeof(image.expected_sha));
+        image.check_sha = 1;
+    }
+
+    image.partition = esp_ota_get_next_update_partition(NULL);
+    if (image.partition == NULL) {
+        LOGE(TAG, "Unable to obtain partition to write to");
+        return -1;
+    }
+    esp_err_t err = esp_ota_begin(image.partition, OTA_WITH_SEQUENTIAL_WRITES, &image.handle);
+    if (err != ESP_OK) {
+        LOGE(TAG, "esp_ota_begin failed (%s)", esp_err_to_name(err));
+        image.handle = 0;
+        return -1;
+    }
+    mbedtls_sha256_init(&image.sha);
+    mbedtls_sha256_starts_ret(&image.sha, 0);
+    image.state = DECODE_HEADER;
+    return 0;
+}
+
+/*
+ * Handle the next piece of the download.  Returns 0 on success, -1 if we should give up,
+ * or -2 if it is a patch made against some other image than the one we are running.
+ */
+int ota_image_write(const unsigned char *data, int len) {
+    if (image.state == DECODE_HEADER) {
+        int used = decode_header(data, len);
+        if (used < 0) {
+            return -1;
+        }
+        data += used;
+        len -= used;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    if (image.packed) {
+        if (len > image.payload_left) {
+            LOGE(TAG, "More data than the header said there would be");
+            return -1;
+        }
+        image.payload_left -= len;
+    }
+
+    if (image.state == DECODE_RAW) {
+        return write_flash(data, len);
+    }
+    if (image.header.flags & OTA_DEFLATE) {
+        return inflate(data, len);
+    }
+    return emit(data, len);
+}
+
+/*
+ * The download is complete:  make sure we got what we expected, and if so, arrange to
+ * boot it.  Returns 0 if the new image is ready, -1 if not (in which case it has been discarded).
+ */
+int ota_image_finish() {
+    unsigned char sha[32];
+
+    mbedtls_sha256_finish_ret(&image.sha, sha);
+    mbedtls_sha256_free(&image.sha);
+    LOGI(TAG, "Wrote %d bytes of image (%d ms writing flash)", image.length, (int)(image.write_time / 1000));
+
+    if (image.state == DECODE_HEADER) {
+        LOGE(TAG, "Image is too short");
+        goto fail;
+    }
+    if (image.packed) {
+        if (image.payload_left != 0 || (image.header.flags & OTA_DEFLATE && !image.inflate_done) ||
+                (image.header.flags & OTA_DELTA && delta.state != DELTA_END)) {
+            LOGE(TAG, "Image is incomplete");
+            goto fail;
+        }
+        if (image.length != image.header.image_len) {
+            LOGE(TAG, "Image length %d does not match expected length %u", image.length, image.header.image_len);
+            goto fail;
+        }
+        if (memcmp(sha, image.header.image_sha256, sizeof(sha)) != 0) {
+            LOGE(TAG, "Image hash does not match; image is corrupted");
+            goto fail;
+        }
+    }
+    if (image.check_sha && memcmp(sha, image.expected_sha, sizeof(sha)) != 0) {
+        LOGE(TAG, "Image hash does not match the one we were given; image is corrupted");
+        goto fail;
+    }
+
+    esp_err_t err = esp_ota_end(image.handle);
+    image.handle = 0;
+    if (err != ESP_OK) {
+        if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
+            LOGE(TAG, "Image validation failed, image is corrupted");
+        } else {
+            LOGE(TAG, "esp_ota_end failed (%s)!", esp_err_to_name(err));
+        }
+        return -1;
+    }
+
+    err = esp_ota_set_boot_partition(image.partition);
+    if (err != ESP_OK) {
+        LOGE(TAG, "esp_ota_set_boot_partition failed (%s)!", esp_err_to_name(err));
+        return -1;
+    }
+    return 0;
+
+fail:
+    ota_image_abort();
+    return -1;
+}
+
+void ota_image_abort() {
+    mbedtls_sha256_free(&image.sha);
+    if (image.handle) {
+        esp_ota_abort(image.handle);
+        image.handle = 0;
+    }
+}
+
+/*
+ * Report which image we are running, so the console can tell whether it has what it
+ * needs to send us a patch.  For an app partition this is the sha256 the build appends
+ * to the image, i.e. the last 32 bytes of the .bin file.
+ */
+int report_running_image() {
+    uint8_t sha[32];
+    char hex[2*sizeof(sha)+1];
+
+    if (esp_partition_get_sha256(esp_ota_get_running_partition(), sha) != ESP_OK) {
+        LOGE(TAG, "Unable to get the hash of the running image");
+        return -1;
+    }
+    for(int i = 0; i < sizeof(sha); i++) {
+        sprintf(hex + 2*i, "%02x", sha[i]);
+    }
+    send_messagef(0, "image %s", hex);
+    return 0;
+}
@@ -1,131 +1,341 @@
+#include <stdio.h>
 #include <string.h>
+#include <ctype.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/event_groups.h"
 #include "esp_system.h"
 #include "esp_log.h"
 #include "esp_ota_ops.h"
-#include "driver/gpio.h"
+#include "esp_timer.h"
 #include "lwip/err.h"
 #include "lwip/sockets.h"
 #include "libconfig.h"
 #include "libdecls.h"
 
-#define BUFFSIZE 1024
-
 static const char *TAG = "ota";
-static unsigned char ota_buffer[BUFFSIZE] = { 0 };
+
+/*
+ * The download is pipelined:  a receiver task reads from the network into a pool of buffers,
+ * while the task that called ota_upgrade writes the filled buffers to flash.  That way the
+ * network keeps flowing while flash is being erased and written (which is slow), rather
+ * than the TCP window stalling every time we write.
+ *
+ * Buffers circulate between two queues:  free_chunks (empty, ready to receive into) and
+ * full_chunks (ready to write).  The receiver always finishes by queueing a chunk with
+ * len <= 0 (0 at end of stream, -1 on a network error), and the writer always waits for
+ * that before cleaning up, so the receiver never outlives the socket.
+ *
+ * The transfer can be resumed.  Each time we connect, we start by telling the sender
+ * (as a decimal number and a newline) the offset we want it to start from.  If the
+ * connection drops, everything that arrived before the drop has still been written to
+ * flash (the writer works through the queue before it sees the error marker), and the image
+ * decoder keeps its state, so we reconnect and ask for the rest.
+ */
+
+struct ota_chunk {
+    unsigned char *data;
+    int len;
+};
+
+static unsigned char ota_buffers[OTA_BUFFER_COUNT][OTA_BUFFER_SIZE];
+static QueueHandle_t free_chunks = NULL;
+static QueueHandle_t full_chunks = NULL;
+
+struct ota_receiver_args {
+    int sock;
+    volatile int abort;         // set by the writer if it gives up
+    int64_t receive_stall;      // time spent waiting for a free buffer (i.e. on flash)
+};
+
+struct ota_stats {
+    int64_t start;
+    int64_t write_stall;        // time spent waiting for data (i.e. on the network)
+    int64_t receive_stall;      // total over all connections
+    int length;                 // bytes received and written, i.e. where to resume from
+    int connections;
+};
 
 // forward decl
 static int connect_to(const char *ipaddr);
 
+static void ota_receiver(struct ota_receiver_args *args) {
+    struct ota_chunk chunk;
+
+    while (1) {
+        int64_t wait_start = esp_timer_get_time();
+        xQueueReceive(free_chunks, &chunk, portMAX_DELAY);
+        args->receive_stall += esp_timer_get_time() - wait_start;
+
+        // Fill the whole buffer (if we can) so flash gets written in big pieces
+        int r = 0;
+        chunk.len = 0;
+        while (chunk.len < OTA_BUFFER_SIZE && !args->abort) {
+            r = recv(args->sock, chunk.data + chunk.len, OTA_BUFFER_SIZE - chunk.len, 0);
+            if (r <= 0) {
+                break;
+            }
+            chunk.len += r;
+        }
+
+        if (args->abort) {
+            chunk.len = 0;
+        }
+        else if (r < 0) {
+            LOGE(TAG, "network read failed (errno %d)", errno);
+            chunk.len = -1;
+        }
+        if (chunk.len > 0) {
+            xQueueSend(full_chunks, &chunk, portMAX_DELAY);
+            if (r > 0) {
+                continue;
+            }
+            // Otherwise we're at the end of the stream; also send the end marker.
+            xQueueReceive(free_chunks, &chunk, portMAX_DELAY);
+            chunk.len = 0;
+        }
+        xQueueSend(full_chunks, &chunk, portMAX_DELAY);
+        break;
+    }
+    vTaskDelete(NULL);
+}
+
+/*
+ * Start a receiver on sock, and return when the pipeline is set up.
+ */
+static void start_receiver(struct ota_receiver_args *args) {
+    struct ota_chunk chunk;
+
+    if (free_chunks == NULL) {
+        free_chunks = xQueueCreate(OTA_BUFFER_COUNT, sizeof(struct ota_chunk));
+        full_chunks = xQueueCreate(OTA_BUFFER_COUNT, sizeof(struct ota_chunk));
+    }
+    xQueueReset(free_chunks);
+    xQueueReset(full_chunks);
+    for(int i = 0; i < OTA_BUFFER_COUNT; i++) {
+        chunk.data = ota_buffers[i];
+        xQueueSend(free_chunks, &chunk, 0);
+    }
+    xTaskCreate((TaskFunction_t)ota_receiver, "ota_receiver", 3072, args, PRIORITY_NETWORK, NULL);
+}
+
+/*
+ * Get the next chunk of data from the receiver, waiting for it if necessary.
+ * Returns the chunk length:  0 at end of stream, < 0 on error.
+ */
+static int next_chunk(struct ota_chunk *chunk, struct ota_stats *stats) {
+    int64_t wait_start = esp_timer_get_time();
+    xQueueReceive(full_chunks, chunk, portMAX_DELAY);
+    stats->write_stall += esp_timer_get_time() - wait_start;
+    return chunk->len;
+}
+
+static void release_chunk(struct ota_chunk *chunk) {
+    xQueueSend(free_chunks, chunk, portMAX_DELAY);
+}
+
+/*
+ * If the writer has to give up early, tell the receiver to stop and wait for it to finish.
+ */
+static void stop_receiver(struct ota_receiver_args *args) {
+    struct ota_chunk chunk;
+
+    args->abort = 1;
+    shutdown(args->sock, SHUT_RD);
+    do {
+        xQueueReceive(full_chunks, &chunk, portMAX_DELAY);
+        release_chunk(&chunk);
+    } while (chunk.len > 0);
+}
+
+static void report_stats(struct ota_stats *stats) {
+    int elapsed = (esp_timer_get_time() - stats->start) / 1000;
+    LOGI(TAG, "Received %d bytes in %d ms (%d KB/s) over %d connection(s).  Waited %d ms for network, %d ms for flash",
+        stats->length, elapsed, elapsed ? stats->length / elapsed : 0, stats->connections,
+        (int)(stats->write_stall / 1000), (int)(stats->receive_stall / 1000));
+}
+
+/*
+ * Receive from sock and write to the image until the stream ends.
+ * Returns 0 at the end of the stream, -1 if the connection failed (we can resume),
+ * or -2 if the image was rejected (we can't).
+ */
+static int transfer(int sock, struct ota_stats *stats) {
+    struct ota_receiver_args receiver = { .sock = sock };
+    struct ota_chunk chunk;
+    int status = 0;
+
+    start_receiver(&receiver);
+    while (next_chunk(&chunk, stats) > 0) {
+        int err = ota_image_write(chunk.data, chunk.len);
+        release_chunk(&chunk);
+        if (err < 0) {
+            stop_receiver(&receiver);
+            status = -2;
+            break;
+        }
+        stats->length += chunk.len;
+        ESP_LOGD(TAG, "Received length %d", stats->length);
+    }
+    if (status == 0) {
+        release_chunk(&chunk);
+        status = (chunk.len < 0 ? -1 : 0);
+    }
+    stats->receive_stall += receiver.receive_stall;
+    return status;
+}
+
+/*
+ * Connect to the sender and ask for the data starting at offset.
+ */
+static int open_transfer(const char *ipaddr, int offset) {
+    char request[16];
+    int sock = connect_to(ipaddr);
+    if (sock < 0) {
+        LOGE(TAG, "Unable to create connection to %s", ipaddr);
+        return -1;
+    }
+    int len = snprintf(request, sizeof(request), "%d\n", offset);
+    if (send(sock, request, len, 0) != len) {
+        LOGE(TAG, "Unable to send request to %s (errno %d)", ipaddr, errno);
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Convert a 64 character hex string to 32 bytes.  Returns -1 if it isn't one.
+static int parse_sha(const char *hex, unsigned char *sha) {
+    for(int i = 0; i < 32; i++) {
+        unsigned int byte;
+        if (!isxdigit((unsigned char)hex[2*i]) || !isxdigit((unsigned char)hex[2*i+1]) ||
+                sscanf(hex + 2*i, "%2x", &byte) != 1) {
+            return -1;
+        }
+        sha[i] = byte;
+    }
+    return (hex[64] == 0 || isspace((unsigned char)hex[64])) ? 0 : -1;
+}
+
 /* 
  * Contact the named IP address on the OTA port to download and install a new version
- * of the code.
+ * of the code.  If sha_hex isn't empty, it is the sha256 the image must have.
  * 
  * Derived from the ESP-IDF "native_ota_example"
  */
 
-void ota_upgrade(const char *ipaddr, int expected_len)
+void ota_upgrade(const char *ipaddr, int expected_len, const char *sha_hex)
 {
-    esp_err_t err;
-
-    esp_ota_handle_t update_handle = 0 ;
-    const esp_partition_t *update_partition = NULL;
-    int sock;
+    struct ota_stats stats = { 0 };
+    unsigned char sha[32];
+    int failures = 0;
 
-    update_partition = esp_ota_get_next_update_partition(NULL);
-    if (update_partition == NULL) {
-        LOGE(TAG, "Unable to obtain partition to write to");
+    while (isspace((unsigned char)*sha_hex)) sha_hex++;
+    if (*sha_hex && parse_sha(sha_hex, sha) < 0) {
+        LOGE(TAG, "Malformed image hash %s", sha_hex);
         return;
     }
-
-    sock = connect_to(ipaddr);
-    if ( sock < 0 ) {
-        LOGE(TAG, "Unable to create connection to %s", ipaddr);
+    if (ota_image_begin(*sha_hex ? sha : NULL) < 0) {
         return;
     }
 
-    err = esp_ota_begin(update_partition, OTA_WITH_SEQUENTIAL_WRITES, &update_handle);
-    if (err != ESP_OK) {
-        LOGE(TAG, "esp_ota_begin failed (%s)", esp_err_to_name(err));
-        goto cleanup;
-    }
-
     LOGI(TAG, "Starting OTA Update");
-
-    int binary_file_length = 0;
-    int data_read = 0;
-    do {
-        data_read = recv(sock, ota_buffer, sizeof(ota_buffer), 0);
-        if (data_read < 0) {
-            LOGE(TAG, "network read failed (%d)", data_read);
-            goto cleanup;
+    stats.start = esp_timer_get_time();
+    while (1) {
+        int offset = stats.length;
+        int status = -1;
+        int sock = open_transfer(ipaddr, offset);
+        if (sock >= 0) {
+            stats.connections++;
+            status = transfer(sock, &stats);
+            shutdown(sock, 0);
+            close(sock);
         }
-        else if (data_read > 0) {
-            err = esp_ota_write( update_handle, (const void *)ota_buffer, data_read);
-            if (err != ESP_OK) {
-                LOGE(TAG, "esp_ota_write failed (%s)", esp_err_to_name(err));
-                goto cleanup;
-            }
-            binary_file_length += data_read;
-            ESP_LOGD(TAG, "Written image length %d", binary_file_length);
+        if (status == -2) {
+            ota_image_abort();
+            return;
         }
-    } while(data_read > 0);
-
-    LOGI(TAG, "Total data length received: %d", binary_file_length);
-    if (binary_file_length != expected_len) {
-        LOGE(TAG, "Length does not match expected length %d, aborting.", expected_len);
-        goto cleanup;
-    }
-
-    err = esp_ota_end(update_handle);
-    if (err != ESP_OK) {
-        if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
-            LOGE(TAG, "Image validation failed, image is corrupted");
-        } else {
-            LOGE(TAG, "esp_ota_end failed (%s)!", esp_err_to_name(err));
+        if (status == 0 && stats.length >= expected_len) {
+            break;
         }
-        goto cleanup;
+        // Only count the failures that get us nowhere
+        failures = (stats.length > offset ? 1 : failures + 1);
+        if (failures > OTA_RESUME_ATTEMPTS) {
+            LOGE(TAG, "Giving up on OTA download at %d of %d bytes", stats.length, expected_len);
+            ota_image_abort();
+            return;
+        }
+        LOGW(TAG, "OTA download interrupted at %d of %d bytes; resuming", stats.length, expected_len);
+        vTaskDelay(OTA_RESUME_DELAY * failures / portTICK_PERIOD_MS);
     }
 
-    err = esp_ota_set_boot_partition(update_partition);
-    if (err != ESP_OK) {
-        LOGE(TAG, "esp_ota_set_boot_partition failed (%s)!", esp_err_to_name(err));
-        goto cleanup;
+    report_stats(&stats);
+    if (stats.length != expected_len) {
+        LOGE(TAG, "Length does not match expected length %d, aborting.", expected_len);
+        ota_image_abort();
+        return;
     }
 
-    // Success!
-    LOGI(TAG, "Preparing to restart system!");
-    esp_restart();
-
-cleanup:
-    esp_ota_abort(update_handle);
-    shutdown(sock, 0);
-    close(sock);
+    if (ota_image_finish() == 0) {
+        // Success!
+        LOGI(TAG, "Preparing to restart system!");
+        esp_restart();
+    }
 }
 
 /*
- * A small test to determine whether or not the boot worked.
+ * Health check after an update.
+ *
+ * The first time a new image boots, it is on probation:  if it doesn't prove itself healthy
+ * within OTA_HEALTH_DEADLINE seconds, we roll back to the previous image.  The check runs in
+ * its own task, alongside normal startup, and the rest of the code reports in as each part
+ * of it starts working (see report_health).  Healthy means all of the HEALTH_ALL bits are set,
+ * and we still have at least OTA_HEALTH_MIN_HEAP bytes of heap.
  */
-static bool diagnostic(void)
-{
-    gpio_config_t io_conf;
-    io_conf.intr_type    = GPIO_INTR_DISABLE;
-    io_conf.mode         = GPIO_MODE_INPUT;
-    io_conf.pin_bit_mask = (1ULL << DIAGNOSTIC_PIN);
-    io_conf.pull_down_en = GPIO_PULLDOWN_DISABLE;
-    io_conf.pull_up_en   = GPIO_PULLUP_ENABLE;
-    gpio_config(&io_conf);
 
-    LOGI(TAG, "Diagnostics (5 sec)...");
-    vTaskDelay(5000 / portTICK_PERIOD_MS);
+static EventGroupHandle_t health = NULL;
 
-    bool diagnostic_is_ok = gpio_get_level(DIAGNOSTIC_PIN);
+static const char *health_names[] = { "wifi", "console", "ambient", "control" };
 
-    gpio_reset_pin(DIAGNOSTIC_PIN);
-    return diagnostic_is_ok;
+// Note that some part of the system is working.  Cheap, and safe to call whether or
+// not a health check is in progress.
+void report_health(int bit) {
+    if (health) {
+        xEventGroupSetBits(health, bit);
+    }
+}
+
+static void health_check_task(void *arg) {
+    EventBits_t bits = xEventGroupWaitBits(health, HEALTH_ALL, pdFALSE, pdTRUE,
+                                           OTA_HEALTH_DEADLINE * 1000 / portTICK_PERIOD_MS);
+    int heap = esp_get_minimum_free_heap_size();
+
+    if ((bits & HEALTH_ALL) == HEALTH_ALL && heap >= OTA_HEALTH_MIN_HEAP) {
+        LOGI(TAG, "New image is healthy (%d ms after boot); keeping it", (int)(esp_timer_get_time() / 1000));
+        esp_ota_mark_app_valid_cancel_rollback();
+    }
+    else {
+        for(int i = 0; i < sizeof(health_names)/sizeof(health_names[0]); i++) {
+            if (!(bits & (1 << i))) {
+                LOGE(TAG, "Health check: no %s", health_names[i]);
+            }
+        }
+        if (heap < OTA_HEALTH_MIN_HEAP) {
+            LOGE(TAG, "Health check: heap got down to %d bytes", heap);
+        }
+        LOGE(TAG, "New image failed its health check! Rolling back to the previous version ...");
+        // Give the broadcast loop a chance to get the news out first
+        vTaskDelay(2 * BROADCAST_INTERVAL / portTICK_PERIOD_MS);
+        esp_ota_mark_app_invalid_rollback_and_reboot();
+    }
+    // (We leave the event group in place, since other tasks may still be reporting to it.)
+    vTaskDelete(NULL);
 }
 
 /* 
- * Perform startup check to see if we have successfully completed an OTA upgrade.
+ * Perform startup check to see if we have just been updated, and if so, start the health
+ * check.  Returns right away.
  */
 void ota_check(void) {
 
@@ -133,15 +343,9 @@ void ota_check(void) {
     esp_ota_img_states_t ota_state;
     if (esp_ota_get_state_partition(running, &ota_state) == ESP_OK) {
         if (ota_state == ESP_OTA_IMG_PENDING_VERIFY) {
-            // run diagnostic function ...
-            bool diagnostic_is_ok = diagnostic();
-            if (diagnostic_is_ok) {
-                LOGI(TAG, "Diagnostics completed successfully! Continuing execution ...");
-                esp_ota_mark_app_valid_cancel_rollback();
-            } else {
-                LOGE(TAG, "Diagnostics failed! Start rollback to the previous version ...");
-                esp_ota_mark_app_invalid_rollback_and_reboot();
-            }
+            LOGI(TAG, "First boot of a new image; checking its health for the next %d s", OTA_HEALTH_DEADLINE);
+            health = xEventGroupCreate();
+            xTaskCreate(health_check_task, "ota_health", 3072, NULL, PRIORITY_CONTROL, NULL);
         }
     }
     else {
@@ -163,8 +367,13 @@ static int connect_to(const char *ipaddr) {
     dest_addr.sin_port = htons(OTA_PORT);
 
     if (connect(sock, (struct sockaddr *)&dest_addr, sizeof(struct sockaddr_in6)) != 0) {
+        close(sock);
         return -1;
     }
 
+    // Don't wait forever if the sender goes away
+    struct timeval receiving_timeout = { .tv_sec = 30 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &receiving_timeout, sizeof(receiving_timeout));
+
     return sock;
 }
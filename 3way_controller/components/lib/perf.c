@@ -0,0 +1,253 @@
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_system.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "hal/cpu_hal.h"
+#include "libconfig.h"
+#include "libdecls.h"
+
+/*
+ * Performance counters:  how much CPU each task is using, how close each is to running out
+ * of stack, and how the heap and message queues are holding up.  These are the things that
+ * run out first on these boards, and this is what lets us size stacks and queues from data
+ * rather than guesswork.
+ *
+ * The console "perf" command reports everything in detail; every PERF_INTERVAL we also
+ * broadcast a one-line summary.  CPU percentages are over the time since the previous
+ * sample (whichever of those took it).
+ *
+ * CPU usage needs the FreeRTOS run time stats, which are turned on in sdkconfig.defaults
+ * (CONFIG_FREERTOS_USE_TRACE_FACILITY and CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS).
+ */
+
+static const char *TAG = "perf";
+
+#define MAX_PERF_TASKS 20
+
+struct task_perf {
+    char name[configMAX_TASK_NAME_LEN];
+    UBaseType_t number;
+    UBaseType_t priority;
+    uint32_t runtime;           // total, as of the last sample
+    int permille;               // of the CPU, since the sample before that
+    int stack_free;             // bytes never used
+};
+
+static struct {
+    int count;
+    struct task_perf tasks[MAX_PERF_TASKS];
+    uint32_t total_runtime;
+    int64_t taken;              // esp_timer time of the sample
+    int64_t interval;           // time since the previous sample
+} perf;
+
+static SemaphoreHandle_t perf_lock;
+
+#if configUSE_TRACE_FACILITY && configGENERATE_RUN_TIME_STATS
+
+static TaskStatus_t task_status[MAX_PERF_TASKS];
+
+static uint32_t previous_runtime(UBaseType_t number) {
+    for(int i = 0; i < perf.count; i++) {
+        if (perf.tasks[i].number == number) {
+            return perf.tasks[i].runtime;
+        }
+    }
+    return 0;   // a new task
+}
+
+// Take a new sample.  Call with perf_lock held.
+static void sample_perf() {
+    struct task_perf tasks[MAX_PERF_TASKS];
+    uint32_t total;
+    int64_t now = esp_timer_get_time();
+
+    int count = uxTaskGetSystemState(task_status, MAX_PERF_TASKS, &total);
+    if (count == 0) {
+        ESP_LOGW(TAG, "More than %d tasks; not sampling", MAX_PERF_TASKS);
+        return;
+    }
+    uint32_t elapsed = total - perf.total_runtime;
+    for(int i = 0; i < count; i++) {
+        TaskStatus_t *t = &task_status[i];
+        struct task_perf *p = &tasks[i];
+        strncpy(p->name, t->pcTaskName, sizeof(p->name)-1);
+        p->name[sizeof(p->name)-1] = 0;
+        p->number = t->xTaskNumber;
+        p->priority = t->uxCurrentPriority;
+        p->runtime = t->ulRunTimeCounter;
+        p->permille = elapsed ? (uint64_t)(t->ulRunTimeCounter - previous_runtime(t->xTaskNumber)) * 1000 / elapsed : 0;
+        p->stack_free = t->usStackHighWaterMark * sizeof(StackType_t);
+    }
+    memcpy(perf.tasks, tasks, count * sizeof(tasks[0]));
+    perf.count = count;
+    perf.total_runtime = total;
+    perf.interval = now - perf.taken;
+    perf.taken = now;
+}
+
+#else
+
+static void sample_perf() {
+    ESP_LOGW(TAG, "FreeRTOS run time stats are not enabled (see sdkconfig.defaults)");
+}
+
+#endif
+
+#ifdef HEAP_GUARD
+
+/*
+ * Heap guard.  With HEAP_GUARD defined, libdecls.h sends our code's malloc, calloc and realloc
+ * here.  We count them, and complain about any once boot is complete.  (This only covers our
+ * own code; IDF and the WIFI driver keep using the heap as they please.)
+ *
+ * The parentheses in "(malloc)(...)" keep the macro from expanding, so we get the real one.
+ */
+
+static int guard_allocs = 0;
+static int guard_bytes = 0;
+static int guard_late = 0;
+
+static void guard_check(size_t size, const char *file, int line) {
+    guard_allocs++;
+    guard_bytes += size;
+    if (boot_is_complete()) {
+        guard_late++;
+        LOGE(TAG, "heap guard: %d bytes allocated at %s:%d after boot", (int)size, file, line);
+#if HEAP_GUARD >= 2
+        abort();
+#endif
+    }
+}
+
+void *guarded_malloc(size_t size, const char *file, int line) {
+    guard_check(size, file, line);
+    return (malloc)(size);
+}
+
+void *guarded_calloc(size_t n, size_t size, const char *file, int line) {
+    guard_check(n * size, file, line);
+    return (calloc)(n, size);
+}
+
+void *guarded_realloc(void *p, size_t size, const char *file, int line) {
+    guard_check(size, file, line);
+    return (realloc)(p, size);
+}
+
+#endif
+
+/*
+ * Cycle meters, for code paths short enough that esp_timer's microseconds are too coarse:
+ * meter_start() reads the CPU cycle counter, meter_stop() adds the cycles since then to the
+ * meter.  Each meter is only ever stopped by one task, so there is no locking.
+ */
+static struct {
+    uint32_t count;
+    uint64_t total;
+    uint32_t max;
+} meters[METER_COUNT];
+
+static const char *meter_names[METER_COUNT] = { "ambient", "control" };
+
+uint32_t meter_start() {
+    return cpu_hal_get_cycle_count();
+}
+
+void meter_stop(enum cycle_meter meter, uint32_t start) {
+    uint32_t cycles = cpu_hal_get_cycle_count() - start;
+    meters[meter].count++;
+    meters[meter].total += cycles;
+    if (cycles > meters[meter].max) {
+        meters[meter].max = cycles;
+    }
+}
+
+static void report_meters() {
+    for(int i = 0; i < METER_COUNT; i++) {
+        if (meters[i].count) {
+            send_messagef(0, "perf: cycles %-8s avg %u max %u over %u", meter_names[i],
+                (unsigned)(meters[i].total / meters[i].count), (unsigned)meters[i].max, (unsigned)meters[i].count);
+        }
+    }
+}
+
+static void report_memory() {
+    int messages, messages_dropped, errors, errors_dropped;
+    message_queue_stats(&messages, &messages_dropped, &errors, &errors_dropped);
+    send_messagef(0, "perf: heap free %d, min %d, largest block %d",
+        heap_caps_get_free_size(MALLOC_CAP_8BIT), heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT),
+        heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+    send_messagef(0, "perf: message queue %d/%d (%d dropped), error queue %d/%d (%d dropped)",
+        messages, MESSAGE_QUEUE_SIZE, messages_dropped, errors, MESSAGE_QUEUE_SIZE, errors_dropped);
+    int repeats, limited;
+    message_filter_stats(&repeats, &limited);
+    send_messagef(0, "perf: %d repeated messages collapsed, %d warnings and errors over their tag's limit",
+        repeats, limited);
+#ifdef HEAP_GUARD
+    send_messagef(0, "perf: heap guard: %d allocations (%d bytes) by our code, %d after boot",
+        guard_allocs, guard_bytes, guard_late);
+#endif
+}
+
+void report_perf() {
+    xSemaphoreTake(perf_lock, portMAX_DELAY);
+    sample_perf();
+    send_messagef(0, "perf: %d tasks, cpu over the last %d s:", perf.count, (int)(perf.interval / (1000 * 1000)));
+    for(int i = 0; i < perf.count; i++) {
+        struct task_perf *p = &perf.tasks[i];
+        send_messagef(0, "perf: %-16s pri %2d cpu %3d.%d%% stack free %5d", p->name, p->priority,
+            p->permille / 10, p->permille % 10, p->stack_free);
+    }
+    xSemaphoreGive(perf_lock);
+    report_memory();
+    report_meters();
+    report_listeners();
+}
+
+/*
+ * Every so often, broadcast a summary:  idle time, the busiest task, and the task with the
+ * least stack to spare.
+ */
+static void perf_loop() {
+    while (1) {
+        vTaskDelay(PERF_INTERVAL / portTICK_PERIOD_MS);
+
+        xSemaphoreTake(perf_lock, portMAX_DELAY);
+        sample_perf();
+        struct task_perf *busiest = NULL, *tightest = NULL;
+        int idle = 0;
+        for(int i = 0; i < perf.count; i++) {
+            struct task_perf *p = &perf.tasks[i];
+            if (strncmp(p->name, "IDLE", 4) == 0) {
+                idle += p->permille;
+            }
+            else if (busiest == NULL || p->permille > busiest->permille) {
+                busiest = p;
+            }
+            if (tightest == NULL || p->stack_free < tightest->stack_free) {
+                tightest = p;
+            }
+        }
+        if (busiest && tightest) {
+            int messages, messages_dropped, errors, errors_dropped;
+            message_queue_stats(&messages, &messages_dropped, &errors, &errors_dropped);
+            send_messagef(0, "perf: idle %d.%d%%, busiest %s %d.%d%%, least stack %s %d; heap min %d largest %d; queue %d dropped %d",
+                idle / 10, idle % 10, busiest->name, busiest->permille / 10, busiest->permille % 10,
+                tightest->name, tightest->stack_free, heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT),
+                heap_caps_get_largest_free_block(MALLOC_CAP_8BIT), messages, messages_dropped);
+        }
+        xSemaphoreGive(perf_lock);
+    }
+}
+
+void init_perf() {
+    perf_lock = xSemaphoreCreateMutex();
+    perf.taken = esp_timer_get_time();
+    xTaskCreate(perf_loop, "perf", 3072, NULL, PRIORITY_BACKGROUND, NULL);
+}
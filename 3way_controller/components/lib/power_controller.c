@@ -1,7 +1,9 @@
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "driver/gpio.h"
 #include "esp_timer.h"
 #include "esp_log.h"
@@ -15,13 +17,102 @@
 // Otherwise, if the power level has been explicitly set, that is used.
 // Otherwise, the level is set based on the desired and existing temperatures.
 
-enum power_level { power_off, power_low, power_medium, power_high, power_na };
 static enum power_level power_level = power_low;
 static enum power_level power_override = power_na;
 static const char *TAG = "power controller";
+static TaskHandle_t controller_task = NULL;
 
-// float safe comparison
-#define NO_T_VALUE(temp) (temp < NO_TEMP_VALUE + 0.1)
+
+/*
+ * Timing.  The loop is supposed to run every HEATER_UPDATE_INTERVAL, but other tasks can
+ * hold it up, so we keep track of how late each pass starts (jitter) and how long it takes
+ * (execution time), as histograms with power-of-two buckets:  bucket i counts times of
+ * 2^i to 2^(i+1)-1 microseconds (bucket 0 also counts zero).  A pass that starts more than
+ * CONTROL_DEADLINE ms late counts as a missed deadline.
+ */
+#define TIMING_BUCKETS 25      // up to about 30 seconds
+
+struct histogram {
+    uint32_t count[TIMING_BUCKETS];
+    int64_t max;
+    int64_t total;
+    uint32_t samples;
+};
+
+static struct histogram jitter_histogram;
+static struct histogram execution_histogram;
+static int missed_deadlines = 0;
+static int64_t last_miss = 0;
+static uint32_t relay_switches = 0;
+
+/*
+ * What the last pass went on, for the code that shows it (the snapshot, HTTP).  They
+ * could read the sensors themselves, but reading them has side effects (a stale ambient
+ * reading resets the history; a failed heater read is an error), and what they would show
+ * is not what the heater was acting on.  Until the first pass, the temperatures are
+ * NO_TEMP_VALUE.
+ */
+static struct control_inputs last_inputs = {
+    .desired = NO_TEMP_VALUE, .actual = NO_TEMP_VALUE, .heater = NO_TEMP_VALUE,
+    .max = NO_TEMP_VALUE, .override = power_na
+};
+static SemaphoreHandle_t inputs_lock = NULL;
+
+static void record_time(struct histogram *h, int64_t usec) {
+    int bucket = 0;
+    if (usec < 0) {
+        usec = 0;   // early, which can happen by up to a tick
+    }
+    if (usec > 0) {
+        bucket = 63 - __builtin_clzll(usec);
+        if (bucket >= TIMING_BUCKETS) {
+            bucket = TIMING_BUCKETS - 1;
+        }
+    }
+    h->count[bucket]++;
+    h->total += usec;
+    h->samples++;
+    if (usec > h->max) {
+        h->max = usec;
+    }
+}
+
+static void report_histogram(const char *name, struct histogram *h) {
+    char buf[MESSAGE_LEN];
+    int len = 0;
+
+    send_messagef(0, "%s: %u passes, mean %d us, max %d us", name, h->samples,
+        h->samples ? (int)(h->total / h->samples) : 0, (int)h->max);
+    for(int i = 0; i < TIMING_BUCKETS; i++) {
+        if (h->count[i]) {
+            int n = snprintf(buf + len, sizeof(buf) - len, "%s<%dus:%u", len ? " " : "", 1 << (i+1), h->count[i]);
+            if (n >= sizeof(buf) - len) {
+                break;
+            }
+            len += n;
+        }
+    }
+    if (len) {
+        send_messagef(0, "%s: %s", name, buf);
+    }
+}
+
+void report_control_timing() {
+    report_histogram("jitter", &jitter_histogram);
+    report_histogram("execution", &execution_histogram);
+    send_messagef(0, "missed deadlines: %d (deadline %d ms late)%s", missed_deadlines, CONTROL_DEADLINE,
+        last_miss ? "" : ", never");
+    if (last_miss) {
+        send_messagef(0, "last missed deadline %d s ago", (int)((esp_timer_get_time() - last_miss) / (1000 * 1000)));
+    }
+}
+
+// Counters for the metrics endpoint (see http.c)
+void control_counters(uint32_t *passes, uint32_t *missed, uint32_t *switches) {
+    *passes = execution_histogram.samples;
+    *missed = missed_deadlines;
+    *switches = relay_switches;
+}
 
 /*
  * Set (or unset) override behavior for the heater.
@@ -50,63 +141,82 @@ void set_power_level(char *level) {
     }
 }
 
+// Put back the level (and assigned level) from before a restart (see warm_restart.c)
+void restore_power_level(enum power_level level, enum power_level override) {
+    if (level < power_na) {
+        power_level = level;
+    }
+    if (override <= power_na) {
+        power_override = override;
+    }
+}
+
+enum power_level current_power_level() {
+    return power_level;
+}
+
+enum power_level current_power_override() {
+    return power_override;
+}
+
+TaskHandle_t power_controller_task() {
+    return controller_task;
+}
+
+void last_control_inputs(struct control_inputs *in) {
+    if (inputs_lock == NULL) {
+        // not started yet, so nothing is writing them
+        *in = last_inputs;
+        return;
+    }
+    xSemaphoreTake(inputs_lock, portMAX_DELAY);
+    *in = last_inputs;
+    xSemaphoreGive(inputs_lock);
+}
+
 
 void power_controller_loop() {
-    float desired_temp, actual_temp, heater_temp, max_temp;
+    // All in centidegrees (see libdecls.h), so the decision is integer arithmetic.
+    // The decision itself is in power_decision.c.
+    centideg_t desired_temp, actual_temp, heater_temp, max_temp;
+    char b1[CENTIDEG_LEN], b2[CENTIDEG_LEN], b3[CENTIDEG_LEN];
 
-    // Delay a bit to let various initializations have a go.
-    vTaskDelay(2000 / portTICK_PERIOD_MS);
+    // Boot doesn't start us until the sensors and stored state are ready (see main.c),
+    // so there is no need to wait.
+    TickType_t last_wake = xTaskGetTickCount();
+    int64_t scheduled = esp_timer_get_time();
 
     while(1) {
+        int64_t start = esp_timer_get_time();
+        int64_t late = start - scheduled;
+        record_time(&jitter_histogram, late);
+        if (late > CONTROL_DEADLINE * 1000LL) {
+            missed_deadlines++;
+            last_miss = start;
+            LOGW(TAG, "Control loop started %d ms late", (int)(late / 1000));
+        }
+
         desired_temp = current_desired_temperature();
         actual_temp = current_ambient_temperature();
         heater_temp = current_heater_temperature();
-        max_temp = max_temperature();
-        LOGI(TAG,"Desired temp %f, actual %f, heater %f, max %f", desired_temp, actual_temp, heater_temp, max_temp);
-        
-        if ( heater_temp > max_temp ) {
-            LOGI(TAG, "Discontinuing heat, heater temperature is %f", heater_temp);
-            if ( heater_temp > max_temp + 2 ) {
-                LOGE(TAG, "Help! Heater is overheating!");
-            }
-            power_level = power_off;
-        }
-        else if ( power_override != power_na ) {
-            LOGI(TAG, "Using assigned power level %d", power_override );
-            power_level = power_override;
-        }
-        else if ( NO_T_VALUE(desired_temp) || NO_T_VALUE(actual_temp) ) {      
-            LOGI(TAG, "Flying blind; maintain behavior: %d", power_level);
-        }
-
-        // I originally thought I'd have to do something more complicated than the following, but
-        // this rather simple approach seems to be working for me so far.  It probably depends
-        // a lot on things like insulation and air flow.
+        trace_sensor(heater_temp);
+        max_temp = CENTIDEG(max_temperature());
+        LOGI(TAG,"Desired temp %s, actual %s, heater %s, max %d", centideg_string(desired_temp, b1),
+             centideg_string(actual_temp, b2), centideg_string(heater_temp, b3), max_temp / 100);
 
-        else if ( actual_temp > desired_temp ) {
-            LOGI(TAG, "Too warm; turn off");
-            power_level = power_off;
-        }
-        else if ( desired_temp - actual_temp <= 0.2 ) {
-            LOGI(TAG, "Just a little please");
-            power_level = power_low;
-        }
-        else if ( desired_temp - actual_temp <= 2 ) {
-            LOGI(TAG, "Medium");
-            power_level = power_medium;
-        }
-        else {
-            // At full power we usually exceed the max heater temperature fairly easily.
-            // Rather than going through cycling between full power and no power, let's try 
-            // to ease up before we hit that top temp.
-            if ( heater_temp > max_temp-1 ) {
-                LOGI(TAG,"Hold up a little");
-                power_level = power_medium;
-            }
-            else {
-                LOGI(TAG,"Full blast!");
-                power_level = power_high;
-            }
+        const char *reason;
+        struct control_inputs in = { desired_temp, actual_temp, heater_temp, max_temp, power_override };
+        xSemaphoreTake(inputs_lock, portMAX_DELAY);
+        last_inputs = in;
+        xSemaphoreGive(inputs_lock);
+        enum power_level previous = power_level;
+        uint32_t decide_start = meter_start();
+        power_level = decide_power_level(&in, previous, &reason);
+        meter_stop(METER_CONTROL, decide_start);
+        trace_decision(&in, previous, power_level);
+        LOGI(TAG, "%s: level %d", reason, power_level);
+        if ( heater_temp > max_temp + CENTIDEG(2) ) {
+            LOGE(TAG, "Help! Heater is overheating!");
         }
 
         switch(power_level) {
@@ -130,9 +240,19 @@ void power_controller_loop() {
                 // can't happen; only power_override can be set to power_na
                 break;              
         }
+        trace_output(power_level);
+        // The relay pins follow the level:  bit 0 is LWATT_PIN, bit 1 HWATT_PIN
+        relay_switches += __builtin_popcount((previous ^ power_level) & 3);
+        longlog_pass(power_level, actual_temp, heater_temp > max_temp + CENTIDEG(2));
+        history_pass(&in, power_level);
         
-        // Delay, in milliseconds.
-        vTaskDelay(HEATER_UPDATE_INTERVAL / portTICK_PERIOD_MS);
+        report_health(HEALTH_CONTROL);
+        save_warm_state();
+        record_time(&execution_histogram, esp_timer_get_time() - start);
+
+        // Wait until the next pass is due (counting from when this one was due, not from now)
+        vTaskDelayUntil(&last_wake, HEATER_UPDATE_INTERVAL / portTICK_PERIOD_MS);
+        scheduled += HEATER_UPDATE_INTERVAL * 1000LL;
     }
 
     vTaskDelete(NULL);
@@ -149,6 +269,8 @@ void power_controller_start()
     };
     gpio_config(&pin_conf);
 
+    inputs_lock = xSemaphoreCreateMutex();
+
     // Go!
-    xTaskCreate(power_controller_loop, "power_controller", 4096, NULL, 5, NULL);
+    xTaskCreate(power_controller_loop, "power_controller", 4096, NULL, PRIORITY_CONTROL, &controller_task);
 }
@@ -0,0 +1,51 @@
+#include "libconfig.h"
+#include "libdecls.h"
+
+// The control decision itself (see power_controller.c for the overview).
+//
+// This is kept apart, as a function of nothing but its inputs, so that the host replayer
+// (host/replay.c) can put recorded inputs through exactly the same code the heater ran.
+// It returns the new level, and in *reason a word on why, for the log.
+
+#define NO_T_VALUE(temp) ((temp) <= NO_TEMP_VALUE)
+
+enum power_level decide_power_level(const struct control_inputs *in, enum power_level previous, const char **reason) {
+    if ( in->heater > in->max ) {
+        *reason = "Discontinuing heat, heater is too hot";
+        return power_off;
+    }
+    if ( in->override != power_na ) {
+        *reason = "Using assigned power level";
+        return in->override;
+    }
+    if ( NO_T_VALUE(in->desired) || NO_T_VALUE(in->actual) ) {
+        *reason = "Flying blind; maintain behavior";
+        return previous;
+    }
+
+    // I originally thought I'd have to do something more complicated than the following, but
+    // this rather simple approach seems to be working for me so far.  It probably depends
+    // a lot on things like insulation and air flow.
+
+    if ( in->actual > in->desired ) {
+        *reason = "Too warm; turn off";
+        return power_off;
+    }
+    if ( in->desired - in->actual <= 20 ) {      // 0.2 degrees
+        *reason = "Just a little please";
+        return power_low;
+    }
+    if ( in->desired - in->actual <= CENTIDEG(2) ) {
+        *reason = "Medium";
+        return power_medium;
+    }
+    // At full power we usually exceed the max heater temperature fairly easily.
+    // Rather than going through cycling between full power and no power, let's try
+    // to ease up before we hit that top temp.
+    if ( in->heater > in->max - CENTIDEG(1) ) {
+        *reason = "Hold up a little";
+        return power_medium;
+    }
+    *reason = "Full blast!";
+    return power_high;
+}
@@ -0,0 +1,99 @@
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "libconfig.h"
+#include "libdecls.h"
+
+/*
+ * A snapshot of all the controller state, sent as a single binary datagram in reply
+ * to the console "snapshot" command.  This is much cheaper than "report" both for us
+ * and for whoever is polling us:  nothing is formatted on the device, and it can't
+ * overflow the message queue.
+ *
+ * The layout is little-endian with no padding.  If you change it, bump SNAPSHOT_VERSION
+ * and update the decoder in console.py to match.
+ *
+ * Temperatures are in hundredths of a degree Celsius; NO_TEMP_VALUE shows up as -10000.
+ * The exceptions are max_heater and bump_temp, which are settings and so whole degrees.
+ */
+
+#define SNAPSHOT_VERSION 1
+
+// flag bits
+#define SNAPSHOT_BUMP_ACTIVE 0x01
+#define SNAPSHOT_TIME_SET    0x02
+
+struct __attribute__((packed)) snapshot {
+    char magic[4];              // "HCSN"
+    uint8_t version;
+    uint8_t power_level;        // enum power_level
+    uint8_t power_override;     // enum power_level; power_na if none
+    uint8_t flags;
+    int16_t ambient;
+    int16_t heater;
+    int16_t desired;
+    int16_t max_heater;         // whole degrees
+    int16_t bump_temp;          // whole degrees
+    uint32_t bump_remaining;    // seconds
+    uint32_t uptime;            // seconds
+    uint32_t time;              // unix time; only meaningful if SNAPSHOT_TIME_SET
+    uint32_t errors;            // since boot
+    uint32_t new_errors;        // since last error report
+    uint32_t dropped_messages;  // lost to message queue overflow
+    uint32_t free_heap;
+    uint32_t min_free_heap;
+    uint16_t stack_control;     // unused stack, in bytes
+    uint16_t stack_console;
+    uint16_t stack_broadcast;
+};
+
+static uint16_t stack_free(TaskHandle_t task) {
+    return task ? uxTaskGetStackHighWaterMark(task) * sizeof(StackType_t) : 0;
+}
+
+void send_snapshot() {
+    struct snapshot s = { .magic = "HCSN", .version = SNAPSHOT_VERSION };
+    struct control_inputs in;
+    int bump_temp = 0;
+    time_t now;
+
+    // What the control loop last acted on (see power_controller.c); reading the sensors
+    // from here could reset the ambient history or count a failed read as an error.
+    last_control_inputs(&in);
+    s.power_level = current_power_level();
+    s.power_override = current_power_override();
+    s.ambient = in.actual;
+    s.heater = in.heater;
+    s.desired = in.desired;
+    s.max_heater = max_temperature();
+
+    s.bump_remaining = bump_remaining(&bump_temp);
+    if (s.bump_remaining) {
+        s.flags |= SNAPSHOT_BUMP_ACTIVE;
+        s.bump_temp = bump_temp;
+    }
+
+    s.uptime = esp_timer_get_time() / (1000 * 1000);
+    time(&now);
+    if (now > EARLIEST_VALID_TIME) {
+        s.flags |= SNAPSHOT_TIME_SET;
+        s.time = now;
+    }
+
+    s.errors = error_count();
+    s.new_errors = new_error_count();
+    s.dropped_messages = dropped_message_count();
+    s.free_heap = esp_get_free_heap_size();
+    s.min_free_heap = esp_get_minimum_free_heap_size();
+
+    s.stack_control = stack_free(power_controller_task());
+    s.stack_console = stack_free(xTaskGetCurrentTaskHandle());
+    s.stack_broadcast = stack_free(broadcast_loop_task());
+
+    send_reply_data(&s, sizeof(s));
+}
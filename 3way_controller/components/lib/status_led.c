@@ -1,22 +1,32 @@
+#include <math.h>
 #include "esp_log.h"
 #include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "led_strip.h"
 #include "libconfig.h"
 #include "libdecls.h"
 
 /*
  * Show status via the on-board LED
- * We switch the LED between different colors to show different status:
- * 
+ * The color says how things are going, and the way it moves says what the heater is doing:
+ *
  * Normal operation: blue
  * Booted within the last 10 minutes: green
  * There have been errors since last report: yellow
- * There have been new errors in the last 30 minutes: red
- * 
- * The timing of the color change is driven by the caller --- at this point I'm
- * just piggy-backing it on top of the messages task, so it gets the message
- * interval.
- * 
+ * There have been new errors in the last 30 minutes: red, blinking
+ * WIFI is down: white, double blink
+ *
+ * Otherwise the LED "breathes", faster the higher the power level; it glows steadily
+ * (and dimly) when the heater is off.
+ *
+ * The LED is animated by its own task, at the lowest priority we use, every LED_FRAME_INTERVAL
+ * ms, so that it never holds up anything else.  (Not from an esp_timer:  the led_strip driver's
+ * refresh waits for the RMT peripheral to finish sending, whatever timeout we give it, and
+ * timer callbacks must not block.)  Each frame is just a couple of table lookups:  the
+ * brightness curves and the gamma correction (which makes the fades look even to the eye) are
+ * computed once at startup.  We only talk to the LED when the color actually changes.
+ *
  * This code uses a hard-to-discover extra IDF component: IDF_PATH/examples/common_components/led_strip.
  * Examples of using it can be found in the IDF examples  get-started/blink  and   peripherals/rmt/led_strip
  * This post was useful:
@@ -25,69 +35,129 @@
 
 #define LED_RMT_CHANNEL 0   // you can chose 0-3; doesn't seem to matter which
 #define LED_PIN 8           // for this board, this is hard-wired
-#define LED_REFRESH_TIME 50 // milliseconds
 
 static const int64_t boot_warning_duration = (10LL * 60 * 1000 * 1000); // 10 min in u-sec
 static const int64_t new_error_limit = (30LL * 60 * 1000 * 1000 ); // 30 min in u-sec
 
+// Brightness curves, indexed by phase (one cycle of the pattern)
+#define CURVE_LEN 64
+enum led_shape { shape_steady, shape_breathe, shape_blink, shape_double_blink, shape_count };
+static uint8_t curves[shape_count][CURVE_LEN];
+static uint8_t gamma_table[256];
+
+struct led_pattern {
+    uint8_t red, green, blue;
+    enum led_shape shape;
+    int period;         // ms
+};
+
 static led_strip_t *status_led;
 static int last_error_count = 0;
 static int64_t last_error_stamp = 0;
-static int odd_even = 0;
+static uint32_t shown = 0xffffffff;     // color currently on the LED
 
 
-void init_status_led() {
-
-    status_led = led_strip_init(LED_RMT_CHANNEL, LED_PIN, 1);
-    status_led->clear(status_led, LED_REFRESH_TIME);
-
-    last_error_count = new_error_count();
-    last_error_stamp = esp_timer_get_time();
-}
-
-/*
- * Instead of blinking the LED, we "pulse" it by altering the intensity
- */
-void led_color_pulse(int red, int green, int blue) {
-    if (odd_even) {
-        status_led->set_pixel(status_led, 0, red, green, blue);
+static void init_tables() {
+    for(int i = 0; i < 256; i++) {
+        gamma_table[i] = (uint8_t)(powf(i / 255.0f, 2.2f) * 255 + 0.5f);
     }
-    else {
-        status_led->set_pixel(status_led, 0, red/3, green/3, blue/3);        
+    for(int i = 0; i < CURVE_LEN; i++) {
+        float phase = (float)i / CURVE_LEN;
+        curves[shape_steady][i] = 255;
+        // from a third of full brightness up to full and back
+        curves[shape_breathe][i] = 85 + 170 * (0.5f - 0.5f * cosf(2 * M_PI * phase));
+        curves[shape_blink][i] = (phase < 0.5f ? 255 : 0);
+        curves[shape_double_blink][i] = ((phase < 0.1f || (phase >= 0.2f && phase < 0.3f)) ? 255 : 0);
     }
-    status_led->refresh(status_led, LED_REFRESH_TIME);
-    odd_even = 1 - odd_even;
 }
 
-void update_status_led() {
-
+/*
+ * Figure out what we should be showing
+ */
+static void choose_pattern(int64_t now, struct led_pattern *p) {
+    static const int breath_period[] = { 0, 4000, 2000, 1000 };   // by power level
     int updated_error_count = new_error_count();
-    int64_t now_stamp = esp_timer_get_time();
+
+    if ( !wifi_connected() ) {
+        *p = (struct led_pattern){ .red = 200, .green = 200, .blue = 200, .shape = shape_double_blink, .period = 2000 };
+        return;
+    }
 
     if ( updated_error_count > 0 ) {
         if ( updated_error_count > last_error_count ) {
             last_error_count = updated_error_count;
-            last_error_stamp = now_stamp;
+            last_error_stamp = now;
         }
-        
-        if ( now_stamp-last_error_stamp < new_error_limit ) {
-            led_color_pulse(255, 10, 0);
-        }
-        else {
-            led_color_pulse(180, 180, 0);
+
+        if ( now-last_error_stamp < new_error_limit ) {
+            *p = (struct led_pattern){ .red = 255, .green = 10, .shape = shape_blink, .period = 1000 };
+            return;
         }
+        *p = (struct led_pattern){ .red = 180, .green = 180, .shape = shape_breathe, .period = 3000 };
+        return;
     }
-    else { // updated error count == 0
-        // either there's never been an error, or we've done a reset.  
-        // either way, clear the previous error counters.
-        last_error_count = 0;
-        last_error_stamp = 0;
-
-        if ( now_stamp < boot_warning_duration ) {
-            led_color_pulse(0, 230, 20);
-        }
-        else {
-            led_color_pulse(0, 50, 230);
-        }
+
+    // either there's never been an error, or we've done a reset.
+    // either way, clear the previous error counters.
+    last_error_count = 0;
+    last_error_stamp = 0;
+
+    if ( now < boot_warning_duration ) {
+        *p = (struct led_pattern){ .green = 230, .blue = 20 };
     }
-}
\ No newline at end of file
+    else {
+        *p = (struct led_pattern){ .green = 50, .blue = 230 };
+    }
+    enum power_level level = current_power_level();
+    if (level == power_off || level >= power_na) {
+        // dim and steady
+        p->red /= 3;
+        p->green /= 3;
+        p->blue /= 3;
+        p->shape = shape_steady;
+        p->period = 1000;
+    }
+    else {
+        p->shape = shape_breathe;
+        p->period = breath_period[level];
+    }
+}
+
+static void led_frame() {
+    struct led_pattern p;
+    int64_t now = esp_timer_get_time();
+
+    choose_pattern(now, &p);
+    int phase = ((now / 1000) % p.period) * CURVE_LEN / p.period;
+    int level = curves[p.shape][phase];
+    uint8_t red = gamma_table[p.red * level / 255];
+    uint8_t green = gamma_table[p.green * level / 255];
+    uint8_t blue = gamma_table[p.blue * level / 255];
+
+    uint32_t color = (red << 16) | (green << 8) | blue;
+    if (color != shown) {
+        status_led->set_pixel(status_led, 0, red, green, blue);
+        status_led->refresh(status_led, 0);
+        shown = color;
+    }
+}
+
+static void led_loop(void *arg) {
+    TickType_t last_wake = xTaskGetTickCount();
+    while(1) {
+        led_frame();
+        vTaskDelayUntil(&last_wake, LED_FRAME_INTERVAL / portTICK_PERIOD_MS);
+    }
+}
+
+void init_status_led() {
+
+    init_tables();
+    status_led = led_strip_init(LED_RMT_CHANNEL, LED_PIN, 1);
+    status_led->clear(status_led, 0);
+
+    last_error_count = new_error_count();
+    last_error_stamp = esp_timer_get_time();
+
+    xTaskCreate(led_loop, "status_led", 2048, NULL, PRIORITY_BACKGROUND, NULL);
+}
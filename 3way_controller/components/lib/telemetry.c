@@ -0,0 +1,271 @@
+#include <stdint.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+#include "libconfig.h"
+#include "libdecls.h"
+
+/*
+ * Telemetry streaming.  A client subscribes (via the console "subscribe" command) to a set of
+ * variables at a rate of its choosing, and we send it a stream of samples directly until it
+ * unsubscribes or stops renewing its subscription.  (Subscriptions last TELEMETRY_LEASE seconds;
+ * re-subscribing renews them.)  The temperatures are read when each frame is due (with the
+ * quiet sample_ functions, which leave the complaining to the control loop), so the stream
+ * follows them as closely as the subscriber asks.
+ *
+ * To keep the stream small, most frames only carry the change in each variable since the
+ * previous frame, as a signed byte.  Every TELEMETRY_FULL_FRAME_INTERVAL frames, or whenever
+ * a change doesn't fit in a byte, we send a full frame instead.  A client that misses a frame
+ * (the sequence number tells it) just waits for the next full one.
+ *
+ * Frame layout (little-endian, no padding):
+ *     "HT", type ('F' or 'D'), variable mask, uint16 sequence number,
+ *     full frame:  uint32 uptime in ms, then an int16 per variable
+ *     delta frame: uint16 ms since previous frame, then an int8 per variable
+ * Variables appear in bit order.  If you change this, update the decoder in console.py.
+ */
+
+static const char *TAG = "telemetry";
+
+// Variables that can be subscribed to.  Temperatures are in hundredths of a degree,
+// the slope in hundredths of a degree per hour.
+#define TV_AMBIENT  0x01
+#define TV_HEATER   0x02
+#define TV_DESIRED  0x04
+#define TV_LEVEL    0x08
+#define TV_SLOPE    0x10
+#define TV_COUNT    5
+#define TV_ALL      0x1f
+
+#define MAX_SUBSCRIBERS 4
+
+struct subscriber {
+    int active;
+    struct sockaddr_in to;
+    int mask;
+    int period;             // ms
+    int64_t next_due;       // esp_timer time (usec)
+    int64_t expires;
+    int64_t last_sent;
+    uint16_t seq;
+    int frames_since_full;
+    int16_t last[TV_COUNT]; // values as of the last frame sent
+};
+
+static struct subscriber subscribers[MAX_SUBSCRIBERS];
+static SemaphoreHandle_t subscribers_lock;
+static TaskHandle_t telemetry_task;
+
+static int same_address(const struct sockaddr_in *a, const struct sockaddr_in *b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+/*
+ * Add or renew a subscription.  Returns 0 on success, -1 if there is no room.
+ */
+int telemetry_subscribe(void *sa, int mask, int period) {
+    struct sockaddr_in *to = (struct sockaddr_in *)sa;
+    struct subscriber *s = NULL;
+    int64_t now = esp_timer_get_time();
+
+    mask &= TV_ALL;
+    if (period < TELEMETRY_MIN_PERIOD) {
+        period = TELEMETRY_MIN_PERIOD;
+    }
+    if (period > 60 * 1000) {
+        // delta frames only have room for about a minute between frames
+        period = 60 * 1000;
+    }
+
+    xSemaphoreTake(subscribers_lock, portMAX_DELAY);
+    for(int i = 0; i < MAX_SUBSCRIBERS; i++) {
+        if (subscribers[i].active && same_address(&subscribers[i].to, to)) {
+            s = &subscribers[i];
+            break;
+        }
+    }
+    if (s == NULL) {
+        for(int i = 0; i < MAX_SUBSCRIBERS; i++) {
+            if (!subscribers[i].active) {
+                s = &subscribers[i];
+                memset(s, 0, sizeof(*s));
+                s->to = *to;
+                s->next_due = now;
+                break;
+            }
+        }
+    }
+    if (s) {
+        if (s->mask != mask) {
+            // Variables changed; make sure the next frame is a full one.
+            s->frames_since_full = TELEMETRY_FULL_FRAME_INTERVAL;
+        }
+        s->mask = mask;
+        s->period = period;
+        s->expires = now + TELEMETRY_LEASE * 1000LL * 1000;
+        s->active = 1;
+    }
+    xSemaphoreGive(subscribers_lock);
+
+    if (s == NULL) {
+        LOGW(TAG, "Too many telemetry subscribers; refusing %s", inet_ntoa(to->sin_addr));
+        return -1;
+    }
+    // Wake the telemetry task so it notices the new schedule
+    xTaskNotifyGive(telemetry_task);
+    return 0;
+}
+
+void telemetry_unsubscribe(void *sa) {
+    xSemaphoreTake(subscribers_lock, portMAX_DELAY);
+    for(int i = 0; i < MAX_SUBSCRIBERS; i++) {
+        if (subscribers[i].active && same_address(&subscribers[i].to, sa)) {
+            subscribers[i].active = 0;
+        }
+    }
+    xSemaphoreGive(subscribers_lock);
+}
+
+// The slope should never be out of range (see temperatures.c), but if it is, the
+// subscriber should see it pinned at the limit rather than wrapped around.
+static int16_t saturate16(int v) {
+    return (v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : v);
+}
+
+static void sample_values(int16_t *values) {
+    values[0] = sample_ambient_temperature();
+    values[1] = sample_heater_temperature();
+    values[2] = current_desired_temperature();
+    values[3] = current_power_level();
+    values[4] = saturate16(current_ambient_slope());
+}
+
+/*
+ * Build the next frame for subscriber s into buf, and return its length.
+ */
+static int build_frame(struct subscriber *s, const int16_t *values, int64_t now, uint8_t *buf) {
+    int full = (s->frames_since_full >= TELEMETRY_FULL_FRAME_INTERVAL);
+    int len = 6;
+
+    // See whether the changes will fit in a byte
+    for(int v = 0; v < TV_COUNT && !full; v++) {
+        int delta = values[v] - s->last[v];
+        if ((s->mask & (1 << v)) && (delta < -128 || delta > 127)) {
+            full = 1;
+        }
+    }
+
+    buf[0] = 'H';
+    buf[1] = 'T';
+    buf[2] = full ? 'F' : 'D';
+    buf[3] = s->mask;
+    memcpy(buf+4, &s->seq, 2);
+    if (full) {
+        uint32_t stamp = now / 1000;
+        memcpy(buf+len, &stamp, 4);
+        len += 4;
+    }
+    else {
+        uint16_t elapsed = (now - s->last_sent) / 1000;
+        memcpy(buf+len, &elapsed, 2);
+        len += 2;
+    }
+
+    for(int v = 0; v < TV_COUNT; v++) {
+        if (s->mask & (1 << v)) {
+            if (full) {
+                memcpy(buf+len, &values[v], 2);
+                len += 2;
+            }
+            else {
+                buf[len++] = (int8_t)(values[v] - s->last[v]);
+            }
+            s->last[v] = values[v];
+        }
+    }
+
+    s->frames_since_full = (full ? 1 : s->frames_since_full+1);
+    s->seq++;
+    s->last_sent = now;
+    return len;
+}
+
+void telemetry_loop() {
+    uint8_t frame[6 + 4 + 2*TV_COUNT];
+    int16_t values[TV_COUNT];
+
+    int generation = wifi_link_generation();
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    if (sock < 0) {
+        LOGE(TAG, "Unable to create socket: errno %d", errno);
+        vTaskDelete(NULL);
+        return;
+    }
+
+    while (1) {
+        int64_t now = esp_timer_get_time();
+
+        if (wifi_link_generation() != generation) {
+            // The link was re-established; start over with a fresh socket
+            close(sock);
+            generation = wifi_link_generation();
+            sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+            if (sock < 0) {
+                LOGE(TAG, "Unable to create socket: errno %d", errno);
+                vTaskDelete(NULL);
+                return;
+            }
+        }
+        int64_t next_due = 0;
+        int sampled = 0;
+
+        xSemaphoreTake(subscribers_lock, portMAX_DELAY);
+        for(int i = 0; i < MAX_SUBSCRIBERS; i++) {
+            struct subscriber *s = &subscribers[i];
+            if (!s->active) {
+                continue;
+            }
+            if (now > s->expires) {
+                LOGI(TAG, "Telemetry subscription for %s expired", inet_ntoa(s->to.sin_addr));
+                s->active = 0;
+                continue;
+            }
+            if (now >= s->next_due) {
+                if (!sampled) {
+                    sample_values(values);
+                    sampled = 1;
+                }
+                int len = build_frame(s, values, now, frame);
+                if (sendto(sock, frame, len, 0, (struct sockaddr *)&s->to, sizeof(s->to)) < 0) {
+                    ESP_LOGW(TAG, "Telemetry send failed: errno %d", errno);
+                }
+                s->next_due += s->period * 1000LL;
+                if (s->next_due < now) {
+                    // We fell behind; don't try to catch up.
+                    s->next_due = now + s->period * 1000LL;
+                }
+            }
+            if (next_due == 0 || s->next_due < next_due) {
+                next_due = s->next_due;
+            }
+        }
+        xSemaphoreGive(subscribers_lock);
+
+        // Sleep until the next frame is due, or until someone subscribes.
+        TickType_t wait = portMAX_DELAY;
+        if (next_due) {
+            int64_t ms = (next_due - esp_timer_get_time()) / 1000;
+            wait = (ms < portTICK_PERIOD_MS ? 1 : ms / portTICK_PERIOD_MS);
+        }
+        ulTaskNotifyTake(pdTRUE, wait);
+    }
+}
+
+void init_telemetry() {
+    subscribers_lock = xSemaphoreCreateMutex();
+    xTaskCreate(telemetry_loop, "telemetry", 4096, NULL, PRIORITY_NETWORK, &telemetry_task);
+}
@@ -16,16 +16,89 @@
 //
 // For the ambient temperature, we dampen the sensor variability by keeping a running average.
 // We also through away the data entirely if it is too old.
+//
+// All of this is done in integer centidegrees (see centideg_t); the only floating point left
+// is the reading from the chip's sensor driver.
 
 
 static char *TAG = "temps";
 
 // We get temperatures at 1-minute intervals, so this smooths over 15 minute periods
 #define HISTORY_LEN 15
-static float ambient_history[HISTORY_LEN];
+static centideg_t ambient_history[HISTORY_LEN];
 static int ahi = 0;
 static int64_t ambient_timestamp = 0;
 
+// Rate of change of the (averaged) ambient temperature, in centidegrees per hour, smoothed
+// further with an exponential filter:  a new reading counts 1/SLOPE_DIVISOR.  Readings closer
+// together than SLOPE_MIN_INTERVAL (a burst of them is allowed) are measured against the last
+// one that wasn't, and no rate counts for more than SLOPE_LIMIT, so the slope always fits
+// comfortably in the int16 that telemetry sends it in.
+#define SLOPE_DIVISOR 5
+#define SLOPE_MIN_INTERVAL (10 * 1000 * 1000)   // microseconds
+#define SLOPE_LIMIT 10000
+static int ambient_slope = 0;
+static centideg_t last_ambient = NO_TEMP_VALUE;
+static int64_t last_ambient_timestamp = 0;
+
+// When we last saved the ambient temperature to persistent storage
+static int64_t ambient_saved_timestamp = 0;
+
+/*
+ * Parse a temperature in degrees ("19", "-2.5", "20.25") into centidegrees.  Digits past the
+ * second decimal place are rounded.  Returns 0, or -1 if s isn't a number (or is far out of range).
+ */
+int parse_centideg(const char *s, centideg_t *val) {
+    int negative = 0, digits = 0, scale = 100;
+    int32_t v = 0;
+
+    while (*s == ' ') {
+        s++;
+    }
+    if (*s == '-' || *s == '+') {
+        negative = (*s++ == '-');
+    }
+    for( ; *s >= '0' && *s <= '9'; s++, digits++) {
+        v = v * 10 + (*s - '0');
+        if (v > 300) {
+            return -1;
+        }
+    }
+    v *= 100;
+    if (*s == '.') {
+        for(s++; *s >= '0' && *s <= '9'; s++, digits++) {
+            scale /= 10;
+            if (scale > 0) {
+                v += (*s - '0') * scale;
+            }
+            else if (scale == 0) {
+                v += (*s >= '5');   // round on the third decimal; ignore the rest
+                scale = -1;
+            }
+        }
+    }
+    while (*s == ' ' || *s == '\n' || *s == '\r') {
+        s++;
+    }
+    if (digits == 0 || *s != 0) {
+        return -1;
+    }
+    *val = negative ? -v : v;
+    return 0;
+}
+
+// Format a temperature as degrees, with two decimals, into buf (CENTIDEG_LEN long)
+char *centideg_string(centideg_t val, char *buf) {
+    int v = val;
+    const char *sign = "";
+    if (v < 0) {
+        sign = "-";
+        v = -v;
+    }
+    snprintf(buf, CENTIDEG_LEN, "%s%d.%02d", sign, v / 100, v % 100);
+    return buf;
+}
+
 // Ambient temperature
 
 void reset_ambient_history() {
@@ -33,38 +106,115 @@ void reset_ambient_history() {
         ambient_history[i] = NO_TEMP_VALUE;
     }
     ahi = 0;
+    last_ambient = NO_TEMP_VALUE;
+    ambient_slope = 0;
 }
 
-float current_ambient_temperature() {
+static centideg_t ambient_average() {
+    int32_t val = 0;
+    int count = 0;
+    for(int i = 0; i<HISTORY_LEN; i++) {
+        if (ambient_history[i] != NO_TEMP_VALUE) {
+            val += ambient_history[i];
+            count++;
+        }
+    }
+    if (count == 0) {
+        return NO_TEMP_VALUE;
+    }
+    // rounded, rather than truncated toward zero
+    return (val + (val < 0 ? -count : count) / 2) / count;
+}
+
+centideg_t current_ambient_temperature() {
     
     int64_t current_time = esp_timer_get_time();
     int64_t ts_delta = current_time - ambient_timestamp;
 
     if (ts_delta > READ_LIFETIME*1000LL) {
         int mins = ts_delta / (1000*1000*60);
-        ESP_LOGW(TAG,"Stored temp %d out of date by %d minutes", current_time, mins);
+        ESP_LOGW(TAG,"Stored temp out of date by %d minutes", mins);
         reset_ambient_history();
         return NO_TEMP_VALUE;
     }
-    else {
-        float val = 0;
-        int count = 0;
-        for(int i = 0; i<HISTORY_LEN; i++) {
-            if (ambient_history[i] != NO_TEMP_VALUE) {
-                val += ambient_history[i];
-                count++;
-            }
+    return ambient_average();
+}
+
+// The same, for anyone just watching (telemetry):  an out of date reading is NO_TEMP_VALUE,
+// but it is left to the control loop to complain about it and start over.
+centideg_t sample_ambient_temperature() {
+    if (esp_timer_get_time() - ambient_timestamp > READ_LIFETIME*1000LL) {
+        return NO_TEMP_VALUE;
+    }
+    return ambient_average();
+}
+
+void update_ambient_slope(centideg_t val, int64_t stamp) {
+    if (last_ambient != NO_TEMP_VALUE) {
+        if (stamp - last_ambient_timestamp < SLOPE_MIN_INTERVAL) {
+            return;
         }
-        if (count == 0) {
-            return NO_TEMP_VALUE;
+        int64_t per_hour = (int64_t)(val - last_ambient) * (1000LL * 1000 * 60 * 60) / (stamp - last_ambient_timestamp);
+        if (per_hour > SLOPE_LIMIT) {
+            per_hour = SLOPE_LIMIT;
         }
-        else {
-            return val/count;
+        else if (per_hour < -SLOPE_LIMIT) {
+            per_hour = -SLOPE_LIMIT;
         }
+        ambient_slope += ((int)per_hour - ambient_slope) / SLOPE_DIVISOR;
+    }
+    last_ambient = val;
+    last_ambient_timestamp = stamp;
+}
+
+int current_ambient_slope() {
+    return ambient_slope;
+}
+
+// Remember the ambient temperature across reboots, so that we can start controlling the heater
+// right away rather than waiting for the next reading.  Only save every AMBIENT_SAVE_INTERVAL,
+// to spare the flash.
+static void save_ambient_temperature(centideg_t val) {
+    char buf[CENTIDEG_LEN];
+    if (ambient_saved_timestamp == 0 || ambient_timestamp - ambient_saved_timestamp > AMBIENT_SAVE_INTERVAL*1000LL) {
+        set_psv("amb", centideg_string(val, buf));
+        ambient_saved_timestamp = ambient_timestamp;
     }
 }
 
-int receive_ambient_temperature(void *buf, int len) {
+// Start from the saved ambient temperature, if there is one.  We don't know how old it is
+// (the clock isn't set yet), so it gets the usual READ_LIFETIME from now.
+void restore_ambient_temperature() {
+    char saved[PSV_MAX_LEN];
+    centideg_t val;
+    if (get_psv("amb", saved, sizeof(saved)) == 0 && parse_centideg(saved, &val) == 0) {
+        if (val >= CENTIDEG(2) && val <= CENTIDEG(40)) {
+            LOGI(TAG, "Restoring last known ambient temperature %s", saved);
+            ambient_history[0] = val;
+            ahi = 1;
+            ambient_timestamp = esp_timer_get_time();
+        }
+    }
+}
+
+// How long ago (in microseconds) the last ambient reading came in, or -1 if there hasn't been one
+int64_t ambient_age() {
+    return ambient_timestamp ? esp_timer_get_time() - ambient_timestamp : -1;
+}
+
+// Pick up where we were before a restart (see warm_restart.c):  the averaged temperature
+// and its trend, as of age microseconds ago.
+void restore_ambient(centideg_t val, int slope, int64_t age) {
+    reset_ambient_history();
+    ambient_history[0] = val;
+    ahi = 1;
+    last_ambient = val;
+    ambient_slope = (slope > SLOPE_LIMIT ? SLOPE_LIMIT : slope < -SLOPE_LIMIT ? -SLOPE_LIMIT : slope);
+    ambient_timestamp = esp_timer_get_time() - age;
+    last_ambient_timestamp = ambient_timestamp;
+}
+
+int receive_ambient_temperature(void *buf, int len, int sock, void *source) {
     // Null terminate and treat as string; we can do this safely because we know the underlying buffer
     // is longer than any data we should be recieving. (#bad_code_smell)
     char *cbuf = (char *)buf;
@@ -72,18 +222,27 @@ int receive_ambient_temperature(void *buf, int len) {
     ESP_LOGI(TAG, "Received ambient temp %s", cbuf);
 
     // Extract the temperature (in Celsius)
-    float val = atof(cbuf);
-    if (val < 2 || val > 40) {
-        LOGW(TAG, "Ambient temperature %f out of range; ignoring", val);
-    }
-    else {
+    // (The meter counts rejected readings too, so it stops before we complain or save.)
+    uint32_t start = meter_start();
+    centideg_t val;
+    int valid = (parse_centideg(cbuf, &val) == 0 && val >= CENTIDEG(2) && val <= CENTIDEG(40));
+    if (valid) {
         // store it, and remember when we last read it
         ambient_timestamp = esp_timer_get_time();
         ambient_history[ahi++] = val;
         if (ahi == HISTORY_LEN) {
             ahi = 0;
         }
+        update_ambient_slope(current_ambient_temperature(), ambient_timestamp);
     }
+    meter_stop(METER_AMBIENT, start);
+
+    if (!valid) {
+        LOGW(TAG, "Ambient temperature %s out of range; ignoring", cbuf);
+        return 0;
+    }
+    report_health(HEALTH_AMBIENT);
+    save_ambient_temperature(val);
     return 0;
 }
 
@@ -95,8 +254,9 @@ void report_ambient_history_values() {
     // For the paranoid: if any of the values run over, they will be written over by the next in line, leading
     // to a garbled string, but not corrupted memory.  And the extra chars added to the buffer should prevent the
     // last one from overflowing, as well.
+    char t[CENTIDEG_LEN];
     for(int i=0; i<HISTORY_LEN; i++) {
-        sprintf(ahstring+(i*8), "%6.2f, ", ambient_history[i]);
+        sprintf(ahstring+(i*8), "%6s, ", centideg_string(ambient_history[i], t));
     }
     send_messagef(0, "ambient temperature history %s", ahstring);
 }
@@ -110,29 +270,37 @@ void report_ambient_history_values() {
 // See https://docs.espressif.com/projects/esp-idf/en/latest/esp32c3/api-reference/peripherals/temp_sensor.html
 // And {$IDF_SRC}/examples/peripherals/temp_sensor
 
-float current_heater_temperature() {
+// Read the sensor without complaining about it if it fails.
+// (The driver gives us a float; this is the one place we convert.)
+centideg_t sample_heater_temperature() {
     float val;
-    int err;
-    err = temp_sensor_read_celsius(&val);
-    if (err) {
+    centideg_t cval = NO_TEMP_VALUE;
+    if (temp_sensor_read_celsius(&val) == ESP_OK) {
+        cval = (centideg_t)(val * 100 + (val < 0 ? -0.5f : 0.5f));
+    }
+    return cval;
+}
+
+centideg_t current_heater_temperature() {
+    centideg_t val = sample_heater_temperature();
+    if (val == NO_TEMP_VALUE) {
         LOGE(TAG, "Unable to read heater temperature");
-        return NO_TEMP_VALUE;
     }
     return val;
 }
 
 
 
-// Do all initialization required.
+// Initialization, which is split up so that boot can do each part as soon as it can.
 
-void init_temps() {
-    
+void init_ambient_listener() {
+    listener_task("ambient", TEMPERATURE_PORT, PRIORITY_AMBIENT, AMBIENT_RATE, AMBIENT_BURST, receive_ambient_temperature);
+}
+
+void init_heater_sensor() {
     // initialize ambient history
     reset_ambient_history();
 
-    // start ambient listener/updater
-    listener_task("ambient", TEMPERATURE_PORT, receive_ambient_temperature);
-
     // initialize onboard sensor
     temp_sensor_config_t temp_sensor = TSENS_CONFIG_DEFAULT();
     esp_err_t err = temp_sensor_set_config(temp_sensor);
@@ -144,4 +312,3 @@ void init_temps() {
         LOGE(TAG, "temp sensor start failed (%s)", esp_err_to_name(err));
     }
 }
-
@@ -0,0 +1,136 @@
+#include <stdint.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "libconfig.h"
+#include "libdecls.h"
+
+/*
+ * Trace recording, so that we can find out afterwards exactly what led up to something.
+ * We keep the last TRACE_RECORDS events in a ring in RAM:  everything that comes in
+ * (datagrams, with who sent them, including ones the rate limit dropped; the heater sensor
+ * readings the control loop takes; the clock being set) and everything we decide and do (each control decision
+ * with all its inputs; the levels we drive the relay pins to).  Each record is a fixed
+ * 32 byte struct trace_record (see libdecls.h), stamped with milliseconds since boot.
+ *
+ * The console "trace <from>" command sends records, oldest first, starting at sequence
+ * number <from> (or the oldest we still have), at most TRACE_CHUNKS datagrams at a time.
+ * Each datagram is a chunk:
+ *     "HCTR", uint8 version, uint8 record count, uint16 record size,
+ *     uint32 sequence number of the first record, uint32 sequence number of the next record
+ *         to be written (so the client knows when it has caught up),
+ *     then the records.
+ * console.py collects them into a file, and host/replay.c runs the recorded inputs back
+ * through the same code and checks that the decisions and outputs come out the same.
+ */
+
+#define TRACE_VERSION 1
+
+struct __attribute__((packed)) trace_chunk_header {
+    char magic[4];              // "HCTR"
+    uint8_t version;
+    uint8_t count;
+    uint16_t record_size;
+    uint32_t first;
+    uint32_t next;
+};
+
+#define RECORDS_PER_CHUNK ((MESSAGE_LEN - sizeof(struct trace_chunk_header)) / sizeof(struct trace_record))
+
+static struct trace_record ring[TRACE_RECORDS];
+static uint32_t trace_next = 0;         // sequence number of the next record
+static SemaphoreHandle_t trace_lock;
+
+// Heater sensor readings are only recorded when they change.
+static centideg_t last_sensor = NO_TEMP_VALUE;
+
+static void trace_add(struct trace_record *r) {
+    if (trace_lock == NULL) {
+        return;
+    }
+    r->ms = esp_timer_get_time() / 1000;
+    xSemaphoreTake(trace_lock, portMAX_DELAY);
+    ring[trace_next % TRACE_RECORDS] = *r;
+    trace_next++;
+    xSemaphoreGive(trace_lock);
+}
+
+void trace_datagram(int port, uint32_t addr, const void *data, int len, int dropped) {
+    struct trace_record r = { .type = dropped ? TRACE_DROPPED : TRACE_DATAGRAM, .arg = port };
+    r.len = len > 255 ? 255 : len;
+    r.datagram.addr = addr;
+    memcpy(r.datagram.text, data, len < TRACE_TEXT_LEN ? len : TRACE_TEXT_LEN);
+    trace_add(&r);
+}
+
+void trace_sensor(centideg_t val) {
+    if (val == last_sensor) {
+        return;
+    }
+    last_sensor = val;
+    struct trace_record r = { .type = TRACE_SENSOR, .value = val };
+    trace_add(&r);
+}
+
+void trace_time(int32_t unixtime) {
+    struct trace_record r = { .type = TRACE_TIME, .value = unixtime };
+    trace_add(&r);
+}
+
+void trace_decision(const struct control_inputs *in, enum power_level previous, enum power_level level) {
+    struct trace_record r = { .type = TRACE_DECISION, .arg = level };
+    r.decision.desired = in->desired;
+    r.decision.actual = in->actual;
+    r.decision.heater = in->heater;
+    r.decision.max = in->max;
+    r.decision.override = in->override;
+    r.decision.previous = previous;
+    trace_add(&r);
+}
+
+// The relay pins follow the level:  bit 0 is LWATT_PIN, bit 1 HWATT_PIN (see power_controller.c)
+void trace_output(enum power_level level) {
+    struct trace_record r = { .type = TRACE_OUTPUT, .arg = level, .value = level };
+    trace_add(&r);
+}
+
+void send_trace(uint32_t from) {
+    uint32_t buf[MESSAGE_LEN / 4];     // (aligned for the records)
+    struct trace_chunk_header *h = (struct trace_chunk_header *)buf;
+
+    for(int chunk = 0; chunk < TRACE_CHUNKS; chunk++) {
+        memcpy(h->magic, "HCTR", 4);
+        h->version = TRACE_VERSION;
+        h->record_size = sizeof(struct trace_record);
+
+        xSemaphoreTake(trace_lock, portMAX_DELAY);
+        if (trace_next > TRACE_RECORDS && from < trace_next - TRACE_RECORDS) {
+            from = trace_next - TRACE_RECORDS;
+        }
+        if (from > trace_next) {
+            from = trace_next;
+        }
+        h->first = from;
+        h->next = trace_next;
+        h->count = 0;
+        struct trace_record *records = (struct trace_record *)(h + 1);
+        while (h->count < RECORDS_PER_CHUNK && from < trace_next) {
+            records[h->count++] = ring[from++ % TRACE_RECORDS];
+        }
+        xSemaphoreGive(trace_lock);
+
+        send_reply_data(buf, sizeof(*h) + h->count * sizeof(struct trace_record));
+        if (from == h->next) {
+            break;
+        }
+    }
+}
+
+void init_trace() {
+    trace_lock = xSemaphoreCreateMutex();
+    struct trace_record r = { .type = TRACE_BOOT };
+    trace_add(&r);
+}
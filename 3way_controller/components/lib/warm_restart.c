@@ -0,0 +1,143 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include "esp_system.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_rom_crc.h"
+#include "esp_private/esp_clk.h"
+#include "libconfig.h"
+#include "libdecls.h"
+
+/*
+ * Carrying on across a restart.  Most of our state (a bump, a manual power level, the ambient
+ * readings, the time of day) lives only in RAM, so after a restart (OTA, the "reboot" command,
+ * a watchdog or a crash) we used to start from nothing and fly blind until new readings came
+ * in and the time was fetched again.
+ *
+ * Instead we keep a copy of that state in RTC memory, which survives everything but a
+ * power cycle.  The control loop refreshes it every pass, and a shutdown handler once more
+ * just before esp_restart; a watchdog reset or a crash gets the copy from the last pass.  A CRC
+ * tells us whether what we find at boot is really ours (rather than power-on garbage, or a
+ * copy half written when we went down).
+ *
+ * Times are kept against the RTC clock, which keeps running across resets, rather than
+ * esp_timer, which starts over; so a bump ends when it should, and the clock is set to the
+ * right time, however long the restart took.
+ */
+
+static const char *TAG = "warm_restart";
+
+#define WARM_STATE_MAGIC 0x57524d31    // "WRM1"
+
+struct warm_state {
+    uint32_t magic;
+    uint16_t size;                  // of the struct, in case the layout changes with an update
+    uint8_t power_level;
+    uint8_t power_override;
+    int64_t wall_offset;            // wall clock time minus RTC time, in us; 0 if the clock isn't set
+    char tz[16];
+    int64_t bump_until;             // RTC time; 0 if there is no bump
+    int16_t bump_temp;
+    int16_t ambient;                // the averaged ambient temperature
+    int32_t ambient_slope;
+    int64_t ambient_time;           // RTC time of the last ambient reading
+    int16_t max_heater;
+    uint32_t crc;                   // of everything above
+};
+
+static RTC_NOINIT_ATTR struct warm_state warm;
+
+static uint32_t warm_crc(const struct warm_state *s) {
+    return esp_rom_crc32_le(0, (const uint8_t *)s, offsetof(struct warm_state, crc));
+}
+
+void save_warm_state() {
+    struct warm_state s;
+    int64_t rtc_now = esp_clk_rtc_time();
+    struct timeval tv;
+    int bump_temp = 0;
+
+    memset(&s, 0, sizeof(s));
+    s.magic = WARM_STATE_MAGIC;
+    s.size = sizeof(s);
+    s.power_level = current_power_level();
+    s.power_override = current_power_override();
+
+    gettimeofday(&tv, NULL);
+    if (tv.tv_sec > EARLIEST_VALID_TIME) {
+        s.wall_offset = tv.tv_sec * 1000000LL + tv.tv_usec - rtc_now;
+    }
+    const char *tz = getenv("TZ");
+    if (tz) {
+        strncpy(s.tz, tz, sizeof(s.tz)-1);
+    }
+
+    int remaining = bump_remaining(&bump_temp);
+    if (remaining) {
+        s.bump_until = rtc_now + remaining * 1000000LL;
+        s.bump_temp = bump_temp;
+    }
+
+    int64_t age = ambient_age();
+    s.ambient = current_ambient_temperature();
+    if (age >= 0 && s.ambient != NO_TEMP_VALUE) {
+        s.ambient_time = rtc_now - age;
+        s.ambient_slope = current_ambient_slope();
+    }
+    s.max_heater = max_temperature();
+
+    s.crc = warm_crc(&s);
+    warm = s;
+}
+
+static void save_on_shutdown() {
+    save_warm_state();
+}
+
+/*
+ * At boot:  if there is a good copy of our state from before a reset, take up from there.
+ * Returns 0 if so, -1 if we are starting from scratch.
+ */
+int restore_warm_state() {
+    esp_reset_reason_t reason = esp_reset_reason();
+    int64_t rtc_now = esp_clk_rtc_time();
+
+    esp_register_shutdown_handler(save_on_shutdown);
+    if (reason == ESP_RST_POWERON || reason == ESP_RST_BROWNOUT || reason == ESP_RST_UNKNOWN) {
+        return -1;
+    }
+    if (warm.magic != WARM_STATE_MAGIC || warm.size != sizeof(warm) || warm.crc != warm_crc(&warm)) {
+        LOGI(TAG, "No saved state after reset (reason %d)", reason);
+        return -1;
+    }
+
+    if (warm.wall_offset) {
+        int64_t wall = warm.wall_offset + rtc_now;
+        struct timeval tv = { .tv_sec = wall / 1000000, .tv_usec = wall % 1000000 };
+        if (warm.tz[0]) {
+            setenv("TZ", warm.tz, 1);
+            tzset();
+        }
+        settimeofday(&tv, NULL);
+        trace_time(tv.tv_sec);
+    }
+    if (warm.bump_until > rtc_now) {
+        restore_bump(warm.bump_temp, (warm.bump_until - rtc_now) / 1000000);
+    }
+    int ambient_kept = (warm.ambient != NO_TEMP_VALUE && rtc_now - warm.ambient_time < READ_LIFETIME * 1000LL);
+    if (ambient_kept) {
+        restore_ambient(warm.ambient, warm.ambient_slope, rtc_now - warm.ambient_time);
+    }
+    set_max_temperature(warm.max_heater);
+    restore_power_level(warm.power_level, warm.power_override);
+
+    LOGI(TAG, "Carrying on after reset (reason %d): clock %s, bump %s, ambient %s, level %d%s",
+         reason, warm.wall_offset ? "set" : "not set", warm.bump_until > rtc_now ? "on" : "off",
+         ambient_kept ? "kept" : "unknown", warm.power_level,
+         warm.power_override != power_na ? " (assigned)" : "");
+    return 0;
+}
@@ -0,0 +1,188 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_event.h"
+#include "esp_netif.h"
+#include "esp_wifi.h"
+#include "sdkconfig.h"
+#include "libconfig.h"
+#include "libdecls.h"
+
+/*
+ * WIFI connection management.
+ *
+ * We drive the connection from the WIFI and IP events, rather than connecting once at boot
+ * and hoping.  When the link drops we reconnect on a timer, backing off exponentially from
+ * WIFI_BACKOFF_MIN to WIFI_BACKOFF_MAX.  The first few attempts go straight to the access point
+ * and channel we were last connected to, which skips the scan and is much faster when (as is
+ * usual) the AP just rebooted; after that we scan again in case it moved.
+ *
+ * Every time we get an address, we bump the link generation.  Tasks that own sockets check
+ * it (see wifi_link_generation) and rebuild their sockets when it changes.
+ *
+ * The SSID and password are the ones configured for the ESP example connection code
+ * (CONFIG_EXAMPLE_WIFI_SSID and CONFIG_EXAMPLE_WIFI_PASSWORD in menuconfig).
+ */
+
+static const char *TAG = "wifi";
+
+#define WIFI_CONNECTED_BIT 0x01
+
+static EventGroupHandle_t wifi_events;
+static esp_timer_handle_t reconnect_timer;
+static wifi_config_t wifi_config;
+
+static volatile int link_generation = 0;
+static int link_up = 0;                 // true from when we get an address until we disconnect
+static int backoff = 0;                 // ms before the next reconnect attempt
+static int attempts = 0;                // attempts since we lost the link
+
+// cached from the last successful connection
+static uint8_t last_bssid[6];
+static uint8_t last_channel = 0;
+
+// metrics
+static int disconnects = 0;
+static int last_reason = 0;
+static int64_t link_up_since = 0;
+static int64_t link_down_since = 0;
+static int last_reconnect_ms = 0;
+static int max_reconnect_ms = 0;
+static int connect_rssi = 0;
+
+int wifi_link_generation() {
+    return link_generation;
+}
+
+int wifi_connected() {
+    return link_up;
+}
+
+static void reconnect(void *arg) {
+    attempts++;
+    if (attempts <= WIFI_FAST_ATTEMPTS && last_channel != 0) {
+        memcpy(wifi_config.sta.bssid, last_bssid, sizeof(last_bssid));
+        wifi_config.sta.bssid_set = true;
+        wifi_config.sta.channel = last_channel;
+    }
+    else {
+        wifi_config.sta.bssid_set = false;
+        wifi_config.sta.channel = 0;
+    }
+    esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+    esp_err_t err = esp_wifi_connect();
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "esp_wifi_connect failed (%s)", esp_err_to_name(err));
+    }
+}
+
+static void schedule_reconnect() {
+    backoff = (backoff == 0 ? WIFI_BACKOFF_MIN : backoff * 2);
+    if (backoff > WIFI_BACKOFF_MAX) {
+        backoff = WIFI_BACKOFF_MAX;
+    }
+    esp_timer_start_once(reconnect_timer, backoff * 1000LL);
+}
+
+static void wifi_event_handler(void *arg, esp_event_base_t base, int32_t id, void *data) {
+    if (id == WIFI_EVENT_STA_START) {
+        reconnect(NULL);
+    }
+    else if (id == WIFI_EVENT_STA_CONNECTED) {
+        wifi_event_sta_connected_t *event = (wifi_event_sta_connected_t *)data;
+        memcpy(last_bssid, event->bssid, sizeof(last_bssid));
+        last_channel = event->channel;
+    }
+    else if (id == WIFI_EVENT_STA_DISCONNECTED) {
+        wifi_event_sta_disconnected_t *event = (wifi_event_sta_disconnected_t *)data;
+        last_reason = event->reason;
+        if (link_up) {
+            // (We can't send messages until we're back; this one will go out when we are.)
+            LOGW(TAG, "WIFI disconnected (reason %d)", event->reason);
+            link_up = 0;
+            disconnects++;
+            link_down_since = esp_timer_get_time();
+            attempts = 0;
+            backoff = 0;
+            xEventGroupClearBits(wifi_events, WIFI_CONNECTED_BIT);
+        }
+        schedule_reconnect();
+    }
+}
+
+static void ip_event_handler(void *arg, esp_event_base_t base, int32_t id, void *data) {
+    if (id == IP_EVENT_STA_GOT_IP) {
+        ip_event_got_ip_t *event = (ip_event_got_ip_t *)data;
+        wifi_ap_record_t ap;
+        int64_t now = esp_timer_get_time();
+
+        if (esp_wifi_sta_get_ap_info(&ap) == ESP_OK) {
+            connect_rssi = ap.rssi;
+        }
+        if (link_down_since) {
+            last_reconnect_ms = (now - link_down_since) / 1000;
+            if (last_reconnect_ms > max_reconnect_ms) {
+                max_reconnect_ms = last_reconnect_ms;
+            }
+            LOGI(TAG, "WIFI reconnected in %d ms after %d attempt(s); address " IPSTR ", rssi %d",
+                last_reconnect_ms, attempts, IP2STR(&event->ip_info.ip), connect_rssi);
+        }
+        else {
+            LOGI(TAG, "WIFI connected; address " IPSTR ", rssi %d", IP2STR(&event->ip_info.ip), connect_rssi);
+        }
+        link_up = 1;
+        link_up_since = now;
+        attempts = 0;
+        backoff = 0;
+        link_generation++;
+        xEventGroupSetBits(wifi_events, WIFI_CONNECTED_BIT);
+    }
+}
+
+/*
+ * Start connecting.  Returns right away; use wifi_wait_connected to wait for the link.
+ */
+void init_wifi() {
+    wifi_events = xEventGroupCreate();
+    esp_timer_create_args_t timer_args = { .callback = reconnect, .name = "wifi_reconnect" };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &reconnect_timer));
+
+    esp_netif_create_default_wifi_sta();
+    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+    ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, wifi_event_handler, NULL));
+    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, ip_event_handler, NULL));
+
+    strncpy((char *)wifi_config.sta.ssid, CONFIG_EXAMPLE_WIFI_SSID, sizeof(wifi_config.sta.ssid));
+    strncpy((char *)wifi_config.sta.password, CONFIG_EXAMPLE_WIFI_PASSWORD, sizeof(wifi_config.sta.password));
+    wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+    wifi_config.sta.sort_method = WIFI_CONNECT_AP_BY_SIGNAL;
+    ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
+    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
+    ESP_ERROR_CHECK(esp_wifi_start());
+}
+
+// Wait until we are connected (have an address).  Returns true if we are.
+int wifi_wait_connected(TickType_t wait) {
+    return (xEventGroupWaitBits(wifi_events, WIFI_CONNECTED_BIT, pdFALSE, pdTRUE, wait) & WIFI_CONNECTED_BIT) != 0;
+}
+
+void report_wifi() {
+    wifi_ap_record_t ap;
+    int64_t now = esp_timer_get_time();
+
+    if (link_up && esp_wifi_sta_get_ap_info(&ap) == ESP_OK) {
+        send_messagef(0, "wifi: connected to %s (%02x:%02x:%02x:%02x:%02x:%02x channel %d) for %d s, rssi %d (%d at connect)",
+            ap.ssid, ap.bssid[0], ap.bssid[1], ap.bssid[2], ap.bssid[3], ap.bssid[4], ap.bssid[5],
+            ap.primary, (int)((now - link_up_since) / (1000 * 1000)), ap.rssi, connect_rssi);
+    }
+    else {
+        send_messagef(0, "wifi: not connected (reason %d), %d attempt(s), next in %d ms", last_reason, attempts, backoff);
+    }
+    send_messagef(0, "wifi: %d disconnect(s); last reconnect took %d ms, longest %d ms; link generation %d",
+        disconnects, last_reconnect_ms, max_reconnect_ms, link_generation);
+}
@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "esp_log.h"
+#include "lwip/sockets.h"
+#include "libconfig.h"
+#include "libdecls.h"
+#include "bench.h"
+
+/*
+ * Micro-benchmarks for the controller's hot paths, run on the host.
+ *
+ *     bench [-t seconds per benchmark] [-o results.json] [name ...]
+ *
+ * For each benchmark we report the time per operation, and how many heap allocations
+ * (and bytes) each operation makes.  The results also go to a JSON file, so runs can be
+ * compared by a script.  Times on a PC are of course much shorter than on the chip; what
+ * matters is how they compare from one version of the code to the next.
+ */
+
+int parse_temperature_values(const char *sched, int *vals);     // desired_temp.c
+int receive_ambient_temperature(void *buf, int len, int sock, void *source);   // temperatures.c
+int recieve_command(void *buf, int len, int sock, void *source);   // console.c
+
+#define MAX_BENCHMARKS 32
+
+struct benchmark {
+    const char *name;
+    void (*op)(void);
+    int ops_per_call;
+    // results
+    long long ops;
+    double ns_per_op;
+    double allocs_per_op;
+    double bytes_per_op;
+};
+
+static struct benchmark benchmarks[MAX_BENCHMARKS];
+static int benchmark_count = 0;
+
+void add_benchmark(const char *name, void (*op)(void), int ops_per_call) {
+    if (benchmark_count < MAX_BENCHMARKS) {
+        benchmarks[benchmark_count++] = (struct benchmark){ .name = name, .op = op, .ops_per_call = ops_per_call };
+    }
+}
+
+/*
+ * Allocation counting.  We replace malloc and friends with versions that count, and
+ * pass the work on to glibc.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void __libc_free(void *p);
+
+static volatile int counting = 0;
+static long long alloc_count = 0;
+static long long alloc_bytes = 0;
+
+static void count_alloc(size_t size) {
+    if (counting) {
+        __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&alloc_bytes, size, __ATOMIC_RELAXED);
+    }
+}
+
+// (The parentheses keep HEAP_GUARD's macros, if any, out of the way.)
+void *(malloc)(size_t size) {
+    count_alloc(size);
+    return __libc_malloc(size);
+}
+
+void *(calloc)(size_t n, size_t size) {
+    count_alloc(n * size);
+    return __libc_calloc(n, size);
+}
+
+void *(realloc)(void *p, size_t size) {
+    count_alloc(size);
+    return __libc_realloc(p, size);
+}
+
+void free(void *p) {
+    __libc_free(p);
+}
+
+static double seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run_benchmark(struct benchmark *b, double min_time) {
+    long long calls = 1;
+    double elapsed;
+
+    b->op();    // warm up
+
+    // Keep doubling the number of calls until the run takes long enough to measure.
+    while (1) {
+        alloc_count = alloc_bytes = 0;
+        counting = 1;
+        double start = seconds();
+        for(long long i = 0; i < calls; i++) {
+            b->op();
+        }
+        elapsed = seconds() - start;
+        counting = 0;
+        if (elapsed >= min_time || calls >= (1LL << 40)) {
+            break;
+        }
+        calls *= 2;
+    }
+    b->ops = calls * b->ops_per_call;
+    b->ns_per_op = elapsed * 1e9 / b->ops;
+    b->allocs_per_op = (double)alloc_count / b->ops;
+    b->bytes_per_op = (double)alloc_bytes / b->ops;
+}
+
+static void write_results(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        return;
+    }
+    fprintf(f, "{\n  \"benchmarks\": [\n");
+    int first = 1;
+    for(int i = 0; i < benchmark_count; i++) {
+        struct benchmark *b = &benchmarks[i];
+        if (b->ops == 0) {
+            continue;
+        }
+        fprintf(f, "%s    {\"name\": \"%s\", \"ops\": %lld, \"ns_per_op\": %.2f, \"allocs_per_op\": %.3f, \"bytes_per_op\": %.1f}",
+            first ? "" : ",\n", b->name, b->ops, b->ns_per_op, b->allocs_per_op, b->bytes_per_op);
+        first = 0;
+    }
+    fprintf(f, "\n  ]\n}\n");
+    fclose(f);
+}
+
+/*
+ * The benchmarks that only need the public interfaces.  (bench_messages.c and bench_time.c
+ * have the others.)
+ */
+
+static const char *schedule = "18,18,18,18,18,18,19,20,21,21,20,19,19,19,19,19,20,21,21,21,20,19,18,18";
+
+static void bench_parse_schedule() {
+    int vals[24];
+    parse_temperature_values(schedule, vals);
+}
+
+static void bench_ambient() {
+    char buf[16] = "21.50";
+    receive_ambient_temperature(buf, 5, -1, NULL);
+}
+
+// Commands are sent from the "console" to a socket we never read; the kernel drops them
+// when it fills up, which is fine.
+static int command_sock = -1;
+static struct sockaddr_in console_addr;
+
+static void run_command_string(const char *cmd) {
+    char buf[256];
+    int len = strlen(cmd);
+    memcpy(buf, cmd, len + 1);
+    recieve_command(buf, len, command_sock, &console_addr);
+}
+
+static void bench_command() {
+    run_command_string("#42 hello");
+}
+
+static void bench_command_batch() {
+    run_command_string("#43 level auto; maxheat 70; bump 1 2");
+}
+
+static void setup_command_socket() {
+    socklen_t len = sizeof(console_addr);
+    int sink = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&console_addr, 0, sizeof(console_addr));
+    console_addr.sin_family = AF_INET;
+    console_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(sink, (struct sockaddr *)&console_addr, sizeof(console_addr));
+    getsockname(sink, (struct sockaddr *)&console_addr, &len);
+    command_sock = socket(AF_INET, SOCK_DGRAM, 0);
+}
+
+static int selected(const char *name, int argc, char **argv, int first) {
+    if (first >= argc) {
+        return 1;
+    }
+    for(int i = first; i < argc; i++) {
+        if (strcmp(argv[i], name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    double min_time = 0.5;
+    const char *output = "bench_results.json";
+    int first = 1;
+
+    while (first < argc && argv[first][0] == '-') {
+        if (strcmp(argv[first], "-t") == 0 && first+1 < argc) {
+            min_time = atof(argv[first+1]);
+            first += 2;
+        }
+        else if (strcmp(argv[first], "-o") == 0 && first+1 < argc) {
+            output = argv[first+1];
+            first += 2;
+        }
+        else {
+            fprintf(stderr, "usage: %s [-t seconds] [-o results.json] [benchmark ...]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    host_log_level = 0;     // the code under test logs a lot; we don't want to measure printf
+    setup_command_socket();
+    register_message_benchmarks();
+    register_time_benchmarks();
+    add_benchmark("parse_temperature_values", bench_parse_schedule, 1);
+    add_benchmark("receive_ambient_temperature", bench_ambient, 1);
+    add_benchmark("recieve_command", bench_command, 1);
+    add_benchmark("recieve_command_batch", bench_command_batch, 1);
+
+    printf("%-28s %12s %10s %10s %10s\n", "benchmark", "ops", "ns/op", "allocs/op", "bytes/op");
+    for(int i = 0; i < benchmark_count; i++) {
+        struct benchmark *b = &benchmarks[i];
+        if (!selected(b->name, argc, argv, first)) {
+            continue;
+        }
+        run_benchmark(b, min_time);
+        printf("%-28s %12lld %10.1f %10.3f %10.1f\n", b->name, b->ops, b->ns_per_op, b->allocs_per_op, b->bytes_per_op);
+    }
+    write_results(output);
+    return 0;
+}
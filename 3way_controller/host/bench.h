@@ -0,0 +1,7 @@
+#pragma once
+
+// Register a benchmark.  op is run repeatedly; ops_per_call is how many operations each call does.
+void add_benchmark(const char *name, void (*op)(void), int ops_per_call);
+
+void register_message_benchmarks();
+void register_time_benchmarks();
@@ -0,0 +1,28 @@
+/*
+ * messages.c, built together with the benchmarks that need to get at its insides
+ * (the queues are static).
+ */
+#include "../components/lib/messages.c"
+#include "bench.h"
+
+static const char *bench_message = "Desired temp 19.000000, actual 18.250000, heater 45.000000, max 70.000000";
+
+static void bench_enqueue() {
+    enqueue_rrqueue(&message_queue, bench_message);
+}
+
+// Fill the queue about as full as it gets between broadcasts, then take it all out.
+#define FETCH_BATCH 16
+
+static void bench_fetch() {
+    for(int i = 0; i < FETCH_BATCH; i++) {
+        enqueue_rrqueue(&message_queue, bench_message);
+    }
+    fetch_rrqueue(&message_queue);
+}
+
+void register_message_benchmarks() {
+    init_messages();
+    add_benchmark("enqueue_rrqueue", bench_enqueue, 1);
+    add_benchmark("fetch_rrqueue", bench_fetch, FETCH_BATCH);
+}
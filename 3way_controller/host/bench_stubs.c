@@ -0,0 +1,51 @@
+#include "libconfig.h"
+#include "libdecls.h"
+
+/*
+ * Stand-ins for the parts of the controller the benchmarks don't include.
+ */
+
+const char *version_string = "host benchmark";
+
+int get_psv(const char *key, char *buf, int len) { return -1; }
+void set_psv(const char *key, const char *newval) {}
+
+// network.c
+void listener_task(const char *taskname, int port, int priority, int rate, int burst,
+                   int callback(void *, int, int, void *)) {}
+int get_internet_data(const char *server, const char *path, char *fill_buffer, int fb_len) { return -1; }
+
+// wifi.c
+int wifi_connected() { return 1; }
+
+// power_controller.c
+void set_power_level(char *level) {}
+void report_control_timing() {}
+
+// ota_upgrade.c, ota_image.c
+void ota_upgrade(const char *ipaddr, int expected_len, const char *sha_hex) {}
+void report_health(int bit) {}
+int report_running_image() { return 0; }
+
+// everything else the console can ask for
+void report_boot_times() {}
+void report_perf() {}
+void report_wifi() {}
+void send_snapshot() {}
+int telemetry_subscribe(void *sa, int mask, int period) { return 0; }
+void telemetry_unsubscribe(void *sa) {}
+
+// perf.c
+uint32_t meter_start() { return 0; }
+void meter_stop(enum cycle_meter meter, uint32_t start) {}
+
+// trace.c
+void trace_sensor(centideg_t val) {}
+void trace_time(int32_t unixtime) {}
+void send_trace(uint32_t from) {}
+
+// history.c
+void send_history(int from, int to) {}
+
+// longlog.c
+void send_longlog(int from, int to) {}
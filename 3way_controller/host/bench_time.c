@@ -0,0 +1,23 @@
+/*
+ * current_time.c, built together with the benchmark that needs its (static) response buffer.
+ */
+#include "../components/lib/current_time.c"
+#include "bench.h"
+
+// What worldtimeapi.org/api/ip.txt sends back, more or less
+static const char *time_response =
+    "HTTP/1.1 200 OK\r\nContent-Type: text/plain; charset=utf-8\r\n\r\n"
+    "abbreviation: PDT\nclient_ip: 203.0.113.7\ndatetime: 2022-10-18T09:41:02.518203-07:00\n"
+    "day_of_week: 2\nday_of_year: 291\ndst: true\ndst_from: 2022-03-13T10:00:00+00:00\n"
+    "dst_offset: 3600\ndst_until: 2022-11-06T09:00:00+00:00\nraw_offset: -28800\n"
+    "timezone: America/Los_Angeles\nunixtime: 1666111262\nutc_datetime: 2022-10-18T16:41:02.518203+00:00\n"
+    "utc_offset: -07:00\nweek_number: 42\n";
+
+static void bench_read_field() {
+    read_field("\nunixtime:");
+}
+
+void register_time_benchmarks() {
+    strncpy(databuf, time_response, sizeof(databuf)-1);
+    add_benchmark("read_field", bench_read_field, 1);
+}
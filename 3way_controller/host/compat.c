@@ -0,0 +1,164 @@
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "mbedtls/sha256.h"
+#include "esp32c3/rom/miniz.h"
+#include "esp_rom_crc.h"
+
+/*
+ * Libraries the chip has built in:  mbedtls's sha256, and the ROM's tinfl inflater and crc32.
+ */
+
+uint32_t esp_rom_crc32_le(uint32_t crc, uint8_t const *buf, uint32_t len) {
+    return crc32(crc, buf, len);
+}
+
+/*
+ * SHA-256, after FIPS 180-4
+ */
+
+static const uint32_t k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(uint32_t *state, const unsigned char *block) {
+    uint32_t w[64];
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for(int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[4*i] << 24 | (uint32_t)block[4*i+1] << 16 | (uint32_t)block[4*i+2] << 8 | block[4*i+3];
+    }
+    for(int i = 16; i < 64; i++) {
+        uint32_t s0 = ROR(w[i-15], 7) ^ ROR(w[i-15], 18) ^ (w[i-15] >> 3);
+        uint32_t s1 = ROR(w[i-2], 17) ^ ROR(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+    for(int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+        uint32_t t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void mbedtls_sha256_init(mbedtls_sha256_context *ctx) {
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+void mbedtls_sha256_free(mbedtls_sha256_context *ctx) {
+}
+
+int mbedtls_sha256_starts_ret(mbedtls_sha256_context *ctx, int is224) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    if (is224) {
+        return -1;      // not needed
+    }
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    return 0;
+}
+
+int mbedtls_sha256_update_ret(mbedtls_sha256_context *ctx, const unsigned char *input, size_t len) {
+    size_t fill = ctx->length % 64;
+
+    ctx->length += len;
+    if (fill && fill + len >= 64) {
+        memcpy(ctx->buffer + fill, input, 64 - fill);
+        sha256_block(ctx->state, ctx->buffer);
+        input += 64 - fill;
+        len -= 64 - fill;
+        fill = 0;
+    }
+    for( ; fill == 0 && len >= 64; input += 64, len -= 64) {
+        sha256_block(ctx->state, input);
+    }
+    memcpy(ctx->buffer + fill, input, len);
+    return 0;
+}
+
+int mbedtls_sha256_finish_ret(mbedtls_sha256_context *ctx, unsigned char output[32]) {
+    static const unsigned char pad[64] = { 0x80 };
+    uint64_t bits = ctx->length * 8;
+    unsigned char length[8];
+
+    for(int i = 0; i < 8; i++) {
+        length[i] = bits >> (56 - 8*i);
+    }
+    mbedtls_sha256_update_ret(ctx, pad, 1 + (119 - ctx->length % 64) % 64);
+    mbedtls_sha256_update_ret(ctx, length, 8);
+    for(int i = 0; i < 8; i++) {
+        output[4*i] = ctx->state[i] >> 24;
+        output[4*i+1] = ctx->state[i] >> 16;
+        output[4*i+2] = ctx->state[i] >> 8;
+        output[4*i+3] = ctx->state[i];
+    }
+    return 0;
+}
+
+/*
+ * tinfl, done with zlib's raw inflate.  zlib keeps its own window, so we just hand it the
+ * free part of the caller's output buffer each time.  tinfl_init only clears m_state; we
+ * notice that and start the stream over.
+ */
+
+tinfl_status tinfl_decompress(tinfl_decompressor *r, const uint8_t *in_buf, size_t *in_size,
+                              uint8_t *out_start, uint8_t *out_next, size_t *out_size, uint32_t flags) {
+    z_stream *z = r->stream;
+
+    if (flags & TINFL_FLAG_PARSE_ZLIB_HEADER) {
+        return TINFL_STATUS_BAD_PARAM;      // we only ever inflate raw streams
+    }
+    if (r->m_state == 0) {
+        if (z == NULL) {
+            z = r->stream = calloc(1, sizeof(*z));
+            if (inflateInit2(z, -15) != Z_OK) {
+                return TINFL_STATUS_FAILED;
+            }
+        }
+        else {
+            inflateReset(z);
+        }
+        r->m_state = 1;
+    }
+    if (r->m_state == 2) {
+        *in_size = *out_size = 0;
+        return TINFL_STATUS_DONE;
+    }
+
+    z->next_in = (uint8_t *)in_buf;
+    z->avail_in = *in_size;
+    z->next_out = out_next;
+    z->avail_out = *out_size;
+    int ret = inflate(z, Z_NO_FLUSH);
+    *in_size -= z->avail_in;
+    *out_size -= z->avail_out;
+
+    if (ret == Z_STREAM_END) {
+        r->m_state = 2;
+        return TINFL_STATUS_DONE;
+    }
+    if (ret != Z_OK && ret != Z_BUF_ERROR) {
+        return TINFL_STATUS_FAILED;
+    }
+    if (z->avail_out == 0) {
+        return TINFL_STATUS_HAS_MORE_OUTPUT;
+    }
+    if (!(flags & TINFL_FLAG_HAS_MORE_INPUT)) {
+        return TINFL_STATUS_FAILED_CANNOT_MAKE_PROGRESS;
+    }
+    return TINFL_STATUS_NEEDS_MORE_INPUT;
+}
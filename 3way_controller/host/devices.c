@@ -0,0 +1,790 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_event.h"
+#include "esp_netif.h"
+#include "esp_wifi.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "nvs_flash.h"
+#include "led_strip.h"
+#include "driver/gpio.h"
+#include "mbedtls/sha256.h"
+#include "sdkconfig.h"
+#include "twin.h"
+
+/*
+ * The twin's hardware:  the chip's peripherals, flash and radio, as the controller code sees
+ * them through ESP-IDF.  Anything that needs to last across restarts (NVS, the OTA partitions
+ * and which of them to boot) is kept in files in the state directory.
+ */
+
+static const char *TAG = "twin";
+
+const char *state_dir = "twin-state";
+
+static void state_path(char *path, size_t size, const char *name) {
+    snprintf(path, size, "%s/%s", state_dir, name);
+}
+
+void init_state_dir(const char *dir) {
+    state_dir = dir;
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        ESP_LOGE(TAG, "Unable to create state directory %s (%s)", dir, strerror(errno));
+        exit(1);
+    }
+}
+
+/*
+ * RTC memory:  the RTC_NOINIT_ATTR variables (the "rtc_noinit" section; see shim/esp_attr.h)
+ * are written to the state directory when we restart, and read back as we come up again.
+ * So, as on the chip, they survive a restart but not a power cycle (the twin being stopped
+ * and started again), and that is also what esp_reset_reason tells the code.
+ */
+
+extern char __start_rtc_noinit[] __attribute__((weak));
+extern char __stop_rtc_noinit[] __attribute__((weak));
+static esp_reset_reason_t reset_reason = ESP_RST_POWERON;
+
+static void save_rtc_memory() {
+    char path[256];
+    state_path(path, sizeof(path), "rtc");
+    FILE *f = fopen(path, "wb");
+    if (f) {
+        fwrite(__start_rtc_noinit, 1, __stop_rtc_noinit - __start_rtc_noinit, f);
+        fclose(f);
+    }
+}
+
+void init_rtc_memory() {
+    char path[256];
+    size_t size = __stop_rtc_noinit - __start_rtc_noinit;
+    state_path(path, sizeof(path), "rtc");
+    FILE *f = fopen(path, "rb");
+    if (f) {
+        if (size && fread(__start_rtc_noinit, 1, size, f) == size) {
+            reset_reason = ESP_RST_SW;
+        }
+        fclose(f);
+        unlink(path);
+    }
+    // Registered first, so it runs after anyone else's handler has had its say
+    esp_register_shutdown_handler(save_rtc_memory);
+}
+
+esp_reset_reason_t esp_reset_reason(void) {
+    return reset_reason;
+}
+
+/*
+ * GPIO:  we only drive outputs, and just remember (and log) their level.
+ */
+
+#define GPIO_COUNT 22
+static int gpio_levels[GPIO_COUNT];
+
+esp_err_t gpio_config(const gpio_config_t *config) {
+    return ESP_OK;
+}
+
+esp_err_t gpio_reset_pin(gpio_num_t pin) {
+    return gpio_set_level(pin, 0);
+}
+
+esp_err_t gpio_set_direction(gpio_num_t pin, gpio_mode_t mode) {
+    return ESP_OK;
+}
+
+esp_err_t gpio_set_level(gpio_num_t pin, uint32_t level) {
+    if (pin < 0 || pin >= GPIO_COUNT) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (gpio_levels[pin] != (level != 0)) {
+        ESP_LOGD(TAG, "gpio %d -> %d", pin, level != 0);
+    }
+    gpio_levels[pin] = (level != 0);
+    return ESP_OK;
+}
+
+int gpio_get_level(gpio_num_t pin) {
+    return (pin >= 0 && pin < GPIO_COUNT) ? gpio_levels[pin] : 0;
+}
+
+/*
+ * The status LED
+ */
+
+static uint32_t led_color;
+
+static esp_err_t led_set_pixel(led_strip_t *strip, uint32_t index, uint32_t red, uint32_t green, uint32_t blue) {
+    led_color = (red << 16) | (green << 8) | blue;
+    return ESP_OK;
+}
+
+static esp_err_t led_refresh(led_strip_t *strip, uint32_t timeout_ms) {
+    return ESP_OK;
+}
+
+static esp_err_t led_clear(led_strip_t *strip, uint32_t timeout_ms) {
+    led_color = 0;
+    return ESP_OK;
+}
+
+static esp_err_t led_del(led_strip_t *strip) {
+    return ESP_OK;
+}
+
+led_strip_t *led_strip_init(uint8_t channel, uint8_t gpio, uint16_t led_num) {
+    static led_strip_t strip = { led_set_pixel, led_refresh, led_clear, led_del };
+    return &strip;
+}
+
+uint32_t twin_led_color() {
+    return led_color;
+}
+
+/*
+ * NVS:  one namespace's worth of strings, kept as key=value lines in the file "nvs".
+ * (Values can't contain newlines; the controller never stores any.)
+ */
+
+#define NVS_MAX_KEYS 64
+#define NVS_KEY_LEN 16
+
+static struct nvs_entry {
+    char key[NVS_KEY_LEN];
+    char *value;
+} nvs_entries[NVS_MAX_KEYS];
+static int nvs_count = 0;
+static int nvs_ready = 0;
+static pthread_mutex_t nvs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct nvs_entry *nvs_find(const char *key) {
+    for(int i = 0; i < nvs_count; i++) {
+        if (strcmp(nvs_entries[i].key, key) == 0) {
+            return &nvs_entries[i];
+        }
+    }
+    return NULL;
+}
+
+static esp_err_t nvs_put(const char *key, const char *value) {
+    struct nvs_entry *e = nvs_find(key);
+    if (e == NULL) {
+        if (nvs_count == NVS_MAX_KEYS) {
+            return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+        }
+        e = &nvs_entries[nvs_count++];
+        strncpy(e->key, key, NVS_KEY_LEN-1);
+    }
+    free(e->value);
+    e->value = strdup(value);
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_init(void) {
+    char path[256], line[1024];
+
+    pthread_mutex_lock(&nvs_lock);
+    state_path(path, sizeof(path), "nvs");
+    FILE *f = fopen(path, "r");
+    if (f) {
+        while (fgets(line, sizeof(line), f)) {
+            char *eq = strchr(line, '=');
+            if (eq) {
+                *eq = 0;
+                eq[strcspn(eq+1, "\n") + 1] = 0;
+                nvs_put(line, eq + 1);
+            }
+        }
+        fclose(f);
+    }
+    nvs_ready = 1;
+    pthread_mutex_unlock(&nvs_lock);
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase(void) {
+    char path[256];
+
+    pthread_mutex_lock(&nvs_lock);
+    for(int i = 0; i < nvs_count; i++) {
+        free(nvs_entries[i].value);
+    }
+    nvs_count = 0;
+    state_path(path, sizeof(path), "nvs");
+    remove(path);
+    pthread_mutex_unlock(&nvs_lock);
+    return ESP_OK;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t mode, nvs_handle_t *handle) {
+    if (!nvs_ready) {
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    }
+    *handle = 1;
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle) {
+}
+
+esp_err_t nvs_get_str(nvs_handle_t handle, const char *key, char *out, size_t *length) {
+    esp_err_t ret = ESP_OK;
+
+    pthread_mutex_lock(&nvs_lock);
+    struct nvs_entry *e = nvs_find(key);
+    if (e == NULL) {
+        ret = ESP_ERR_NVS_NOT_FOUND;
+    }
+    else if (out == NULL) {
+        *length = strlen(e->value) + 1;
+    }
+    else if (*length < strlen(e->value) + 1) {
+        ret = ESP_ERR_NVS_INVALID_LENGTH;
+    }
+    else {
+        strcpy(out, e->value);
+        *length = strlen(e->value) + 1;
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    return ret;
+}
+
+esp_err_t nvs_set_str(nvs_handle_t handle, const char *key, const char *value) {
+    if (strlen(key) >= NVS_KEY_LEN || strchr(value, '\n')) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&nvs_lock);
+    esp_err_t ret = nvs_put(key, value);
+    pthread_mutex_unlock(&nvs_lock);
+    return ret;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key) {
+    esp_err_t ret = ESP_ERR_NVS_NOT_FOUND;
+
+    pthread_mutex_lock(&nvs_lock);
+    struct nvs_entry *e = nvs_find(key);
+    if (e) {
+        free(e->value);
+        *e = nvs_entries[--nvs_count];
+        ret = ESP_OK;
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    return ret;
+}
+
+// Write everything out, via a temporary file so that a crash can't leave half of it.
+esp_err_t nvs_commit(nvs_handle_t handle) {
+    char path[256], temp[280];
+    esp_err_t ret = ESP_OK;
+
+    pthread_mutex_lock(&nvs_lock);
+    state_path(path, sizeof(path), "nvs");
+    snprintf(temp, sizeof(temp), "%s.new", path);
+    FILE *f = fopen(temp, "w");
+    if (f == NULL) {
+        ret = ESP_FAIL;
+    }
+    else {
+        for(int i = 0; i < nvs_count; i++) {
+            fprintf(f, "%s=%s\n", nvs_entries[i].key, nvs_entries[i].value);
+        }
+        if (fclose(f) != 0 || rename(temp, path) != 0) {
+            ret = ESP_FAIL;
+        }
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    return ret;
+}
+
+/*
+ * OTA.  The two app partitions are the files "ota_0" and "ota_1", and "otadata" says which
+ * one to boot and what state it is in.  As with the bootloader, an image that is still
+ * pending verification when we start again gets rolled back.
+ *
+ * Of course the twin always runs the code it was built from, whichever "partition" it boots;
+ * but the controller code sees the same sequence of states it would on the chip.
+ */
+
+#define OTA_PARTITION_SIZE (0x180000)
+
+static const esp_partition_t partitions[2] = {
+    { .type = ESP_PARTITION_TYPE_APP, .subtype = ESP_PARTITION_SUBTYPE_APP_OTA_0,
+      .address = 0x10000, .size = OTA_PARTITION_SIZE, .label = "ota_0" },
+    { .type = ESP_PARTITION_TYPE_APP, .subtype = ESP_PARTITION_SUBTYPE_APP_OTA_1,
+      .address = 0x10000 + OTA_PARTITION_SIZE, .size = OTA_PARTITION_SIZE, .label = "ota_1" },
+};
+
+static int boot_slot = 0;       // where we will boot next time
+static int running_slot = 0;
+static esp_ota_img_states_t running_state = ESP_OTA_IMG_UNDEFINED;
+static esp_ota_img_states_t boot_state = ESP_OTA_IMG_UNDEFINED;
+static FILE *ota_file = NULL;
+static int ota_slot = -1;
+static size_t ota_written = 0;
+
+static void save_otadata() {
+    char path[256];
+    state_path(path, sizeof(path), "otadata");
+    FILE *f = fopen(path, "w");
+    if (f) {
+        fprintf(f, "%d %d\n", boot_slot, (int)boot_state);
+        fclose(f);
+    }
+}
+
+// What the bootloader does:  decide which image to run
+void init_ota() {
+    char path[256];
+    int state = ESP_OTA_IMG_UNDEFINED;
+
+    state_path(path, sizeof(path), "otadata");
+    FILE *f = fopen(path, "r");
+    if (f) {
+        if (fscanf(f, "%d %d", &boot_slot, &state) != 2 || boot_slot < 0 || boot_slot > 1) {
+            boot_slot = 0;
+        }
+        fclose(f);
+    }
+    boot_state = state;
+    if (boot_state == ESP_OTA_IMG_NEW) {
+        boot_state = ESP_OTA_IMG_PENDING_VERIFY;
+    }
+    else if (boot_state == ESP_OTA_IMG_PENDING_VERIFY) {
+        ESP_LOGW(TAG, "Image in %s was never confirmed; rolling back", partitions[boot_slot].label);
+        boot_slot = 1 - boot_slot;
+        boot_state = ESP_OTA_IMG_VALID;
+    }
+    save_otadata();
+    running_slot = boot_slot;
+    running_state = boot_state;
+    ESP_LOGI(TAG, "Booting %s", partitions[running_slot].label);
+}
+
+const esp_partition_t *esp_ota_get_running_partition(void) {
+    return &partitions[running_slot];
+}
+
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start_from) {
+    return &partitions[1 - running_slot];
+}
+
+esp_err_t esp_ota_get_state_partition(const esp_partition_t *partition, esp_ota_img_states_t *state) {
+    if (partition != &partitions[running_slot] || running_state == ESP_OTA_IMG_UNDEFINED) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    *state = running_state;
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_begin(const esp_partition_t *partition, size_t image_size, esp_ota_handle_t *handle) {
+    char path[256];
+
+    if (partition == &partitions[running_slot]) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (ota_file) {
+        fclose(ota_file);
+    }
+    state_path(path, sizeof(path), partition->label);
+    ota_file = fopen(path, "w+b");
+    if (ota_file == NULL) {
+        return ESP_FAIL;
+    }
+    ota_slot = partition - partitions;
+    ota_written = 0;
+    *handle = 1;
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_write(esp_ota_handle_t handle, const void *data, size_t size) {
+    if (ota_file == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (ota_written + size > OTA_PARTITION_SIZE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (fwrite(data, 1, size, ota_file) != size) {
+        return ESP_FAIL;
+    }
+    ota_written += size;
+    return ESP_OK;
+}
+
+// Like the real one, we check that this at least looks like an app image.
+esp_err_t esp_ota_end(esp_ota_handle_t handle) {
+    unsigned char magic = 0;
+
+    if (ota_file == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    rewind(ota_file);
+    size_t got = fread(&magic, 1, 1, ota_file);
+    int ok = (fclose(ota_file) == 0);
+    ota_file = NULL;
+    if (!ok) {
+        return ESP_FAIL;
+    }
+    if (got != 1 || magic != 0xE9) {
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_abort(esp_ota_handle_t handle) {
+    if (ota_file) {
+        fclose(ota_file);
+        ota_file = NULL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition) {
+    boot_slot = partition - partitions;
+    boot_state = (boot_slot == running_slot ? ESP_OTA_IMG_VALID : ESP_OTA_IMG_NEW);
+    save_otadata();
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_mark_app_valid_cancel_rollback(void) {
+    running_state = ESP_OTA_IMG_VALID;
+    if (boot_slot == running_slot) {
+        boot_state = running_state;
+        save_otadata();
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_mark_app_invalid_rollback_and_reboot(void) {
+    if (running_state != ESP_OTA_IMG_PENDING_VERIFY) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    boot_slot = 1 - running_slot;
+    boot_state = ESP_OTA_IMG_VALID;
+    save_otadata();
+    esp_restart();
+}
+
+// Reading past what has been written gives erased flash, as it would on the chip.
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t offset, void *dst, size_t size) {
+    char path[256];
+
+    if (offset + size > partition->size) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(dst, 0xff, size);
+    state_path(path, sizeof(path), partition->label);
+    FILE *f = fopen(path, "rb");
+    if (f) {
+        if (fseek(f, offset, SEEK_SET) == 0) {
+            size_t got = fread(dst, 1, size, f);
+            (void)got;
+        }
+        fclose(f);
+    }
+    return ESP_OK;
+}
+
+// Images carry their own sha256 at the end (see ota_pack.py's image_id).  A partition
+// nothing has been written to yet gets the hash of nothing.
+esp_err_t esp_partition_get_sha256(const esp_partition_t *partition, uint8_t *sha_256) {
+    char path[256];
+
+    state_path(path, sizeof(path), partition->label);
+    FILE *f = fopen(path, "rb");
+    if (f == NULL || fseek(f, -32, SEEK_END) != 0 || fread(sha_256, 1, 32, f) != 32) {
+        mbedtls_sha256_context sha;
+        mbedtls_sha256_init(&sha);
+        mbedtls_sha256_starts_ret(&sha, 0);
+        mbedtls_sha256_finish_ret(&sha, sha_256);
+    }
+    if (f) {
+        fclose(f);
+    }
+    return ESP_OK;
+}
+
+/*
+ * The long-term log's data partition (see partitions.csv and longlog.c) is the file "longlog",
+ * mapped into memory as the chip maps flash.  As on flash, writing can only clear bits, and
+ * erasing sets a sector back to all ones.
+ */
+
+#define LONGLOG_PARTITION_SIZE (0x40000)
+
+static const esp_partition_t longlog_partition = {
+    .type = ESP_PARTITION_TYPE_DATA, .subtype = 0x99,
+    .address = 0x310000, .size = LONGLOG_PARTITION_SIZE, .label = "longlog"
+};
+static int longlog_fd = -1;
+static uint8_t *longlog_map = NULL;
+
+static int open_longlog() {
+    char path[256];
+    struct stat st;
+    uint8_t erased[SPI_FLASH_SEC_SIZE];
+
+    if (longlog_map) {
+        return 0;
+    }
+    state_path(path, sizeof(path), longlog_partition.label);
+    longlog_fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (longlog_fd < 0 || fstat(longlog_fd, &st) != 0) {
+        ESP_LOGE(TAG, "Unable to open %s (%s)", path, strerror(errno));
+        return -1;
+    }
+    // A new "partition" is erased flash
+    memset(erased, 0xff, sizeof(erased));
+    for(off_t at = st.st_size; at < LONGLOG_PARTITION_SIZE; at += sizeof(erased)) {
+        if (pwrite(longlog_fd, erased, sizeof(erased), at) != sizeof(erased)) {
+            return -1;
+        }
+    }
+    longlog_map = mmap(NULL, LONGLOG_PARTITION_SIZE, PROT_READ, MAP_SHARED, longlog_fd, 0);
+    if (longlog_map == MAP_FAILED) {
+        longlog_map = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label) {
+    if (type == ESP_PARTITION_TYPE_DATA && label && strcmp(label, longlog_partition.label) == 0) {
+        return &longlog_partition;
+    }
+    return NULL;
+}
+
+esp_err_t esp_partition_mmap(const esp_partition_t *partition, size_t offset, size_t size,
+                             spi_flash_mmap_memory_t memory, const void **out_ptr, spi_flash_mmap_handle_t *out_handle) {
+    if (partition != &longlog_partition || offset + size > partition->size || open_longlog() < 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    *out_ptr = longlog_map + offset;
+    *out_handle = 1;
+    return ESP_OK;
+}
+
+void spi_flash_munmap(spi_flash_mmap_handle_t handle) {
+    // The mapping stays until we exit
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t dst_offset, const void *src, size_t size) {
+    uint8_t buf[SPI_FLASH_SEC_SIZE];
+
+    if (partition != &longlog_partition || dst_offset + size > partition->size || open_longlog() < 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    while (size > 0) {
+        size_t n = size < sizeof(buf) ? size : sizeof(buf);
+        for(size_t i = 0; i < n; i++) {
+            buf[i] = longlog_map[dst_offset + i] & ((const uint8_t *)src)[i];
+        }
+        if (pwrite(longlog_fd, buf, n, dst_offset) != n) {
+            return ESP_FAIL;
+        }
+        src = (const uint8_t *)src + n;
+        dst_offset += n;
+        size -= n;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size) {
+    uint8_t erased[SPI_FLASH_SEC_SIZE];
+
+    if (partition != &longlog_partition || offset + size > partition->size ||
+        offset % SPI_FLASH_SEC_SIZE || size % SPI_FLASH_SEC_SIZE || open_longlog() < 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(erased, 0xff, sizeof(erased));
+    for( ; size > 0; offset += sizeof(erased), size -= sizeof(erased)) {
+        if (pwrite(longlog_fd, erased, sizeof(erased), offset) != sizeof(erased)) {
+            return ESP_FAIL;
+        }
+    }
+    return ESP_OK;
+}
+
+/*
+ * The default event loop:  events are queued, and handlers run in their own task,
+ * as they do on the chip.
+ */
+
+esp_event_base_t const WIFI_EVENT = "WIFI_EVENT";
+esp_event_base_t const IP_EVENT = "IP_EVENT";
+
+#define MAX_HANDLERS 16
+#define EVENT_DATA_LEN 64
+
+struct event {
+    esp_event_base_t base;
+    int32_t id;
+    char data[EVENT_DATA_LEN];
+};
+
+static struct {
+    esp_event_base_t base;
+    int32_t id;
+    esp_event_handler_t handler;
+    void *arg;
+} handlers[MAX_HANDLERS];
+static int handler_count = 0;
+static pthread_mutex_t handler_lock = PTHREAD_MUTEX_INITIALIZER;
+static QueueHandle_t events = NULL;
+
+static void event_task(void *arg) {
+    struct event e;
+    while (1) {
+        xQueueReceive(events, &e, portMAX_DELAY);
+        pthread_mutex_lock(&handler_lock);
+        int count = handler_count;
+        pthread_mutex_unlock(&handler_lock);
+        for(int i = 0; i < count; i++) {
+            if (handlers[i].base == e.base && (handlers[i].id == ESP_EVENT_ANY_ID || handlers[i].id == e.id)) {
+                handlers[i].handler(handlers[i].arg, e.base, e.id, e.data);
+            }
+        }
+    }
+}
+
+esp_err_t esp_event_loop_create_default(void) {
+    if (events) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    events = xQueueCreate(32, sizeof(struct event));
+    xTaskCreate(event_task, "sys_evt", 2304, NULL, 20, NULL);
+    return ESP_OK;
+}
+
+esp_err_t esp_event_handler_register(esp_event_base_t base, int32_t id, esp_event_handler_t handler, void *arg) {
+    esp_err_t ret = ESP_ERR_NO_MEM;
+
+    pthread_mutex_lock(&handler_lock);
+    if (handler_count < MAX_HANDLERS) {
+        handlers[handler_count].base = base;
+        handlers[handler_count].id = id;
+        handlers[handler_count].handler = handler;
+        handlers[handler_count].arg = arg;
+        handler_count++;
+        ret = ESP_OK;
+    }
+    pthread_mutex_unlock(&handler_lock);
+    return ret;
+}
+
+esp_err_t esp_event_post(esp_event_base_t base, int32_t id, const void *data, size_t size, TickType_t wait) {
+    struct event e = { .base = base, .id = id };
+
+    if (events == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (size > sizeof(e.data)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (data) {
+        memcpy(e.data, data, size);
+    }
+    return xQueueSend(events, &e, wait) == pdTRUE ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+/*
+ * WIFI.  The "network" is the loopback interface, and the access point always answers.
+ * twin_wifi_drop pretends we lost it, so reconnection can be exercised.
+ */
+
+static const uint8_t fake_bssid[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+#define FAKE_CHANNEL 6
+#define FAKE_RSSI -42
+
+static int wifi_started = 0;
+static volatile int wifi_link = 0;
+
+esp_err_t esp_netif_init(void) {
+    return ESP_OK;
+}
+
+esp_netif_t *esp_netif_create_default_wifi_sta(void) {
+    static int netif;
+    return (esp_netif_t *)&netif;
+}
+
+esp_err_t esp_wifi_init(const wifi_init_config_t *config) {
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_storage(wifi_storage_t storage) {
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_mode(wifi_mode_t mode) {
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_config(wifi_interface_t interface, wifi_config_t *config) {
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_start(void) {
+    wifi_started = 1;
+    return esp_event_post(WIFI_EVENT, WIFI_EVENT_STA_START, NULL, 0, portMAX_DELAY);
+}
+
+esp_err_t esp_wifi_connect(void) {
+    wifi_event_sta_connected_t connected = { .channel = FAKE_CHANNEL };
+    ip_event_got_ip_t got_ip = { 0 };
+
+    if (!wifi_started) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    memcpy(connected.ssid, CONFIG_EXAMPLE_WIFI_SSID, sizeof(CONFIG_EXAMPLE_WIFI_SSID) - 1);
+    connected.ssid_len = sizeof(CONFIG_EXAMPLE_WIFI_SSID) - 1;
+    memcpy(connected.bssid, fake_bssid, sizeof(fake_bssid));
+    esp_event_post(WIFI_EVENT, WIFI_EVENT_STA_CONNECTED, &connected, sizeof(connected), portMAX_DELAY);
+
+    got_ip.ip_info.ip.addr = htonl(INADDR_LOOPBACK);
+    got_ip.ip_info.netmask.addr = htonl(0xff000000);
+    wifi_link = 1;
+    return esp_event_post(IP_EVENT, IP_EVENT_STA_GOT_IP, &got_ip, sizeof(got_ip), portMAX_DELAY);
+}
+
+esp_err_t esp_wifi_disconnect(void) {
+    wifi_event_sta_disconnected_t disconnected = { .reason = WIFI_REASON_BEACON_TIMEOUT };
+
+    wifi_link = 0;
+    memcpy(disconnected.bssid, fake_bssid, sizeof(fake_bssid));
+    return esp_event_post(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, &disconnected, sizeof(disconnected), portMAX_DELAY);
+}
+
+esp_err_t esp_wifi_sta_get_ap_info(wifi_ap_record_t *ap) {
+    if (!wifi_link) {
+        return ESP_ERR_WIFI_NOT_CONNECT;
+    }
+    memset(ap, 0, sizeof(*ap));
+    memcpy(ap->bssid, fake_bssid, sizeof(fake_bssid));
+    strcpy((char *)ap->ssid, CONFIG_EXAMPLE_WIFI_SSID);
+    ap->primary = FAKE_CHANNEL;
+    ap->rssi = FAKE_RSSI;
+    return ESP_OK;
+}
+
+void twin_wifi_drop() {
+    if (wifi_link) {
+        ESP_LOGI(TAG, "Dropping the WIFI link");
+        esp_wifi_disconnect();
+    }
+}
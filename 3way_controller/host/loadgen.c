@@ -0,0 +1,408 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "libconfig.h"
+
+/*
+ * Load generator:  drive the heater's console and ambient temperature ports, and watch its
+ * broadcasts, to see how the listeners, the message queue and the broadcast loop hold up.
+ *
+ *     loadgen [-h address] [-t seconds] [-c console/s] [-a ambient/s] [-s steady|burst|ramp]
+ *             [-b burst size] [-m command] [-o results.json]
+ *
+ * Runs against the heater itself, or the digital twin (the default address, 127.0.0.1).
+ *
+ * Console requests carry request ids, so we can tell which ones were answered, and how long
+ * that took.  Every request the heater receives also shows up in its broadcasts (the console
+ * logs it), so counting those tells us how much the message queue lost.  Ambient readings get
+ * no answer; we just send them, which loads the listener and the control code.
+ *
+ * Traffic shapes:
+ *     steady:  evenly spaced
+ *     burst:   -b packets back to back, with the bursts spaced to give the same average rate
+ *     ramp:    from nothing up to the given rate over the run
+ *
+ * After the run we keep sending one request every PROBE_INTERVAL ms, to see how soon the heater
+ * answers promptly again ("recovery"), and we ask the heater (with "perf") how many messages
+ * its queue dropped.
+ */
+
+#define PROBE_INTERVAL 100          // ms
+#define PROBE_PROMPT 200            // ms; an answer within this counts as recovered
+#define PROBE_LIMIT 30000           // ms; give up on recovery after this long
+#define DRAIN_TIME (2 * BROADCAST_INTERVAL)     // ms to keep listening for stragglers
+#define ID_PREFIX "L"
+
+enum shape { shape_steady, shape_burst, shape_ramp };
+
+static struct {
+    const char *address;
+    double duration;        // s
+    double console_rate;    // per s
+    double ambient_rate;
+    enum shape shape;
+    int burst;
+    const char *command;
+    const char *output;
+} opt = { "127.0.0.1", 10, 20, 5, shape_steady, 10, "hello", NULL };
+
+struct stream {
+    const char *name;
+    double rate;
+    double next;            // when the next packet (or burst) is due, in s since start
+    long sent;
+    long send_errors;
+};
+
+// per console request
+struct request {
+    double sent;            // s since start
+    double latency;         // ms; negative until the reply is complete
+    int echoed;             // seen in the broadcasts
+};
+
+static struct request *requests;
+static long request_limit;
+static int console_sock, ambient_sock, broadcast_sock;
+static struct sockaddr_in console_addr, ambient_addr;
+static struct timespec start_time;
+
+// what the broadcasts showed
+static long broadcast_lines = 0;
+static long broadcast_bytes = 0;
+static long overflow_events = 0;
+static long foreign_replies = 0;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec - start_time.tv_sec) + (ts.tv_nsec - start_time.tv_nsec) / 1e9;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-h address] [-t seconds] [-c console/s] [-a ambient/s]\n"
+                    "          [-s steady|burst|ramp] [-b burst size] [-m command] [-o results.json]\n", name);
+    exit(2);
+}
+
+static int make_socket(int port) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    int on = 1;
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_ANY) };
+
+    if (sock < 0) {
+        perror("socket");
+        exit(1);
+    }
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Unable to bind port %d: %s\n", port, strerror(errno));
+        exit(1);
+    }
+    return sock;
+}
+
+static int send_request(long n, const char *command) {
+    char buf[MESSAGE_LEN];
+    int len = snprintf(buf, sizeof(buf), "#" ID_PREFIX "%ld %s", n, command);
+
+    requests[n].sent = now();
+    requests[n].latency = -1;
+    return sendto(console_sock, buf, len, 0, (struct sockaddr *)&console_addr, sizeof(console_addr));
+}
+
+static void send_ambient(struct stream *s) {
+    char buf[16];
+    // a plausible reading that changes a little each time
+    int len = snprintf(buf, sizeof(buf), "%.2f", 18.0 + (s->sent % 400) / 100.0);
+    if (sendto(ambient_sock, buf, len, 0, (struct sockaddr *)&ambient_addr, sizeof(ambient_addr)) < 0) {
+        s->send_errors++;
+    }
+}
+
+// Returns the request number a reply or broadcast line refers to, or -1
+static long request_number(const char *text) {
+    const char *p = strstr(text, "#" ID_PREFIX);
+    if (p == NULL) {
+        return -1;
+    }
+    long n = strtol(p + 1 + strlen(ID_PREFIX), NULL, 10);
+    return (n >= 0 && n < request_limit) ? n : -1;
+}
+
+static void receive_replies() {
+    char buf[MESSAGE_LEN + REQUEST_ID_LEN + 4];
+    int len;
+
+    while ((len = recv(console_sock, buf, sizeof(buf) - 1, MSG_DONTWAIT)) > 0) {
+        buf[len] = 0;
+        long n = request_number(buf);
+        if (n < 0 || strncmp(buf, "#" ID_PREFIX, 1 + strlen(ID_PREFIX)) != 0) {
+            foreign_replies++;
+            continue;
+        }
+        // The reply is complete when we get the final "ok" or "err" line
+        char *text = strchr(buf, ' ');
+        if (text && (strcmp(text + 1, "ok") == 0 || strcmp(text + 1, "err") == 0) && requests[n].latency < 0) {
+            requests[n].latency = (now() - requests[n].sent) * 1000;
+        }
+    }
+}
+
+static void receive_broadcasts() {
+    char buf[2048];
+    int len;
+
+    while ((len = recv(broadcast_sock, buf, sizeof(buf) - 1, MSG_DONTWAIT)) > 0) {
+        buf[len] = 0;
+        broadcast_lines++;
+        broadcast_bytes += len;
+        if (strstr(buf, "Message queue overflowed")) {
+            overflow_events++;
+        }
+        if (strstr(buf, "Received command")) {
+            long n = request_number(buf);
+            if (n >= 0) {
+                requests[n].echoed = 1;
+            }
+        }
+    }
+}
+
+// Wait for traffic until the given time
+static void pump(double until) {
+    struct pollfd fds[2] = { { .fd = console_sock, .events = POLLIN }, { .fd = broadcast_sock, .events = POLLIN } };
+    double wait;
+
+    while ((wait = until - now()) > 0) {
+        if (poll(fds, 2, (int)(wait * 1000) + 1) > 0) {
+            receive_replies();
+            receive_broadcasts();
+        }
+    }
+    receive_replies();
+    receive_broadcasts();
+}
+
+// Seconds until the next packet (or burst) of a stream is due, after this one
+static double interval(struct stream *s, double t) {
+    double rate = s->rate;
+    if (opt.shape == shape_ramp) {
+        rate *= t / opt.duration;
+        if (rate < s->rate / 100) {
+            rate = s->rate / 100;
+        }
+    }
+    return (opt.shape == shape_burst ? opt.burst : 1) / rate;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, long count, double p) {
+    if (count == 0) {
+        return 0;
+    }
+    long i = (long)(p / 100 * (count - 1) + 0.5);
+    return sorted[i];
+}
+
+// Ask the heater how many messages its queue has dropped (from the perf command), or -1
+static long dropped_messages(long n) {
+    char buf[MESSAGE_LEN + REQUEST_ID_LEN + 4];
+    long dropped = -1;
+    double give_up = now() + 3;
+
+    send_request(n, "perf");
+    while (now() < give_up && requests[n].latency < 0) {
+        struct pollfd fd = { .fd = console_sock, .events = POLLIN };
+        if (poll(&fd, 1, 100) <= 0) {
+            continue;
+        }
+        int len;
+        while ((len = recv(console_sock, buf, sizeof(buf) - 1, MSG_DONTWAIT)) > 0) {
+            buf[len] = 0;
+            const char *q = strstr(buf, "message queue");
+            int fill, size, d;
+            if (request_number(buf) == n && q && sscanf(q, "message queue %d/%d (%d dropped)", &fill, &size, &d) == 3) {
+                dropped = d;
+            }
+            if (request_number(buf) == n && strstr(buf, " ok")) {
+                requests[n].latency = 0;
+            }
+        }
+    }
+    return dropped;
+}
+
+int main(int argc, char **argv) {
+    int c;
+    static const char *shapes[] = { "steady", "burst", "ramp" };
+
+    while ((c = getopt(argc, argv, "h:t:c:a:s:b:m:o:")) != -1) {
+        switch (c) {
+            case 'h': opt.address = optarg; break;
+            case 't': opt.duration = atof(optarg); break;
+            case 'c': opt.console_rate = atof(optarg); break;
+            case 'a': opt.ambient_rate = atof(optarg); break;
+            case 'b': opt.burst = atoi(optarg); break;
+            case 'm': opt.command = optarg; break;
+            case 'o': opt.output = optarg; break;
+            case 's':
+                if (strcmp(optarg, "steady") == 0) opt.shape = shape_steady;
+                else if (strcmp(optarg, "burst") == 0) opt.shape = shape_burst;
+                else if (strcmp(optarg, "ramp") == 0) opt.shape = shape_ramp;
+                else usage(argv[0]);
+                break;
+            default: usage(argv[0]);
+        }
+    }
+    if (opt.duration <= 0 || opt.burst < 1 || opt.console_rate < 0 || opt.ambient_rate < 0 || optind != argc) {
+        usage(argv[0]);
+    }
+
+    console_addr = (struct sockaddr_in){ .sin_family = AF_INET, .sin_port = htons(CNTRL_PORT) };
+    ambient_addr = (struct sockaddr_in){ .sin_family = AF_INET, .sin_port = htons(TEMPERATURE_PORT) };
+    if (inet_pton(AF_INET, opt.address, &console_addr.sin_addr) != 1) {
+        fprintf(stderr, "Bad address %s\n", opt.address);
+        return 2;
+    }
+    ambient_addr.sin_addr = console_addr.sin_addr;
+    console_sock = make_socket(0);
+    ambient_sock = make_socket(0);
+    broadcast_sock = make_socket(BROADCAST_PORT);
+
+    // room for every request we might send, the probes, and the perf query
+    request_limit = (long)(opt.console_rate * opt.duration) + opt.burst + PROBE_LIMIT / PROBE_INTERVAL + 2;
+    requests = calloc(request_limit, sizeof(*requests));
+
+    struct stream console = { .name = "console", .rate = opt.console_rate };
+    struct stream ambient = { .name = "ambient", .rate = opt.ambient_rate };
+    struct stream *streams[] = { &console, &ambient };
+    long n = 0;
+
+    printf("%s load on %s for %.0f s:  %.1f console requests/s (\"%s\"), %.1f ambient readings/s",
+        shapes[opt.shape], opt.address, opt.duration, opt.console_rate, opt.command, opt.ambient_rate);
+    printf(opt.shape == shape_burst ? ", in bursts of %d\n" : "\n", opt.burst);
+
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    while (1) {
+        double next = opt.duration;
+        for(int i = 0; i < 2; i++) {
+            struct stream *s = streams[i];
+            if (s->rate > 0 && s->next < next) {
+                next = s->next;
+            }
+        }
+        pump(next);
+        if (next >= opt.duration) {
+            break;
+        }
+        for(int i = 0; i < 2; i++) {
+            struct stream *s = streams[i];
+            if (s->rate <= 0 || s->next > next) {
+                continue;
+            }
+            for(int b = 0; b < (opt.shape == shape_burst ? opt.burst : 1); b++) {
+                if (s == &console) {
+                    if (n < request_limit - PROBE_LIMIT / PROBE_INTERVAL - 2 && send_request(n++, opt.command) < 0) {
+                        s->send_errors++;
+                    }
+                }
+                else {
+                    send_ambient(s);
+                }
+                s->sent++;
+            }
+            s->next += interval(s, s->next);
+        }
+    }
+    double load_end = now();
+    long load_requests = n;
+
+    // Recovery:  how soon does the heater answer promptly again?
+    double recovered = -1;
+    while (now() - load_end < PROBE_LIMIT / 1000.0) {
+        long probe = n++;
+        send_request(probe, "hello");
+        pump(now() + PROBE_INTERVAL / 1000.0);
+        for(long p = load_requests; p <= probe; p++) {
+            if (requests[p].latency >= 0 && requests[p].latency <= PROBE_PROMPT) {
+                recovered = (requests[p].sent - load_end) * 1000;
+                break;
+            }
+        }
+        if (recovered >= 0) {
+            break;
+        }
+    }
+    pump(now() + DRAIN_TIME / 1000.0);
+    long dropped = dropped_messages(n++);
+
+    // Results
+    double *latencies = malloc((load_requests + 1) * sizeof(double));
+    long answered = 0, echoed = 0;
+    for(long i = 0; i < load_requests; i++) {
+        if (requests[i].latency >= 0) {
+            latencies[answered++] = requests[i].latency;
+        }
+        echoed += requests[i].echoed;
+    }
+    qsort(latencies, answered, sizeof(double), compare_doubles);
+    double reply_loss = load_requests ? 100.0 * (load_requests - answered) / load_requests : 0;
+    double echo_loss = load_requests ? 100.0 * (load_requests - echoed) / load_requests : 0;
+
+    printf("sent:       %ld console requests (%.1f/s), %ld ambient readings (%.1f/s)\n",
+        console.sent, console.sent / (load_end), ambient.sent, ambient.sent / (load_end));
+    printf("replies:    %ld complete, %.1f%% lost\n", answered, reply_loss);
+    printf("latency:    p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+        percentile(latencies, answered, 50), percentile(latencies, answered, 90),
+        percentile(latencies, answered, 99), percentile(latencies, answered, 100));
+    printf("broadcasts: %ld lines (%.1f/s, %ld bytes); %.1f%% of requests never showed up\n",
+        broadcast_lines, broadcast_lines / now(), broadcast_bytes, echo_loss);
+    printf("overflow:   %ld queue overflow event(s) seen", overflow_events);
+    if (dropped >= 0) {
+        printf("; heater has dropped %ld message(s) since boot", dropped);
+    }
+    printf("\n");
+    if (recovered >= 0) {
+        printf("recovery:   answering within %d ms again %.0f ms after the load stopped\n", PROBE_PROMPT, recovered);
+    }
+    else {
+        printf("recovery:   not answering within %d ms %d s after the load stopped\n", PROBE_PROMPT, PROBE_LIMIT / 1000);
+    }
+    if (console.send_errors || ambient.send_errors || foreign_replies) {
+        printf("(%ld send errors; %ld replies that weren't ours)\n", console.send_errors + ambient.send_errors, foreign_replies);
+    }
+
+    if (opt.output) {
+        FILE *f = fopen(opt.output, "w");
+        if (f == NULL) {
+            fprintf(stderr, "Unable to write %s: %s\n", opt.output, strerror(errno));
+            return 1;
+        }
+        fprintf(f, "{\n  \"address\": \"%s\", \"shape\": \"%s\", \"duration_s\": %.1f, \"burst\": %d,\n",
+            opt.address, shapes[opt.shape], load_end, opt.burst);
+        fprintf(f, "  \"console_sent\": %ld, \"ambient_sent\": %ld,\n", console.sent, ambient.sent);
+        fprintf(f, "  \"console_per_s\": %.2f, \"ambient_per_s\": %.2f,\n", console.sent / load_end, ambient.sent / load_end);
+        fprintf(f, "  \"replies\": %ld, \"reply_loss_pct\": %.2f, \"broadcast_loss_pct\": %.2f,\n",
+            answered, reply_loss, echo_loss);
+        fprintf(f, "  \"latency_ms\": { \"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"max\": %.2f },\n",
+            percentile(latencies, answered, 50), percentile(latencies, answered, 90),
+            percentile(latencies, answered, 99), percentile(latencies, answered, 100));
+        fprintf(f, "  \"broadcast_lines\": %ld, \"broadcast_bytes\": %ld, \"overflow_events\": %ld, \"dropped_messages\": %ld,\n",
+            broadcast_lines, broadcast_bytes, overflow_events, dropped);
+        fprintf(f, "  \"recovery_ms\": %.0f\n}\n", recovered);
+        fclose(f);
+    }
+    return 0;
+}
@@ -0,0 +1,360 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "mbedtls/sha256.h"
+#include "libconfig.h"
+#include "libdecls.h"
+
+/*
+ * Check the OTA image decoder (ota_image.c) against the ways a download can arrive:  every
+ * kind of image, fed to it in pieces of 1, 3, 7 and 1000 bytes and of random sizes, so that
+ * headers, patch operations and compressed blocks all get split at every possible place.
+ *
+ *     ota_test [-v] [OLD_IMAGE NEW_IMAGE [PACKED...]]
+ *
+ * -v shows everything the decoder logs, rather than just its errors.  The exit status is 1
+ * if any image didn't come out right.
+ *
+ * First come images made here, from a made-up source and target:  patches with lots of
+ * short operations, so that there are plenty of operation headers to split (the decoder
+ * doesn't care how good the patch is).  Then, if we are given them, the real thing:  with
+ * OLD_IMAGE running, each PACKED file (made from NEW_IMAGE by ota_pack.py, whole or as a
+ * patch against OLD_IMAGE) and NEW_IMAGE itself, unpacked, must come out as NEW_IMAGE.
+ * And the ones that must not work:  a stored image with a byte of its payload changed must
+ * fail the hash check, and a patch must be refused with -2 when something else is running.
+ * CMakeLists.txt runs it that way, on the images in testdata/.
+ *
+ * Flash is a pair of buffers:  the running image and the one being written.
+ */
+
+#define IMAGE_SIZE (64 * 1024)      // of the made-up images
+#define MAX_IMAGE (256 * 1024)
+
+// sync with ota_image.c
+#define OTA_DEFLATE 0x01
+#define OTA_DELTA   0x02
+
+struct __attribute__((packed)) ota_header {
+    char magic[4];
+    uint8_t version;
+    uint8_t flags;
+    uint16_t header_len;
+    uint32_t payload_len;
+    uint32_t image_len;
+    uint8_t image_sha256[32];
+};
+
+static unsigned char source[MAX_IMAGE];     // running
+static size_t source_len;
+static unsigned char target[MAX_IMAGE];     // what should come out
+static size_t target_len;
+static unsigned char written[MAX_IMAGE];
+static size_t written_len;
+
+static const esp_partition_t partitions[2] = {
+    { .type = ESP_PARTITION_TYPE_APP, .subtype = ESP_PARTITION_SUBTYPE_APP_OTA_0,
+      .address = 0x10000, .size = MAX_IMAGE, .label = "ota_0" },
+    { .type = ESP_PARTITION_TYPE_APP, .subtype = ESP_PARTITION_SUBTYPE_APP_OTA_1,
+      .address = 0x10000 + MAX_IMAGE, .size = MAX_IMAGE, .label = "ota_1" },
+};
+
+/*
+ * The parts of ESP-IDF and the controller that ota_image.c uses.
+ */
+
+// What it logs goes through ESP_LOGx as well, so host_log_level decides what we see.
+void send_logf(const char *tag, int severity, const char *fmt, ...) {}
+void send_messagef(int severity, const char *fmt, ...) {}
+
+const esp_partition_t *esp_ota_get_running_partition(void) {
+    return &partitions[0];
+}
+
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start_from) {
+    return &partitions[1];
+}
+
+esp_err_t esp_ota_begin(const esp_partition_t *partition, size_t image_size, esp_ota_handle_t *handle) {
+    written_len = 0;
+    *handle = 1;
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_write(esp_ota_handle_t handle, const void *data, size_t size) {
+    if (written_len + size > sizeof(written)) {
+        return ESP_FAIL;
+    }
+    memcpy(written + written_len, data, size);
+    written_len += size;
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_end(esp_ota_handle_t handle) { return ESP_OK; }
+esp_err_t esp_ota_abort(esp_ota_handle_t handle) { return ESP_OK; }
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition) { return ESP_OK; }
+esp_err_t esp_partition_get_sha256(const esp_partition_t *partition, uint8_t *sha_256) { return ESP_FAIL; }
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t offset, void *dst, size_t size) {
+    if (partition != &partitions[0] || offset + size > source_len) {
+        return ESP_FAIL;
+    }
+    memcpy(dst, source + offset, size);
+    return ESP_OK;
+}
+
+/*
+ * Making images
+ */
+
+static void sha256(const unsigned char *data, size_t len, unsigned char *out) {
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts_ret(&sha, 0);
+    mbedtls_sha256_update_ret(&sha, data, len);
+    mbedtls_sha256_finish_ret(&sha, out);
+    mbedtls_sha256_free(&sha);
+}
+
+static unsigned char *put_number(unsigned char *p, uint32_t n) {
+    memcpy(p, &n, 4);
+    return p + 4;
+}
+
+// Something that looks a bit like code:  runs of repeated words among random bytes.
+static void make_images() {
+    for(int i = 0; i < IMAGE_SIZE; i++) {
+        source[i] = (i & 0x100) ? rand() : (i * 7) & 0xff;
+    }
+    memcpy(target, source, IMAGE_SIZE);
+    for(int i = 0; i < IMAGE_SIZE; i += 1 + rand() % 64) {
+        target[i] += 1 + rand() % 255;
+    }
+    source_len = target_len = IMAGE_SIZE;
+}
+
+static size_t read_file(const char *path, unsigned char *buf, size_t room) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        exit(2);
+    }
+    size_t len = fread(buf, 1, room, f);
+    if (!feof(f) && fgetc(f) != EOF) {
+        fprintf(stderr, "%s is more than %zu bytes\n", path, room);
+        exit(2);
+    }
+    fclose(f);
+    return len;
+}
+
+/*
+ * Turn source into target with a patch of short operations, alternating "add" (from a
+ * random place in the source, so a mix of differences and copies) and "insert".
+ * Returns the length of the patch.
+ */
+static size_t make_delta(unsigned char *out) {
+    unsigned char *p = out;
+    uint32_t at = 0;
+
+    memcpy(p, "HCDL", 4);
+    p = put_number(p + 4, IMAGE_SIZE);
+    sha256(source, IMAGE_SIZE, p);
+    p += 32;
+    for(int op = 0; at < IMAGE_SIZE; op++) {
+        uint32_t n = 1 + rand() % 300;
+        if (n > IMAGE_SIZE - at) {
+            n = IMAGE_SIZE - at;
+        }
+        if (op % 2 == 0) {
+            uint32_t from = (rand() % 2 ? at : rand() % (IMAGE_SIZE - n + 1));
+            *p++ = 'A';
+            p = put_number(p, from);
+            p = put_number(p, n);
+            for(uint32_t i = 0; i < n; i++) {
+                *p++ = target[at + i] - source[from + i];
+            }
+        }
+        else {
+            *p++ = 'I';
+            p = put_number(p, n);
+            memcpy(p, target + at, n);
+            p += n;
+        }
+        at += n;
+    }
+    *p++ = 'E';
+    return p - out;
+}
+
+// Deflate in place, the way ota_pack.py does (raw stream, window no bigger than ours)
+static size_t deflate_payload(unsigned char *buf, size_t len, size_t room) {
+    static unsigned char in[2 * IMAGE_SIZE];
+    z_stream z = { .zalloc = Z_NULL };
+
+    memcpy(in, buf, len);
+    deflateInit2(&z, 9, Z_DEFLATED, -13, 8, Z_DEFAULT_STRATEGY);
+    z.next_in = in;
+    z.avail_in = len;
+    z.next_out = buf;
+    z.avail_out = room;
+    if (deflate(&z, Z_FINISH) != Z_STREAM_END) {
+        fprintf(stderr, "deflate failed\n");
+        exit(2);
+    }
+    len = z.total_out;
+    deflateEnd(&z);
+    return len;
+}
+
+// Returns the length of the packed image in out.
+static size_t pack(int flags, unsigned char *out, size_t room) {
+    struct ota_header h = { .magic = "HCOT", .version = 1, .flags = flags, .header_len = sizeof(h),
+                            .image_len = IMAGE_SIZE };
+    unsigned char *payload = out + sizeof(h);
+    size_t len;
+
+    if (flags & OTA_DELTA) {
+        len = make_delta(payload);
+    }
+    else {
+        memcpy(payload, target, IMAGE_SIZE);
+        len = IMAGE_SIZE;
+    }
+    if (flags & OTA_DEFLATE) {
+        len = deflate_payload(payload, len, room - sizeof(h));
+    }
+    h.payload_len = len;
+    sha256(target, IMAGE_SIZE, h.image_sha256);
+    memcpy(out, &h, sizeof(h));
+    return sizeof(h) + len;
+}
+
+/*
+ * Feeding them to the decoder
+ */
+
+/*
+ * Returns 0 if target came out, what ota_image_write returned if it failed, or -1 if
+ * ota_image_finish failed or the wrong thing came out.  Chunk size 0 means random sizes.
+ */
+static int try_image(const unsigned char *packed, size_t len, int chunk) {
+    if (ota_image_begin(NULL) < 0) {
+        return -1;
+    }
+    for(size_t at = 0; at < len; ) {
+        size_t n = chunk ? chunk : (rand() % 4 ? 1 + rand() % 16 : 1 + rand() % 2000);
+        if (n > len - at) {
+            n = len - at;
+        }
+        int err = ota_image_write(packed + at, n);
+        if (err < 0) {
+            ota_image_abort();
+            return err;
+        }
+        at += n;
+    }
+    if (ota_image_finish() < 0) {
+        return -1;
+    }
+    return (written_len == target_len && memcmp(written, target, target_len) == 0) ? 0 : -1;
+}
+
+// Feed it in every size of piece; returns the number of failures.
+static int try_chunks(const char *name, const unsigned char *packed, size_t len) {
+    static const int chunks[] = { 1, 3, 7, 1000, 0 };
+    int failures = 0;
+
+    for(size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+        int ok = (try_image(packed, len, chunks[c]) == 0);
+        if (chunks[c]) {
+            printf("%-28s %6zu bytes, %4d-byte pieces: %s\n", name, len, chunks[c], ok ? "ok" : "FAILED");
+        }
+        else {
+            printf("%-28s %6zu bytes, random pieces:   %s\n", name, len, ok ? "ok" : "FAILED");
+        }
+        failures += !ok;
+    }
+    return failures;
+}
+
+static const char *kind_name(int flags) {
+    static const char *names[] = { "stored", "compressed", "stored delta", "compressed delta" };
+    return names[flags & (OTA_DEFLATE | OTA_DELTA)];
+}
+
+/*
+ * The images ota_pack.py made, and the raw image.  Returns the number of failures.
+ */
+static int try_packed_files(const char *old_path, const char *new_path, char **paths, int count) {
+    static unsigned char packed[2 * MAX_IMAGE];
+    static unsigned char other[MAX_IMAGE];
+    char name[64];
+    int failures = 0;
+
+    source_len = read_file(old_path, source, sizeof(source));
+    target_len = read_file(new_path, target, sizeof(target));
+    failures += try_chunks("raw", target, target_len);
+
+    for(int i = 0; i < count; i++) {
+        size_t len = read_file(paths[i], packed, sizeof(packed));
+        struct ota_header h;
+        if (len < sizeof(h)) {
+            fprintf(stderr, "%s is too short to be a packed image\n", paths[i]);
+            exit(2);
+        }
+        memcpy(&h, packed, sizeof(h));
+        snprintf(name, sizeof(name), "ota_pack.py %s", kind_name(h.flags));
+        failures += try_chunks(name, packed, len);
+
+        if (h.flags == 0) {
+            // The decoder can't tell, until it checks the hash at the end.
+            packed[sizeof(h) + len / 3] ^= 0x10;
+            int ok = (try_image(packed, len, 1000) == -1 && written_len == target_len);
+            printf("%-28s %6zu bytes, one byte changed:  %s\n", name, len, ok ? "rejected" : "NOT REJECTED");
+            failures += !ok;
+        }
+        if (h.flags & OTA_DELTA) {
+            // Running something else:  the new image, as if it had already been installed
+            memcpy(other, source, source_len);
+            memcpy(source, target, target_len);
+            size_t other_len = source_len;
+            source_len = target_len;
+            int ok = (try_image(packed, len, 1000) == -2);
+            printf("%-28s %6zu bytes, wrong source:      %s\n", name, len, ok ? "rejected" : "NOT REJECTED");
+            failures += !ok;
+            memcpy(source, other, other_len);
+            source_len = other_len;
+        }
+    }
+    return failures;
+}
+
+int main(int argc, char **argv) {
+    static const int kinds[] = { 0, OTA_DEFLATE, OTA_DELTA, OTA_DELTA | OTA_DEFLATE };
+    static unsigned char packed[4 * IMAGE_SIZE];
+    int failures = 0;
+
+    host_log_level = 1;
+    if (argc > 1 && strcmp(argv[1], "-v") == 0) {
+        host_log_level = 3;
+        argc--, argv++;
+    }
+    if (argc == 2) {
+        fprintf(stderr, "usage: ota_test [-v] [OLD_IMAGE NEW_IMAGE [PACKED...]]\n");
+        return 2;
+    }
+    srand(1);
+    make_images();
+
+    for(size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+        size_t len = pack(kinds[k], packed, sizeof(packed));
+        failures += try_chunks(kind_name(kinds[k]), packed, len);
+    }
+    if (argc > 2) {
+        failures += try_packed_files(argv[1], argv[2], argv + 3, argc - 3);
+    }
+    return failures ? 1 : 0;
+}
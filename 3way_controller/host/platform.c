@@ -0,0 +1,598 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "esp_heap_caps.h"
+#include "esp_private/esp_clk.h"
+#include "driver/temp_sensor.h"
+
+/*
+ * The parts of FreeRTOS and ESP-IDF the controller code uses, implemented on Linux.
+ * Tasks are threads, and time is CLOCK_MONOTONIC.  This is not a simulation of the chip:
+ * it is just enough to run the controller's own code off-target, so it can be measured
+ * and exercised.
+ */
+
+int host_log_level = 3;
+
+static int64_t boot_ns;
+
+static int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// "Boot" is when the process started
+__attribute__((constructor)) static void record_boot_time() {
+    boot_ns = now_ns();
+}
+
+// Unless something (replay.c) is running its own clock
+static int64_t simulated_us = -1;
+
+void host_set_time(int64_t us) {
+    simulated_us = us;
+}
+
+int64_t esp_timer_get_time(void) {
+    if (simulated_us >= 0) {
+        return simulated_us;
+    }
+    return (now_ns() - boot_ns) / 1000;
+}
+
+// The RTC clock doesn't start over when we restart; nor does CLOCK_MONOTONIC
+uint64_t esp_clk_rtc_time(void) {
+    return now_ns() / 1000;
+}
+
+void host_log(int level, const char *tag, const char *fmt, ...) {
+    static const char levels[] = "?EWID";
+    va_list args;
+    char line[512];
+
+    va_start(args, fmt);
+    vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    fprintf(stderr, "%c (%lld) %s: %s\n", levels[level], (long long)(esp_timer_get_time() / 1000), tag, line);
+}
+
+const char *esp_err_to_name(esp_err_t err) {
+    static __thread char buf[16];
+    if (err == ESP_OK) {
+        return "ESP_OK";
+    }
+    snprintf(buf, sizeof(buf), "0x%x", err);
+    return buf;
+}
+
+// If set (the twin sets it), esp_restart starts the program over, as the chip would;
+// otherwise it exits with status 3.  Either way the shutdown handlers run first, the last
+// registered first, as on the chip.
+char **host_restart_argv = NULL;
+
+#define MAX_SHUTDOWN_HANDLERS 5
+static shutdown_handler_t shutdown_handlers[MAX_SHUTDOWN_HANDLERS];
+static int shutdown_handler_count = 0;
+
+esp_err_t esp_register_shutdown_handler(shutdown_handler_t handler) {
+    if (shutdown_handler_count == MAX_SHUTDOWN_HANDLERS) {
+        return ESP_ERR_NO_MEM;
+    }
+    shutdown_handlers[shutdown_handler_count++] = handler;
+    return ESP_OK;
+}
+
+void esp_restart(void) {
+    for(int i = shutdown_handler_count - 1; i >= 0; i--) {
+        shutdown_handlers[i]();
+    }
+    if (host_restart_argv) {
+        ESP_LOGI("host", "Restarting");
+        fflush(NULL);
+        // Don't leave our sockets bound for the new image to trip over
+        for(int fd = 3; fd < 1024; fd++) {
+            close(fd);
+        }
+        execv("/proc/self/exe", host_restart_argv);
+        ESP_LOGE("host", "Unable to restart (%s)", strerror(errno));
+    }
+    ESP_LOGI("host", "Restart requested; exiting");
+    exit(3);
+}
+
+/*
+ * Waiting.  Condition variables use CLOCK_MONOTONIC, like everything else here.
+ */
+
+static void init_cond(pthread_cond_t *cond) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static struct timespec deadline_after(TickType_t ticks) {
+    int64_t ns = now_ns() + (int64_t)ticks * (1000000000LL / configTICK_RATE_HZ);
+    struct timespec ts = { .tv_sec = ns / 1000000000LL, .tv_nsec = ns % 1000000000LL };
+    return ts;
+}
+
+// Wait on cond (with lock held) until *deadline; portMAX_DELAY waits forever.
+// Returns 0 if we timed out.
+static int wait_until(pthread_cond_t *cond, pthread_mutex_t *lock, TickType_t wait, const struct timespec *deadline) {
+    if (wait == portMAX_DELAY) {
+        pthread_cond_wait(cond, lock);
+        return 1;
+    }
+    return pthread_cond_timedwait(cond, lock, deadline) == 0;
+}
+
+// We don't have a meaningful heap limit on Linux; report something plausible and constant.
+uint32_t esp_get_free_heap_size(void) {
+    return 200 * 1024;
+}
+
+uint32_t esp_get_minimum_free_heap_size(void) {
+    return 200 * 1024;
+}
+
+size_t heap_caps_get_free_size(uint32_t caps) {
+    return esp_get_free_heap_size();
+}
+
+size_t heap_caps_get_minimum_free_size(uint32_t caps) {
+    return esp_get_minimum_free_heap_size();
+}
+
+size_t heap_caps_get_largest_free_block(uint32_t caps) {
+    return 64 * 1024;
+}
+
+/*
+ * Tasks
+ */
+
+struct host_task {
+    pthread_t thread;
+    char name[configMAX_TASK_NAME_LEN];
+    TaskFunction_t fn;
+    void *arg;
+    uint32_t stack;
+    // notifications
+    pthread_mutex_t lock;
+    pthread_cond_t notified;
+    uint32_t notify_count;
+};
+
+static __thread struct host_task *current_task = NULL;
+static struct host_task main_task = { .name = "main", .lock = PTHREAD_MUTEX_INITIALIZER };
+
+__attribute__((constructor)) static void init_main_task() {
+    init_cond(&main_task.notified);
+}
+
+static void *task_trampoline(void *p) {
+    struct host_task *task = p;
+    current_task = task;
+    task->fn(task->arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg,
+                       UBaseType_t priority, TaskHandle_t *handle) {
+    struct host_task *task = calloc(1, sizeof(*task));
+    strncpy(task->name, name, sizeof(task->name)-1);
+    task->fn = fn;
+    task->arg = arg;
+    task->stack = stack;
+    pthread_mutex_init(&task->lock, NULL);
+    init_cond(&task->notified);
+    if (handle) {
+        *handle = task;
+    }
+    // Linux threads need more stack than the chip does (printf alone uses more than 4K),
+    // so we don't use the requested size.
+    if (pthread_create(&task->thread, NULL, task_trampoline, task) != 0) {
+        free(task);
+        return pdFAIL;
+    }
+    pthread_detach(task->thread);
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task) {
+    if (task == NULL || task == current_task) {
+        pthread_exit(NULL);
+    }
+    pthread_cancel(task->thread);
+}
+
+void vTaskDelay(TickType_t ticks) {
+    struct timespec ts = { .tv_sec = ticks / configTICK_RATE_HZ,
+                           .tv_nsec = (ticks % configTICK_RATE_HZ) * (1000000000L / configTICK_RATE_HZ) };
+    nanosleep(&ts, NULL);
+}
+
+void vTaskDelayUntil(TickType_t *previous, TickType_t increment) {
+    TickType_t wake = *previous + increment;
+    TickType_t now = xTaskGetTickCount();
+    // (signed difference, so this is right across wraparound)
+    if ((int32_t)(wake - now) > 0) {
+        vTaskDelay(wake - now);
+    }
+    *previous = wake;
+}
+
+TickType_t xTaskGetTickCount(void) {
+    return esp_timer_get_time() / (1000 * portTICK_PERIOD_MS);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+    return current_task ? current_task : &main_task;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) {
+    // Not measured on the host
+    return task ? task->stack : 0;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+    pthread_mutex_lock(&task->lock);
+    task->notify_count++;
+    pthread_cond_signal(&task->notified);
+    pthread_mutex_unlock(&task->lock);
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait) {
+    struct host_task *task = xTaskGetCurrentTaskHandle();
+    struct timespec deadline = deadline_after(wait);
+    uint32_t count;
+
+    pthread_mutex_lock(&task->lock);
+    while (task->notify_count == 0 && wait && wait_until(&task->notified, &task->lock, wait, &deadline)) {
+    }
+    count = task->notify_count;
+    if (count) {
+        task->notify_count = clear ? 0 : count - 1;
+    }
+    pthread_mutex_unlock(&task->lock);
+    return count;
+}
+
+/*
+ * Queues:  a ring of fixed size items
+ */
+
+struct host_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    UBaseType_t length, item_size;
+    UBaseType_t head, count;
+    char *items;
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+    struct host_queue *q = calloc(1, sizeof(*q));
+    q->items = malloc(length * item_size);
+    q->length = length;
+    q->item_size = item_size;
+    pthread_mutex_init(&q->lock, NULL);
+    init_cond(&q->changed);
+    return q;
+}
+
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t wait) {
+    struct timespec deadline = deadline_after(wait);
+    BaseType_t ret = errQUEUE_FULL;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->length && wait && wait_until(&q->changed, &q->lock, wait, &deadline)) {
+    }
+    if (q->count < q->length) {
+        memcpy(q->items + ((q->head + q->count) % q->length) * q->item_size, item, q->item_size);
+        q->count++;
+        pthread_cond_broadcast(&q->changed);
+        ret = pdPASS;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ret;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t wait) {
+    struct timespec deadline = deadline_after(wait);
+    BaseType_t ret = pdFALSE;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && wait && wait_until(&q->changed, &q->lock, wait, &deadline)) {
+    }
+    if (q->count > 0) {
+        memcpy(item, q->items + q->head * q->item_size, q->item_size);
+        q->head = (q->head + 1) % q->length;
+        q->count--;
+        pthread_cond_broadcast(&q->changed);
+        ret = pdTRUE;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ret;
+}
+
+BaseType_t xQueueReset(QueueHandle_t q) {
+    pthread_mutex_lock(&q->lock);
+    q->head = q->count = 0;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+    return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q) {
+    pthread_mutex_lock(&q->lock);
+    UBaseType_t count = q->count;
+    pthread_mutex_unlock(&q->lock);
+    return count;
+}
+
+void vQueueDelete(QueueHandle_t q) {
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->changed);
+    free(q->items);
+    free(q);
+}
+
+/*
+ * Semaphores.  A mutex is a counting semaphore of one that starts out given; unlike FreeRTOS
+ * there is no priority inheritance (Linux threads don't have our priorities anyway).
+ */
+
+struct host_semaphore {
+    pthread_mutex_t lock;
+    pthread_cond_t given;
+    UBaseType_t count, max;
+};
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t initial) {
+    struct host_semaphore *sem = calloc(1, sizeof(*sem));
+    pthread_mutex_init(&sem->lock, NULL);
+    init_cond(&sem->given);
+    sem->count = initial;
+    sem->max = max;
+    return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    return xSemaphoreCreateCounting(1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void) {
+    return xSemaphoreCreateCounting(1, 0);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t wait) {
+    struct timespec deadline = deadline_after(wait);
+    BaseType_t ret = pdFALSE;
+
+    pthread_mutex_lock(&sem->lock);
+    while (sem->count == 0 && wait && wait_until(&sem->given, &sem->lock, wait, &deadline)) {
+    }
+    if (sem->count > 0) {
+        sem->count--;
+        ret = pdTRUE;
+    }
+    pthread_mutex_unlock(&sem->lock);
+    return ret;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem) {
+    BaseType_t ret = pdFALSE;
+
+    pthread_mutex_lock(&sem->lock);
+    if (sem->count < sem->max) {
+        sem->count++;
+        pthread_cond_signal(&sem->given);
+        ret = pdTRUE;
+    }
+    pthread_mutex_unlock(&sem->lock);
+    return ret;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem) {
+    pthread_mutex_destroy(&sem->lock);
+    pthread_cond_destroy(&sem->given);
+    free(sem);
+}
+
+/*
+ * Event groups
+ */
+
+struct host_event_group {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    EventBits_t bits;
+};
+
+EventGroupHandle_t xEventGroupCreate(void) {
+    struct host_event_group *group = calloc(1, sizeof(*group));
+    pthread_mutex_init(&group->lock, NULL);
+    init_cond(&group->changed);
+    return group;
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits) {
+    pthread_mutex_lock(&group->lock);
+    group->bits |= bits;
+    EventBits_t now = group->bits;
+    pthread_cond_broadcast(&group->changed);
+    pthread_mutex_unlock(&group->lock);
+    return now;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits) {
+    pthread_mutex_lock(&group->lock);
+    EventBits_t before = group->bits;
+    group->bits &= ~bits;
+    pthread_mutex_unlock(&group->lock);
+    return before;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group) {
+    pthread_mutex_lock(&group->lock);
+    EventBits_t now = group->bits;
+    pthread_mutex_unlock(&group->lock);
+    return now;
+}
+
+static int bits_satisfied(EventBits_t have, EventBits_t want, BaseType_t all) {
+    return all ? (have & want) == want : (have & want) != 0;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear,
+                                BaseType_t all, TickType_t wait) {
+    struct timespec deadline = deadline_after(wait);
+
+    pthread_mutex_lock(&group->lock);
+    while (!bits_satisfied(group->bits, bits, all) && wait &&
+           wait_until(&group->changed, &group->lock, wait, &deadline)) {
+    }
+    EventBits_t now = group->bits;
+    if (clear && bits_satisfied(now, bits, all)) {
+        group->bits &= ~bits;
+    }
+    pthread_mutex_unlock(&group->lock);
+    return now;
+}
+
+void vEventGroupDelete(EventGroupHandle_t group) {
+    pthread_mutex_destroy(&group->lock);
+    pthread_cond_destroy(&group->changed);
+    free(group);
+}
+
+/*
+ * esp_timer.  Each timer gets a thread, which sleeps until the timer is due.  On the chip
+ * all callbacks run in one task; here they may overlap, which the code must cope with anyway.
+ */
+
+struct esp_timer {
+    esp_timer_cb_t callback;
+    void *arg;
+    char name[configMAX_TASK_NAME_LEN];
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int armed;
+    int64_t due_ns;
+    int64_t period_ns;      // 0 for a one shot
+};
+
+static void *timer_thread(void *p) {
+    struct esp_timer *timer = p;
+
+    pthread_mutex_lock(&timer->lock);
+    while (1) {
+        if (!timer->armed) {
+            pthread_cond_wait(&timer->changed, &timer->lock);
+            continue;
+        }
+        struct timespec due = { .tv_sec = timer->due_ns / 1000000000LL, .tv_nsec = timer->due_ns % 1000000000LL };
+        if (pthread_cond_timedwait(&timer->changed, &timer->lock, &due) == 0 || now_ns() < timer->due_ns) {
+            continue;   // re-armed, stopped, or woken early
+        }
+        if (timer->period_ns) {
+            timer->due_ns += timer->period_ns;
+        }
+        else {
+            timer->armed = 0;
+        }
+        pthread_mutex_unlock(&timer->lock);
+        timer->callback(timer->arg);
+        pthread_mutex_lock(&timer->lock);
+    }
+    return NULL;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *handle) {
+    struct esp_timer *timer = calloc(1, sizeof(*timer));
+    timer->callback = args->callback;
+    timer->arg = args->arg;
+    strncpy(timer->name, args->name ? args->name : "timer", sizeof(timer->name)-1);
+    pthread_mutex_init(&timer->lock, NULL);
+    init_cond(&timer->changed);
+    if (pthread_create(&timer->thread, NULL, timer_thread, timer) != 0) {
+        free(timer);
+        return ESP_ERR_NO_MEM;
+    }
+    pthread_detach(timer->thread);
+    *handle = timer;
+    return ESP_OK;
+}
+
+static esp_err_t arm_timer(esp_timer_handle_t timer, uint64_t us, int periodic) {
+    pthread_mutex_lock(&timer->lock);
+    if (timer->armed) {
+        pthread_mutex_unlock(&timer->lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->armed = 1;
+    timer->due_ns = now_ns() + us * 1000;
+    timer->period_ns = periodic ? us * 1000 : 0;
+    pthread_cond_signal(&timer->changed);
+    pthread_mutex_unlock(&timer->lock);
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us) {
+    return arm_timer(timer, timeout_us, 0);
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us) {
+    return arm_timer(timer, period_us, 1);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+    pthread_mutex_lock(&timer->lock);
+    int was_armed = timer->armed;
+    timer->armed = 0;
+    pthread_cond_signal(&timer->changed);
+    pthread_mutex_unlock(&timer->lock);
+    return was_armed ? ESP_OK : ESP_ERR_INVALID_STATE;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer) {
+    // The thread may be about to look at it, so we just leave it stopped.
+    esp_timer_stop(timer);
+    return ESP_OK;
+}
+
+/*
+ * The chip's temperature sensor.  HOST_HEATER_TEMP in the environment sets what it reads.
+ */
+
+esp_err_t temp_sensor_set_config(temp_sensor_config_t config) {
+    return ESP_OK;
+}
+
+esp_err_t temp_sensor_start(void) {
+    return ESP_OK;
+}
+
+esp_err_t temp_sensor_read_celsius(float *celsius) {
+    const char *t = getenv("HOST_HEATER_TEMP");
+    *celsius = t ? atof(t) : 45.0;
+    return ESP_OK;
+}
@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "libconfig.h"
+#include "libdecls.h"
+
+/*
+ * Trace replayer:  take a trace fetched from the heater (console.py "trace <file>"), and run
+ * it back through the same code the heater runs, to see whether it does the same things.
+ *
+ * The input side is re-run as well as the decision:  every ambient temperature datagram in
+ * the trace goes through receive_ambient_temperature (temperatures.c), at the time it arrived
+ * by a simulated clock that follows the trace's timestamps, and each heater sensor reading
+ * is remembered.  At each recorded decision, the actual temperature is what
+ * current_ambient_temperature makes of all that, and the heater temperature is the last
+ * reading.  The desired and maximum temperatures and the override come from the record;
+ * the trace doesn't have the schedule or the console commands that set them.  Then we
+ * decide (power_decision.c), starting from the level we decided last time, and check the
+ * relays were driven to match.
+ *
+ * Anything that comes out differently is reported:  an input (the parsing or averaging has
+ * changed), a decision (the control logic has changed) or an output.  Or the heater wasn't
+ * running the code we think it was.
+ *
+ * A trace usually starts partway through, so at first we don't know everything the heater
+ * did:  until the ambient average is made entirely of readings we have replayed (and after
+ * each boot, when the heater restored its last average instead), and until we have seen a
+ * heater reading, the recorded input stands in for ours and isn't checked.
+ *
+ *     replay [-v] trace-file
+ *
+ * -v also lists every event in the trace.  The exit status is 1 if anything differed.
+ *
+ * The file is just the trace records, in order (see trace.c and struct trace_record).
+ */
+
+int receive_ambient_temperature(void *buf, int len, int sock, void *source);   // temperatures.c
+void reset_ambient_history();                                                 // temperatures.c
+
+// sync with HISTORY_LEN in temperatures.c
+#define AMBIENT_AVERAGED 15
+
+// When the heater's clock was set (TRACE_TIME), we can show its local time.
+static int64_t wall_clock_offset = -1;     // unix time minus ms since boot, in ms
+
+static const char *level_names[] = { "off", "low", "medium", "high", "auto" };
+
+static const char *level_name(int level) {
+    return level >= 0 && level <= power_na ? level_names[level] : "?";
+}
+
+static void print_time(uint32_t ms) {
+    if (wall_clock_offset >= 0) {
+        time_t t = (wall_clock_offset + ms) / 1000;
+        struct tm tm;
+        localtime_r(&t, &tm);
+        printf("%02d:%02d:%02d.%03d  ", tm.tm_hour, tm.tm_min, tm.tm_sec, (int)(ms % 1000));
+    }
+    else {
+        printf("%10.3f  ", ms / 1000.0);
+    }
+}
+
+static void print_event(const struct trace_record *r) {
+    struct in_addr addr;
+
+    print_time(r->ms);
+    switch (r->type) {
+        case TRACE_BOOT:
+            printf("boot\n");
+            break;
+        case TRACE_DATAGRAM:
+        case TRACE_DROPPED:
+            addr.s_addr = r->datagram.addr;
+            printf("%s port %d from %s, %d bytes: |%.*s%s|\n", r->type == TRACE_DROPPED ? "dropped" : "datagram",
+                   r->arg, inet_ntoa(addr), r->len, r->len < TRACE_TEXT_LEN ? r->len : TRACE_TEXT_LEN,
+                   r->datagram.text, r->len > TRACE_TEXT_LEN ? "..." : "");
+            break;
+        case TRACE_SENSOR:
+            printf("heater sensor %.2f\n", r->value / 100.0);
+            break;
+        case TRACE_TIME:
+            printf("clock set to %d\n", r->value);
+            break;
+        case TRACE_DECISION:
+            printf("decision: desired %.2f, actual %.2f, heater %.2f, max %d, override %s, was %s: %s\n",
+                   r->decision.desired / 100.0, r->decision.actual / 100.0,
+                   r->decision.heater / 100.0, r->decision.max / 100,
+                   level_name(r->decision.override), level_name(r->decision.previous), level_name(r->arg));
+            break;
+        case TRACE_OUTPUT:
+            printf("relays: low %d, high %d\n", r->value & 1, (r->value >> 1) & 1);
+            break;
+        default:
+            printf("unknown event type %d\n", r->type);
+    }
+}
+
+/*
+ * The parts of the controller temperatures.c uses, besides the sensor (see platform.c).
+ */
+
+void send_logf(const char *tag, int severity, const char *fmt, ...) {}
+void send_messagef(int severity, const char *fmt, ...) {}
+int get_psv(const char *key, char *buf, int len) { return -1; }
+void set_psv(const char *key, const char *newval) {}
+void report_health(int bit) {}
+uint32_t meter_start() { return 0; }
+void meter_stop(enum cycle_meter meter, uint32_t start) {}
+void listener_task(const char *taskname, int port, int priority, int rate, int burst,
+                   int callback(void *, int, int, void *)) {}
+
+/*
+ * Replaying
+ */
+
+static int events = 0, decisions = 0, differences = 0;
+static int verbose = 0;
+
+// Report something that came out differently, with the record it is about.
+static void differs(const struct trace_record *r, const char *what, const char *recorded, const char *replayed) {
+    differences++;
+    if (!verbose) {
+        print_event(r);
+    }
+    print_time(r->ms);
+    printf("** %s was %s, replayed as %s\n", what, recorded, replayed);
+}
+
+static void replay(FILE *f) {
+    struct trace_record r;
+    int ambient_readings = 0;           // replayed since the trace (or the heater) started
+    centideg_t heater = NO_TEMP_VALUE;  // last sensor reading, if we have seen one
+    int level = -1;                     // as we decided it; -1 until the first decision
+    char text[TRACE_TEXT_LEN + 1], b1[CENTIDEG_LEN], b2[CENTIDEG_LEN];
+
+    reset_ambient_history();
+    while (fread(&r, sizeof(r), 1, f) == 1) {
+        events++;
+        host_set_time(r.ms * 1000LL);
+        if (verbose) {
+            print_event(&r);
+        }
+        switch (r.type) {
+            case TRACE_BOOT:
+                // The heater restored what it knew (see warm_restart.c), which we don't have.
+                reset_ambient_history();
+                ambient_readings = 0;
+                heater = NO_TEMP_VALUE;
+                level = -1;
+                break;
+
+            case TRACE_DATAGRAM:
+                if (r.arg != TEMPERATURE_PORT) {
+                    break;
+                }
+                if (r.len > TRACE_TEXT_LEN) {
+                    // Only the start of it was recorded; we can't tell what the heater made of it.
+                    ambient_readings = 0;
+                    break;
+                }
+                memcpy(text, r.datagram.text, r.len);
+                receive_ambient_temperature(text, r.len, -1, NULL);
+                ambient_readings++;
+                break;
+
+            case TRACE_SENSOR:
+                heater = r.value;
+                break;
+
+            case TRACE_TIME:
+                wall_clock_offset = r.value * 1000LL - r.ms;
+                break;
+
+            case TRACE_DECISION: {
+                struct control_inputs in = { r.decision.desired, r.decision.actual, r.decision.heater,
+                                             r.decision.max, r.decision.override };
+                if (ambient_readings >= AMBIENT_AVERAGED) {
+                    in.actual = current_ambient_temperature();
+                    if (in.actual != r.decision.actual) {
+                        differs(&r, "actual temperature", centideg_string(r.decision.actual, b1),
+                                centideg_string(in.actual, b2));
+                    }
+                }
+                if (heater != NO_TEMP_VALUE) {
+                    in.heater = heater;
+                    if (in.heater != r.decision.heater) {
+                        differs(&r, "heater temperature", centideg_string(r.decision.heater, b1),
+                                centideg_string(in.heater, b2));
+                    }
+                }
+                enum power_level previous = (level >= 0 ? level : r.decision.previous);
+                const char *reason;
+                level = decide_power_level(&in, previous, &reason);
+                decisions++;
+                if (level != r.arg) {
+                    differs(&r, "decision", level_name(r.arg), level_name(level));
+                    printf("            (%s)\n", reason);
+                }
+                break;
+            }
+
+            case TRACE_OUTPUT:
+                // The relay pins follow the level (see power_controller.c)
+                if (level >= 0 && r.value != (level & 3)) {
+                    differs(&r, "output", level_name(r.value), level_name(level));
+                }
+                break;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    int c;
+    while ((c = getopt(argc, argv, "v")) != -1) {
+        if (c == 'v') {
+            verbose = 1;
+        }
+        else {
+            fprintf(stderr, "usage: replay [-v] trace-file\n");
+            return 2;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: replay [-v] trace-file\n");
+        return 2;
+    }
+    FILE *f = fopen(argv[optind], "rb");
+    if (f == NULL) {
+        perror(argv[optind]);
+        return 2;
+    }
+    // What temperatures.c logs is for the heater; here it would just get in the way.
+    host_log_level = 0;
+    replay(f);
+    fclose(f);
+
+    printf("%d events, %d decisions, %d differences\n", events, decisions, differences);
+    return differences ? 1 : 0;
+}
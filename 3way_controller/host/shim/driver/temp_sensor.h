@@ -0,0 +1,9 @@
+#pragma once
+#include "esp_err.h"
+
+typedef struct { int dac_offset; int clk_div; } temp_sensor_config_t;
+#define TSENS_CONFIG_DEFAULT() { 0, 6 }
+
+esp_err_t temp_sensor_set_config(temp_sensor_config_t config);
+esp_err_t temp_sensor_start(void);
+esp_err_t temp_sensor_read_celsius(float *celsius);
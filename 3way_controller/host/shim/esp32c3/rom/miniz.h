@@ -0,0 +1,28 @@
+#pragma once
+// The ROM's tinfl inflater, done with zlib on the host; see host/compat.c
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+    TINFL_STATUS_FAILED_CANNOT_MAKE_PROGRESS = -4,
+    TINFL_STATUS_BAD_PARAM = -3,
+    TINFL_STATUS_ADLER32_MISMATCH = -2,
+    TINFL_STATUS_FAILED = -1,
+    TINFL_STATUS_DONE = 0,
+    TINFL_STATUS_NEEDS_MORE_INPUT = 1,
+    TINFL_STATUS_HAS_MORE_OUTPUT = 2,
+} tinfl_status;
+
+#define TINFL_FLAG_PARSE_ZLIB_HEADER 1
+#define TINFL_FLAG_HAS_MORE_INPUT 2
+#define TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF 4
+
+typedef struct {
+    uint32_t m_state;
+    void *stream;               // zlib's state, kept across tinfl_init
+} tinfl_decompressor;
+
+#define tinfl_init(r) do { (r)->m_state = 0; } while(0)
+
+tinfl_status tinfl_decompress(tinfl_decompressor *r, const uint8_t *in_buf, size_t *in_size,
+                              uint8_t *out_start, uint8_t *out_next, size_t *out_size, uint32_t flags);
@@ -0,0 +1,4 @@
+#pragma once
+
+// The twin keeps this section across restarts, as the chip keeps RTC memory (see devices.c)
+#define RTC_NOINIT_ATTR __attribute__((section("rtc_noinit")))
@@ -0,0 +1,13 @@
+#pragma once
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"
+
+// 0 = nothing, 1 = errors, 2 = warnings, 3 = info, 4 = debug.  See host/platform.c.
+extern int host_log_level;
+void host_log(int level, const char *tag, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+#define ESP_LOGE(tag, ...) do { if (host_log_level >= 1) host_log(1, tag, __VA_ARGS__); } while(0)
+#define ESP_LOGW(tag, ...) do { if (host_log_level >= 2) host_log(2, tag, __VA_ARGS__); } while(0)
+#define ESP_LOGI(tag, ...) do { if (host_log_level >= 3) host_log(3, tag, __VA_ARGS__); } while(0)
+#define ESP_LOGD(tag, ...) do { if (host_log_level >= 4) host_log(4, tag, __VA_ARGS__); } while(0)
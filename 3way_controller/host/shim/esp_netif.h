@@ -0,0 +1,30 @@
+#pragma once
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_event.h"
+
+typedef struct { uint32_t addr; } esp_ip4_addr_t;     // network byte order, as in lwIP
+
+typedef struct {
+    esp_ip4_addr_t ip;
+    esp_ip4_addr_t netmask;
+    esp_ip4_addr_t gw;
+} esp_netif_ip_info_t;
+
+typedef struct esp_netif_obj esp_netif_t;
+
+typedef enum { IP_EVENT_STA_GOT_IP = 0, IP_EVENT_STA_LOST_IP = 1 } ip_event_t;
+
+typedef struct {
+    esp_netif_t *esp_netif;
+    esp_netif_ip_info_t ip_info;
+    bool ip_changed;
+} ip_event_got_ip_t;
+
+#define esp_ip4_addr_get_byte(a, n) (((const uint8_t *)(&(a)->addr))[n])
+#define IPSTR "%d.%d.%d.%d"
+#define IP2STR(a) esp_ip4_addr_get_byte(a, 0), esp_ip4_addr_get_byte(a, 1), \
+                  esp_ip4_addr_get_byte(a, 2), esp_ip4_addr_get_byte(a, 3)
+
+esp_err_t esp_netif_init(void);
+esp_netif_t *esp_netif_create_default_wifi_sta(void);
@@ -0,0 +1,5 @@
+#pragma once
+#include <stdint.h>
+
+// Microseconds on the RTC clock, which keeps counting across resets
+uint64_t esp_clk_rtc_time(void);
@@ -0,0 +1,14 @@
+#pragma once
+#include <stdint.h>
+#include <time.h>
+
+// The cycle counter; on the host the TSC where there is one, otherwise nanoseconds.
+static inline uint32_t cpu_hal_get_cycle_count(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return (uint32_t)__builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+#endif
+}
@@ -0,0 +1,15 @@
+#pragma once
+#include <stdint.h>
+#include "esp_err.h"
+
+// The interface of IDF's examples/common_components/led_strip
+typedef struct led_strip_s led_strip_t;
+
+struct led_strip_s {
+    esp_err_t (*set_pixel)(led_strip_t *strip, uint32_t index, uint32_t red, uint32_t green, uint32_t blue);
+    esp_err_t (*refresh)(led_strip_t *strip, uint32_t timeout_ms);
+    esp_err_t (*clear)(led_strip_t *strip, uint32_t timeout_ms);
+    esp_err_t (*del)(led_strip_t *strip);
+};
+
+led_strip_t *led_strip_init(uint8_t channel, uint8_t gpio, uint16_t led_num);
@@ -0,0 +1,6 @@
+#pragma once
+// The few configuration values the controller code reads.  The twin's "network" is the
+// loopback interface, so the WIFI credentials don't matter.
+#define CONFIG_EXAMPLE_WIFI_SSID "host"
+#define CONFIG_EXAMPLE_WIFI_PASSWORD ""
+#define CONFIG_FREERTOS_HZ 1000
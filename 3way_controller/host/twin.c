@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "twin.h"
+
+/*
+ * The digital twin:  the whole controller (everything in components/lib, plus main.c) running
+ * as a Linux process.  It binds the real ports, so console.py, the temperature station protocol
+ * and the OTA upload all work against it as they would against the heater.
+ *
+ *     heater_twin [-d state-dir] [-v] [-q]
+ *
+ * Sending the process SIGUSR1 drops the "WIFI" link, to exercise reconnection; the console
+ * "reboot" command (and OTA updates) start it over, keeping its state directory and
+ * RTC memory.
+ */
+
+extern void app_main(void);
+
+static void main_task(void *arg) {
+    app_main();
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-d state-dir] [-v] [-q]\n", name);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    const char *dir = getenv("TWIN_STATE_DIR");
+    int opt;
+    sigset_t signals;
+
+    while ((opt = getopt(argc, argv, "d:vq")) != -1) {
+        switch (opt) {
+            case 'd': dir = optarg; break;
+            case 'v': host_log_level = 4; break;
+            case 'q': host_log_level = 2; break;
+            default: usage(argv[0]);
+        }
+    }
+    host_restart_argv = argv;
+    init_state_dir(dir ? dir : "twin-state");
+    init_rtc_memory();
+    init_ota();
+
+    // Block the signals we handle here before there are any other threads, so they all
+    // inherit that and the signals come to us.
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    xTaskCreate(main_task, "main", 3584, NULL, 1, NULL);
+
+    while (1) {
+        int sig;
+        if (sigwait(&signals, &sig) == 0 && sig == SIGUSR1) {
+            twin_wifi_drop();
+        }
+    }
+}
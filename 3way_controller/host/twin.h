@@ -0,0 +1,13 @@
+#pragma once
+#include <stdint.h>
+
+// The twin's own controls; see devices.c and twin.c
+
+extern const char *state_dir;
+extern char **host_restart_argv;
+
+void init_state_dir(const char *dir);
+void init_ota(void);
+void init_rtc_memory(void);
+void twin_wifi_drop(void);
+uint32_t twin_led_color(void);
@@ -5,7 +5,6 @@
 #include "esp_timer.h"
 #include "nvs.h"
 #include "led_strip.h"
-#include "protocol_examples_common.h"
 #include "libconfig.h"
 #include "libdecls.h"
 
@@ -13,40 +12,121 @@ static const char *TAG = "main";
 const char *version_string = "Smooooth operator";
 nvs_handle_t storage_handle;
 
-void app_main(void)
-{
-    ota_check();
+/*
+ * Boot stages.  Each one starts as soon as the ones it needs are done (see boot.c), so the
+ * heater is under control from the stored schedule and last known temperature without
+ * waiting for WIFI.  Nothing waits for WIFI to actually connect, or boot would never be
+ * complete while the access point is out of reach:  the broadcaster and the time updater
+ * hold off by themselves until the link is up.
+ */
+#define BOOT_STORAGE    0x001
+#define BOOT_SENSORS    0x002
+#define BOOT_STATE      0x004
+#define BOOT_CONTROL    0x008
+#define BOOT_NETIF      0x010
+#define BOOT_WIFI       0x020
+#define BOOT_LISTENERS  0x040
+#define BOOT_BROADCAST  0x080
+#define BOOT_TIME       0x100
+#define BOOT_LED        0x200
 
-    // Set up required system services.  If any of these fail, the code aborts.
+static int start_storage() {
+    // If this fails, the code aborts.
     esp_err_t ret = nvs_flash_init();
     if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
       ESP_ERROR_CHECK(nvs_flash_erase());
       ret = nvs_flash_init();
     }
     ESP_ERROR_CHECK(ret);
+    ESP_ERROR_CHECK(nvs_open("storage", NVS_READWRITE, &storage_handle));
+    return 0;
+}
+
+static int start_sensors() {
+    init_heater_sensor();
+    return 0;
+}
+
+static int start_state() {
+    init_temperature_schedule();
+    // After a reset, carry on from where we were; otherwise start from what NVS has
+    if (restore_warm_state() < 0) {
+        restore_ambient_temperature();
+    }
+    return 0;
+}
+
+static int start_control() {
+    init_longlog();
+    init_history();
+    power_controller_start();
+    return 0;
+}
+
+static int start_netif() {
     ESP_ERROR_CHECK(esp_netif_init());
     ESP_ERROR_CHECK(esp_event_loop_create_default());
+    return 0;
+}
 
-    ESP_ERROR_CHECK(nvs_open("storage", NVS_READWRITE, &storage_handle));
+static void wifi_connect_task(void *arg) {
+    // The connection manager keeps trying (and reconnects later if need be);
+    // we just wait for the first connection.
+    wifi_wait_connected(portMAX_DELAY);
+    report_health(HEALTH_WIFI);
+    vTaskDelete(NULL);
+}
 
-    // Connect to WIFI using the ESP demo code, which seems good enough for us.
-    // If the connect fails, the rest of the code will continue to function
-    // in a default mode.
-    if (example_connect() != ESP_OK) {
-        LOGE(TAG,"Wifi connection failed!");
-    }
+static int start_wifi() {
+    init_wifi();
+    xTaskCreate(wifi_connect_task, "wifi_connect", 2048, NULL, PRIORITY_NETWORK, NULL);
+    return 0;
+}
 
-    LOGI(TAG, "%s", version_string);
+static int start_listeners() {
+    init_perf();
+    init_ambient_listener();
+    init_console();
+    init_telemetry();
+    init_http();
+    return 0;
+}
 
-    // Initialize our code
+static int start_broadcast() {
     init_broadcast_loop();
+    return 0;
+}
+
+static int start_led() {
+    init_status_led();
+    return 0;
+}
+
+static int start_time() {
     init_time();
-    init_temps();
-    init_console();
-    init_temperature_schedule();
+    return 0;
+}
 
-    // ...and go!
-    power_controller_start();
+static const struct boot_stage boot_stages[] = {
+    { "storage",   0,                            BOOT_STORAGE,   start_storage },
+    { "sensors",   0,                            BOOT_SENSORS,   start_sensors },
+    { "state",     BOOT_STORAGE | BOOT_SENSORS,  BOOT_STATE,     start_state },
+    { "control",   BOOT_STATE,                   BOOT_CONTROL,   start_control },
+    { "netif",     0,                            BOOT_NETIF,     start_netif },
+    { "wifi",      BOOT_NETIF | BOOT_STORAGE,    BOOT_WIFI,      start_wifi },
+    { "listeners", BOOT_NETIF | BOOT_STATE,      BOOT_LISTENERS, start_listeners },
+    { "broadcast", BOOT_NETIF,                   BOOT_BROADCAST, start_broadcast },
+    { "time",      BOOT_NETIF,                   BOOT_TIME,      start_time },
+    { "led",       0,                            BOOT_LED,       start_led },
+};
+
+void app_main(void)
+{
+    init_trace();
+    ota_check();
+    LOGI(TAG, "%s", version_string);
+
+    run_boot(boot_stages, sizeof(boot_stages) / sizeof(boot_stages[0]));
 
     LOGI(TAG, "%s", "...Booting complete");
     vTaskDelete(NULL);
@@ -62,20 +142,20 @@ void app_main(void)
  */
 
 
-char *get_psv(const char *key) {
-    size_t len;
+int get_psv(const char *key, char *buf, int len) {
+    size_t size = len;
     int ret;
-    // Getting key without memptr will fill in the length
-    ret = nvs_get_str(storage_handle, key, NULL, &len);
+    ret = nvs_get_str(storage_handle, key, buf, &size);
     if ( ret == ESP_OK ) {
-        char *val = malloc(len);
-        nvs_get_str(storage_handle, key, val, &len);
-        return val;
+        return 0;
+    }
+    else if ( ret == ESP_ERR_NVS_INVALID_LENGTH ) {
+        LOGE(TAG,"Stored psv key (%s) is longer than %d", key, len);
     }
     else if ( ret != ESP_ERR_NVS_NOT_FOUND ) {
         LOGE(TAG,"Fetch psv key (%s) error %d", key, ret);
     }
-    return NULL;
+    return -1;
 }
 
 void set_psv(const char *key, const char *newval) {
@@ -1,8 +1,16 @@
+import os
 import socketserver
 import socket
 import threading
+import itertools
+import hashlib
+import struct
+import zlib
+import time
+import queue
 from pathlib import Path
 from datetime import datetime
+import ota_pack
 
 # ####################################################################
 # Listen for messages coming from either the heater or the temperature station,
@@ -17,10 +25,13 @@ heater_broadcast_port = 3341
 ota_port = 3343
 
 # TODO: listen for the heater's broadcast and remember its address instead of braodcasting?
-heater_ip = '10.0.0.255'
+# (HEATER_IP=127.0.0.1 talks to the digital twin; see 3way_controller/host)
+heater_ip = os.environ.get("HEATER_IP", '10.0.0.255')
 
-currdir = Path(__file__).parent
-heaterbinary = currdir/"3way_controller/build/3way_controller.bin"
+heaterbinary = ota_pack.heaterbinary
+
+# Copies of every image we have sent, named by image id, so we can send patches against them
+ota_cache = Path(__file__).parent/".ota_cache"
 
 # Listener
 class MyUDPHandler(socketserver.BaseRequestHandler):
@@ -30,26 +41,403 @@ class MyUDPHandler(socketserver.BaseRequestHandler):
         print(". ", end="", flush=True)
 
 def monitor_port(portno):
-    with socketserver.UDPServer(("", portno), MyUDPHandler) as server:
+    try:
+        server = socketserver.UDPServer(("", portno), MyUDPHandler)
+    except OSError as e:
+        # e.g. the digital twin is running on this machine, and has the port
+        print(f"Not monitoring port {portno}: {e}")
+        return
+    with server:
         server.serve_forever()
 
+# Replies to our commands come straight back to the socket we sent them from,
+# tagged with the request id we sent.
+request_ids = itertools.count(1)
+# Replies that someone is waiting for, by request id, instead of printing them
+pending = {}
+
+# sync with 3way_controller/components/lib/snapshot.c
+# Temperatures are centidegrees, except max_heater and bump_temp, which are whole degrees.
+snapshot_format = struct.Struct("<4sBBBBhhhhhIIIIIIIIHHH")
+snapshot_fields = ["magic", "version", "power_level", "power_override", "flags",
+                   "ambient", "heater", "desired", "max_heater", "bump_temp",
+                   "bump_remaining", "uptime", "time", "errors", "new_errors", "dropped_messages",
+                   "free_heap", "min_free_heap", "stack_control", "stack_console", "stack_broadcast"]
+power_levels = ["off", "low", "medium", "high", "auto"]
+
+def temp(centidegrees):
+    return "unknown" if centidegrees <= -10000 else f"{centidegrees/100:.2f}C"
+
+def decode_snapshot(payload):
+    """Pretty-print a binary state snapshot"""
+    if len(payload) != snapshot_format.size:
+        return f"snapshot of unexpected length {len(payload)} (version {payload[4]})"
+    s = dict(zip(snapshot_fields, snapshot_format.unpack(payload)))
+    bump = f"{s['bump_temp']}C for {s['bump_remaining']//60} min" if s['flags'] & 1 else "none"
+    clock = time.strftime("%c", time.localtime(s['time'])) if s['flags'] & 2 else "not set"
+    return "\n".join([
+        f"snapshot v{s['version']}, clock {clock}, up {s['uptime']//3600}:{s['uptime']//60%60:02}",
+        f"  ambient {temp(s['ambient'])}, desired {temp(s['desired'])}, heater {temp(s['heater'])} (max {s['max_heater']}C)",
+        f"  level {power_levels[s['power_level']]}, override {power_levels[s['power_override']]}, bump {bump}",
+        f"  errors {s['errors']} ({s['new_errors']} new), dropped messages {s['dropped_messages']}",
+        f"  heap {s['free_heap']} free (min {s['min_free_heap']}), unused stack: control {s['stack_control']},"
+        f" console {s['stack_console']}, broadcast {s['stack_broadcast']}"])
+
+# Telemetry frames; sync with 3way_controller/components/lib/telemetry.c
+telemetry_names = ["ambient", "heater", "desired", "level", "slope"]
+telemetry_state = {}   # per sender: (expected sequence number, values)
+
+def decode_telemetry(addr, frame):
+    ftype, mask = chr(frame[2]), frame[3]
+    seq, = struct.unpack_from("<H", frame, 4)
+    names = [n for i, n in enumerate(telemetry_names) if mask & (1 << i)]
+    if ftype == 'F':
+        stamp, = struct.unpack_from("<I", frame, 6)
+        values = list(struct.unpack_from(f"<{len(names)}h", frame, 10))
+    else:
+        expected, values = telemetry_state.get(addr, (None, None))
+        if seq != expected or values is None or len(values) != len(names):
+            telemetry_state[addr] = (None, None)
+            return None   # lost a frame; wait for the next full one
+        deltas = struct.unpack_from(f"<{len(names)}b", frame, 8)
+        values = [v + d for v, d in zip(values, deltas)]
+    telemetry_state[addr] = ((seq + 1) & 0xffff, values)
+    shown = []
+    for n, v in zip(names, values):
+        if n == "level":
+            shown.append(f"level {power_levels[v]}")
+        elif n == "slope":
+            shown.append(f"slope {v/100:+.2f}C/h")
+        else:
+            shown.append(f"{n} {temp(v)}")
+    return ", ".join(shown)
+
+def monitor_replies(sock):
+    while True:
+        data, addr = sock.recvfrom(2048)
+        # split off the request id, if any
+        reqid, payload = b"", data
+        if data.startswith(b"#"):
+            reqid, _, payload = data.partition(b" ")
+            if reqid in pending:
+                pending[reqid].put(payload)
+                continue
+            reqid += b" "
+        if payload.startswith(b"HCSN"):
+            text = decode_snapshot(payload)
+        elif payload.startswith(b"HT"):
+            text = decode_telemetry(addr, payload)
+            if text is None:
+                continue
+            print(f"{datetime.now():%X}: {addr[0]} telemetry: {text}")
+            continue
+        else:
+            text = payload.decode(errors='replace').strip()
+        print(f"{datetime.now():%X}: {addr[0]} replied: {reqid.decode()}{text}")
+        print(". ", end="", flush=True)
+
+# Keep a telemetry subscription alive until told to stop
+watching = threading.Event()
+
+def renew_subscription(sock, cmd):
+    while watching.is_set():
+        sock.sendto(cmd.encode(), (heater_ip, heater_control_port))
+        time.sleep(20)   # well within the heater's TELEMETRY_LEASE
+
+def send_command(sock, cmd):
+    """Send a command to the heater, tagged with a new request id"""
+    outcommand = f"#{next(request_ids)} {cmd}"
+    sock.sendto(outcommand.encode(), (heater_ip, heater_control_port))
+    print(f"sent {outcommand}")
+
+def ask(sock, cmd, timeout=5):
+    """Send a command and collect its reply lines.  Returns (ok, lines); ok is None if
+    the heater didn't finish replying within timeout seconds."""
+    reqid = f"#{next(request_ids)}"
+    replies = pending[reqid.encode()] = queue.Queue()
+    lines = []
+    try:
+        sock.sendto(f"{reqid} {cmd}".encode(), (heater_ip, heater_control_port))
+        while True:
+            line = replies.get(timeout=timeout).decode(errors='replace').strip()
+            if line in ("ok", "err"):
+                return line == "ok", lines
+            lines.append(line)
+    except queue.Empty:
+        return None, lines
+    finally:
+        del pending[reqid.encode()]
+
 # uploader
-def start_upload(path: Path):
-    """Prepare connection and send file contents"""
+def start_upload(contents: bytes, done: threading.Event):
+    """Serve file contents to the heater.  Each connection starts with the heater asking
+    for the offset it wants (a decimal number and a newline), so that it can resume an
+    interrupted download.  We keep serving until done is set, or no one connects for a minute."""
     sender = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sender.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
     sender.bind(('', ota_port))
+    sender.settimeout(1)
     sender.listen()
+    idle_since = time.monotonic()
     with sender:
-        conn, _ = sender.accept()
-        print("Upload connection accepted.\n. ")
-        with conn:
-            with open(str(path), mode='rb') as f:
+        while not done.is_set():
+            try:
+                conn, _ = sender.accept()
+            except socket.timeout:
+                if time.monotonic() - idle_since > 60:
+                    print("Heater stopped asking for the upload.\n. ")
+                    return
+                continue
+            with conn:
                 try:
-                    conn.sendfile(f)
-                except ConnectionResetError:
-                    # this happens when the device reboots.
+                    conn.settimeout(30)
+                    request = b""
+                    while not request.endswith(b"\n"):
+                        data = conn.recv(16)
+                        if not data:
+                            raise ConnectionResetError
+                        request += data
+                    offset = int(request)
+                    print(f"Upload connection accepted, sending from {offset}.\n. ")
+                    conn.sendall(contents[offset:])
+                    print("Upload sent.\n. ")
+                except (ConnectionError, socket.timeout, ValueError):
+                    # this happens when the device reboots, or the link drops (it will reconnect)
                     pass
-                print("Upload completed.\n. ")
+            idle_since = time.monotonic()
+
+def running_image(sock):
+    """Return the bytes of the image the heater is running, if we have a copy of it"""
+    ok, lines = ask(sock, "imagehash")
+    for line in lines if ok else []:
+        if line.startswith("image "):
+            cached = ota_cache/f"{line.split()[1]}.bin"
+            if cached.exists():
+                return cached.read_bytes()
+    return None
+
+def upload(sock, image: bytes, mode: str):
+    """Update the heater to image.  By default we send a patch against the image it is
+    running, if we have that image and the patch is smaller; if the heater refuses the
+    patch, we fall back to sending the whole image."""
+    ota_cache.mkdir(exist_ok=True)
+    (ota_cache/f"{ota_pack.image_id(image)}.bin").write_bytes(image)
+
+    attempts = []
+    if mode == "raw":
+        attempts.append(("raw", image))
+    else:
+        full = ota_pack.pack(image)
+        source = running_image(sock) if mode != "full" else None
+        if source is not None and source != image:
+            patch = ota_pack.pack(image, source=source)
+            if len(patch) < len(full):
+                attempts.append(("patch", patch))
+        attempts.append(("full", full))
+
+    # warning: this next line will not work on some unix systems.
+    # in that case, replace with the code indicated here: https://stackoverflow.com/a/28950776
+    myip = socket.gethostbyname(socket.gethostname())
+    sha = hashlib.sha256(image).hexdigest()
+    for kind, contents in attempts:
+        print(f"Sending {kind} image, {len(contents)} bytes\n. ")
+        done = threading.Event()
+        t3 = threading.Thread(target=start_upload, args=(contents, done), daemon=True)
+        t3.start()
+        # The heater only replies if the update failed; on success it reboots.
+        ok, lines = ask(sock, f"update {myip} {len(contents)} {sha}", timeout=300)
+        done.set()
+        t3.join()
+        for line in lines:
+            print(f"{datetime.now():%X}: heater replied: {line}")
+        if ok is not False:
+            return
+        print(f"Heater refused the {kind} image.\n. ")
+
+# sync with 3way_controller/components/lib/trace.c
+trace_chunk_format = struct.Struct("<4sBBHII")
+
+def fetch_trace(sock, path):
+    """Fetch the heater's event trace into path, for host/replay.  The heater sends a few
+    chunks per request, so we keep asking from where we got to until we've caught up."""
+    records = {}
+    want = 0
+    for attempt in range(100):
+        reqid = f"#{next(request_ids)}".encode()
+        replies = pending[reqid] = queue.Queue()
+        latest = oldest = None
+        try:
+            sock.sendto(reqid + f" trace {want}".encode(), (heater_ip, heater_control_port))
+            while True:
+                payload = replies.get(timeout=5)
+                if not payload.startswith(b"HCTR"):
+                    break   # ok or err
+                _, version, count, size, first, latest = trace_chunk_format.unpack_from(payload)
+                oldest = first if oldest is None else min(oldest, first)
+                for i in range(count):
+                    offset = trace_chunk_format.size + i * size
+                    records[first + i] = payload[offset:offset + size]
+        except queue.Empty:
+            pass
+        finally:
+            del pending[reqid]
+        if latest is None:
+            continue
+        if want not in records and oldest > want:
+            want = oldest       # those have been overwritten already
+        while want in records:
+            want += 1
+        if want >= latest:
+            break
+    Path(path).write_bytes(b"".join(records[k] for k in sorted(records)))
+    print(f"{len(records)} trace records written to {path}")
+
+# sync with 3way_controller/components/lib/history.c
+history_version = 2
+history_header_format = struct.Struct("<4sBBHII")
+history_keyframe_format = struct.Struct("<IhhhB")
+
+def decode_history_block(data):
+    """Yield (minute, ambient, desired, heater, state) for each record in a history block.
+    The heater keeps temperatures in tenths of a degree; we give them back in hundredths,
+    like everything else."""
+    minute, ambient, desired, heater, state = history_keyframe_format.unpack_from(data)
+    yield minute, ambient * 10, desired * 10, heater * 10, state
+    i = history_keyframe_format.size
+    while i < len(data):
+        header = data[i]
+        i += 1
+        if not header & 0x80:
+            # small changes to the temperatures, and nothing else:  signed 3 and 4 bit fields
+            ambient += (header & 7) - 8 if header & 4 else header & 7
+            heater += ((header >> 3) & 15) - 16 if header & 0x40 else (header >> 3) & 15
+            minute += 1
+            yield minute, ambient * 10, desired * 10, heater * 10, state
+            continue
+        deltas = []
+        for code in (header & 3, (header >> 2) & 3):
+            if code == 1:
+                deltas.append(struct.unpack_from("<b", data, i)[0])
+                i += 1
+            elif code == 2:
+                deltas.append(struct.unpack_from("<h", data, i)[0])
+                i += 2
+            else:
+                deltas.append(0)
+        ambient += deltas[0]
+        heater += deltas[1]
+        if header & 0x10:
+            desired += struct.unpack_from("<h", data, i)[0]
+            i += 2
+        if header & 0x20:
+            state = data[i]
+            i += 1
+        minute += 1
+        yield minute, ambient * 10, desired * 10, heater * 10, state
+
+def fetch_history(sock, minutes, path=None):
+    """Fetch the last so many minutes of the heater's history, and print it or write it to
+    path as CSV.  The heater sends a few blocks per request, so we keep asking from where
+    we got to until we've caught up."""
+    rows = {}
+    want = -minutes
+    now_minute = now_time = None
+    for attempt in range(100):
+        reqid = f"#{next(request_ids)}".encode()
+        replies = pending[reqid] = queue.Queue()
+        got = False
+        try:
+            sock.sendto(reqid + f" history {want}".encode(), (heater_ip, heater_control_port))
+            while True:
+                payload = replies.get(timeout=5)
+                if not payload.startswith(b"HCHI"):
+                    break   # ok, err or nothing there
+                _, version, _, length, now_minute, now_time = history_header_format.unpack_from(payload)
+                if version != history_version:
+                    print(f"History is version {version}; this console.py knows version {history_version}")
+                    return
+                block = payload[history_header_format.size:history_header_format.size + length]
+                for row in decode_history_block(block):
+                    rows[row[0]] = row
+                got = True
+        except queue.Empty:
+            pass
+        finally:
+            del pending[reqid]
+        if not got:
+            break
+        if want < 0:
+            want += now_minute
+        want = max(want, max(rows) + 1)
+        if want >= now_minute:
+            break
+    if not rows:
+        print("No history")
+        return
+    now_time = now_time or int(time.time())
+    out = open(path, "w") if path else None
+    print("time,minute,ambient,desired,heater,level,assigned,bump", file=out)
+    for minute in sorted(rows):
+        if minute < now_minute - minutes:
+            continue
+        _, ambient, desired, heater, state = rows[minute]
+        when = datetime.fromtimestamp(now_time - (now_minute - minute) * 60)
+        assigned = (state >> 3) & 7
+        print(f"{when:%Y-%m-%d %H:%M},{minute},{temp(ambient)},{temp(desired)},{temp(heater)},"
+              f"{power_levels[state & 7]},{power_levels[assigned] if assigned != 4 else ''},"
+              f"{'bump' if state & 0x40 else ''}", file=out)
+    if out:
+        out.close()
+        print(f"{len(rows)} minutes of history written to {path}")
+
+# sync with 3way_controller/components/lib/longlog.c
+longlog_chunk_format = struct.Struct("<4sBBHII")
+longlog_record_format = struct.Struct("<IIHhhh4HHBBI")
+
+def fetch_longlog(sock, hours, path=None):
+    """Fetch the last so many hourly summaries from the heater's long-term log, and print them
+    or write them to path as CSV.  As with the trace, we keep asking from where we got to."""
+    records = {}
+    want = -hours
+    for attempt in range(1000):
+        reqid = f"#{next(request_ids)}".encode()
+        replies = pending[reqid] = queue.Queue()
+        latest = None
+        try:
+            sock.sendto(reqid + f" longlog {want}".encode(), (heater_ip, heater_control_port))
+            while True:
+                payload = replies.get(timeout=5)
+                if not payload.startswith(b"HCLL"):
+                    break   # ok, err, or no log
+                _, version, count, size, first, latest = longlog_chunk_format.unpack_from(payload)
+                for i in range(count):
+                    offset = longlog_chunk_format.size + i * size
+                    records[first + i] = payload[offset:offset + size]
+                want = first + count
+        except queue.Empty:
+            pass
+        finally:
+            del pending[reqid]
+        if latest is None or want >= latest:
+            break
+    out = open(path, "w") if path else None
+    print("start,uptime,hours,ambient_min,ambient_max,ambient_mean,hours_off,hours_low,hours_medium,"
+          "hours_high,toggles,overheats,boot", file=out)
+    good = 0
+    for n in sorted(records):
+        rec = records[n]
+        fields = longlog_record_format.unpack(rec)
+        if zlib.crc32(rec[:-4]) != fields[-1]:
+            continue    # half written when the heater went down
+        start, uptime, seconds, amin, amax, amean, *levels, toggles, overheats, flags, _ = fields
+        when = f"{datetime.fromtimestamp(start):%Y-%m-%d %H:%M}" if start else ""
+        print(f"{when},{uptime},{seconds/3600:.2f},{temp(amin)},{temp(amax)},{temp(amean)},"
+              + ",".join(f"{l/3600:.2f}" for l in levels)
+              + f",{toggles},{overheats},{'boot' if flags & 1 else ''}", file=out)
+        good += 1
+    if out:
+        out.close()
+        print(f"{good} hourly summaries written to {path}")
 
 
 if __name__ == "__main__":
@@ -61,6 +449,10 @@ if __name__ == "__main__":
 
     # channel we use to send commands to the heater
     broadcaster = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    broadcaster.setsockopt(socket.SOL_SOCKET, socket.SO_BROADCAST, 1)
+    broadcaster.bind(('', 0))
+    t4 = threading.Thread(target=monitor_replies, args=(broadcaster,), daemon=True)
+    t4.start()
 
     while(1):
         cmd = input(". ")
@@ -75,11 +467,31 @@ if __name__ == "__main__":
             maxheat n: set the maximum heater temperature to n, where 60 <= n <= 100.
             schedule <n>,<n>...:  set an hourly schedule for desired temps.  If the
                   schedule is less than 24 hours long, the last value is repeated.
-            update: upgrade to the current version in the build directory
+            update [full|raw]: upgrade to the current version in the build directory.  We send a
+                  compressed patch against the running image if we have a copy of it, else the
+                  whole image compressed.  full skips the patch; raw sends the image as it is.
+            imagehash: show the id of the running image
             reboot: tell the heater to reboot itself
             report: list useful info
+            jitter: show how late control loop passes start, and how long they take
+            perf: show cpu and stack use by task, heap and message queue usage
+            wifi: show the state of the WIFI connection
+            boot: show when each stage of startup started and finished
+            snapshot: fetch all the controller state at once (compact)
+            history [minutes] [file]: show the last so many minutes (default 60) of ambient,
+                  desired and heater temperatures and power levels, or write them to file as CSV
+            longlog [hours] [file]: show the last so many hourly summaries (default 24) from the
+                  long-term log in flash (ambient range, time at each level, relay switchings,
+                  overheating), or write them to file as CSV
+            trace [file]: fetch the recent event trace into file (default trace.bin); replay
+                  it with 3way_controller/host's replay
+            watch [mask] [period]: stream live values every period ms (default 1000).  mask selects
+                  1=ambient 2=heater 4=desired 8=level 16=slope (default all)
+            unwatch: stop streaming
             time_update: fetch the current time/tz
             errtest: generate a bunch of errors for testing purposes.
+            help: list the commands the heater itself knows about
+            Several commands can be sent at once, separated by ';'
             """)
         elif cmd.startswith("up"):
             # Currently hardwiring the path.  If we need to handle multiple binaries, will have to modify.
@@ -87,17 +499,29 @@ if __name__ == "__main__":
             if not fp.exists():
                 print(f"File {fp} doesn't seem to exist")
             else:
-                filelen = fp.stat().st_size
-                t3 = threading.Thread(target=start_upload, args=(fp,), daemon=True)
-                t3.start()
-
-                # warning: this next line will not work on some unix systems.
-                # in that case, replace with the code indicated here: https://stackoverflow.com/a/28950776
-                myip = socket.gethostbyname(socket.gethostname())
-                outcommand = f"update {myip} {filelen}"
-                broadcaster.sendto(outcommand.encode(), (heater_ip, heater_control_port))
-                print(f"sent {outcommand}")
+                mode = cmd.split()[1] if len(cmd.split()) > 1 else "auto"
+                threading.Thread(target=upload, args=(broadcaster, fp.read_bytes(), mode), daemon=True).start()
+        elif cmd.startswith("watch"):
+            args = cmd.split()[1:]
+            mask = args[0] if len(args) > 0 else "31"
+            period = args[1] if len(args) > 1 else "1000"
+            if not watching.is_set():
+                watching.set()
+                t5 = threading.Thread(target=renew_subscription, daemon=True,
+                                      args=(broadcaster, f"subscribe {mask} {period}"))
+                t5.start()
+        elif cmd.startswith("history"):
+            args = cmd.split()[1:]
+            fetch_history(broadcaster, int(args[0]) if args else 60, args[1] if len(args) > 1 else None)
+        elif cmd.startswith("longlog"):
+            args = cmd.split()[1:]
+            fetch_longlog(broadcaster, int(args[0]) if args else 24, args[1] if len(args) > 1 else None)
+        elif cmd.startswith("trace"):
+            args = cmd.split()[1:]
+            fetch_trace(broadcaster, args[0] if args else "trace.bin")
+        elif cmd.startswith("unwatch"):
+            watching.clear()
+            send_command(broadcaster, "unsubscribe")
         else:
-            broadcaster.sendto(cmd.encode(), (heater_ip, heater_control_port))
-            print(f"sent {cmd}")
+            send_command(broadcaster, cmd)
  
@@ -0,0 +1,206 @@
+import argparse
+import hashlib
+import struct
+import sys
+import zlib
+from pathlib import Path
+
+# ####################################################################
+# Pack a heater controller image for OTA update:  a small header followed by
+# the image, compressed so it can be inflated on the device in a small window.
+#
+# The format is described in 3way_controller/components/lib/ota_image.c;
+# keep the two in sync.
+######################################################################
+
+magic = b"HCOT"
+version = 1
+flag_deflate = 0x01
+flag_delta = 0x02
+
+delta_magic = b"HCDL"
+delta_block = 32       # shortest exact match we look for
+delta_index_step = 8   # how often we index the source
+
+# sync with OTA_INFLATE_WINDOW in 3way_controller/components/lib/include/libconfig.h
+window_bits = 13   # 8192 bytes
+
+header_format = struct.Struct("<4sBBHII32s")
+
+currdir = Path(__file__).parent
+heaterbinary = currdir/"3way_controller/build/3way_controller.bin"
+
+
+def extend_match(source: bytes, spos: int, target: bytes, tpos: int) -> int:
+    """Return how far to extend a match forward, allowing for scattered differences
+    (the way bsdiff does):  the length that maximizes 2*matches - length."""
+    best_len = best_score = score = 0
+    length = 0
+    limit = min(len(source) - spos, len(target) - tpos)
+    while length < limit:
+        # skip quickly over long exact runs
+        step = 256
+        while length + step <= limit and source[spos+length:spos+length+step] == target[tpos+length:tpos+length+step]:
+            length += step
+            score += step
+        if length + step <= limit:
+            score += 1 if source[spos+length] == target[tpos+length] else -1
+            length += 1
+        else:
+            for i in range(length, limit):
+                score += 1 if source[spos+i] == target[tpos+i] else -1
+                if score > best_score:
+                    best_score, best_len = score, i + 1
+            break
+        if score > best_score:
+            best_score, best_len = score, length
+        elif length - best_len > 64:
+            break   # too many differences; this match has run out
+    return best_len
+
+
+def make_delta(source: bytes, target: bytes) -> bytes:
+    """Return a patch that turns source into target (see ota_image.c for the format)"""
+    index = {}
+    for j in range(0, len(source) - delta_block + 1, delta_index_step):
+        index.setdefault(source[j:j+delta_block], j)
+
+    out = [delta_magic, struct.pack("<I", len(source)), hashlib.sha256(source).digest()]
+    insert_start = i = 0
+    while i <= len(target) - delta_block:
+        j = index.get(target[i:i+delta_block])
+        if j is None:
+            i += 1
+            continue
+        # extend the match backwards over what we were about to insert
+        while i > insert_start and j > 0 and target[i-1] == source[j-1]:
+            i, j = i - 1, j - 1
+        if i > insert_start:
+            out += [b"I", struct.pack("<I", i - insert_start), target[insert_start:i]]
+        length = extend_match(source, j, target, i)
+        diff = bytes((t - s) & 0xff for s, t in zip(source[j:j+length], target[i:i+length]))
+        out += [b"A", struct.pack("<II", j, length), diff]
+        i += length
+        insert_start = i
+    if insert_start < len(target):
+        out += [b"I", struct.pack("<I", len(target) - insert_start), target[insert_start:]]
+    out.append(b"E")
+    return b"".join(out)
+
+
+def apply_delta(source: bytes, patch: bytes) -> bytes:
+    """Apply a patch made by make_delta, the same way the device does"""
+    if patch[:4] != delta_magic:
+        raise ValueError("patch has a bad header")
+    source_len, = struct.unpack_from("<I", patch, 4)
+    if source_len != len(source) or patch[8:40] != hashlib.sha256(source).digest():
+        raise ValueError("patch does not apply to this source")
+    out = bytearray()
+    pos = 40
+    while True:
+        op = patch[pos:pos+1]
+        if op == b"A":
+            offset, length = struct.unpack_from("<II", patch, pos + 1)
+            pos += 9
+            if offset + length > len(source):
+                raise ValueError("patch refers outside of the source")
+            out += bytes((s + d) & 0xff for s, d in zip(source[offset:offset+length], patch[pos:pos+length]))
+            pos += length
+        elif op == b"I":
+            length, = struct.unpack_from("<I", patch, pos + 1)
+            pos += 5
+            out += patch[pos:pos+length]
+            pos += length
+        elif op == b"E":
+            if pos + 1 != len(patch):
+                raise ValueError("data after the end of the patch")
+            return bytes(out)
+        else:
+            raise ValueError(f"unknown patch operation {op}")
+
+
+def image_id(image: bytes) -> str:
+    """How the device identifies an image:  by the sha256 the build appends to it"""
+    return image[-32:].hex()
+
+
+def pack(image: bytes, compress=True, source: bytes = None) -> bytes:
+    """Return the packed form of image.  If source is given, the result is a patch
+    against source rather than the whole image."""
+    flags = 0
+    payload = image
+    if source is not None:
+        payload = make_delta(source, image)
+        flags |= flag_delta
+    if compress:
+        # negative window bits gives us a raw deflate stream, with no zlib header
+        compressor = zlib.compressobj(9, zlib.DEFLATED, -window_bits, 9)
+        payload = compressor.compress(payload) + compressor.flush()
+        flags |= flag_deflate
+    header = header_format.pack(magic, version, flags, header_format.size,
+                                len(payload), len(image), hashlib.sha256(image).digest())
+    return header + payload
+
+
+def unpack(packed: bytes, source: bytes = None) -> bytes:
+    """Recover the image from its packed form, the same way the device does.
+    Patches need the source they were made against."""
+    m, v, flags, hlen, payload_len, image_len, sha = header_format.unpack_from(packed)
+    if m != magic or v != version or hlen != header_format.size:
+        raise ValueError("not a packed image (or an unsupported version)")
+    payload = packed[hlen:]
+    if len(payload) != payload_len:
+        raise ValueError(f"payload is {len(payload)} bytes, header says {payload_len}")
+    if flags & flag_deflate:
+        # Using the device's window size makes sure the stream never reaches back further
+        # than the device can.
+        inflater = zlib.decompressobj(-window_bits)
+        payload = inflater.decompress(payload) + inflater.flush()
+        if not inflater.eof or inflater.unused_data:
+            raise ValueError("compressed stream is incomplete or has trailing data")
+    if flags & flag_delta:
+        if source is None:
+            raise ValueError("this is a patch; need the image it was made against")
+        image = apply_delta(source, payload)
+    else:
+        image = payload
+    if len(image) != image_len or hashlib.sha256(image).digest() != sha:
+        raise ValueError("image does not match its length or hash")
+    return image
+
+
+def check(path: Path, source_path: Path = None):
+    """Round-trip an image through pack and unpack, and report how much we saved"""
+    image = path.read_bytes()
+    source = source_path.read_bytes() if source_path else None
+    packed = pack(image, source=source)
+    if unpack(packed, source) != image:
+        raise ValueError("round trip did not reproduce the image")
+    against = f" as a patch against {source_path}" if source_path else ""
+    print(f"{path}: {len(image)} bytes packs to {len(packed)}{against} "
+          f"({100*len(packed)/len(image):.0f}%), round trip ok")
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Pack a heater controller image for OTA update")
+    parser.add_argument("image", nargs="?", type=Path, default=heaterbinary,
+                        help="application image (default: the current build)")
+    parser.add_argument("-o", "--output", type=Path, help="where to write the packed image")
+    parser.add_argument("--store", action="store_true", help="don't compress")
+    parser.add_argument("--delta-from", type=Path, metavar="OLD_IMAGE",
+                        help="make a patch against this (running) image instead of sending the whole image")
+    parser.add_argument("--check", action="store_true",
+                        help="check that the image survives packing and unpacking")
+    args = parser.parse_args()
+
+    if args.check:
+        try:
+            check(args.image, args.delta_from)
+        except ValueError as e:
+            sys.exit(f"{args.image}: {e}")
+    else:
+        source = args.delta_from.read_bytes() if args.delta_from else None
+        packed = pack(args.image.read_bytes(), compress=not args.store, source=source)
+        output = args.output or args.image.with_suffix(".ota")
+        output.write_bytes(packed)
+        print(f"wrote {output} ({len(packed)} bytes)")